@@ -64,4 +64,22 @@ int main()
   SolveODE_RK(tend, steps, y, rhs, A_rad, b_rad,
               [&ost2](double t, VectorView<double> y) { ost2 << t << "  " << y(0) << " " << y(1) << "\n"; });
   ost2.close();
+
+  y(0) = 1; y(1) = 0;
+  std::ofstream ost3;
+  ost3.open ("C:/ESC/ASC-ODE/ASC-ODE/py_tests/output_sdirk.txt");
+  SolveODE_SDIRK(tend, steps, y, rhs, SDIRK3(),
+                 [&ost3](double t, VectorView<double> y) { ost3 << t << "  " << y(0) << " " << y(1) << "\n"; });
+  ost3.close();
+
+  // Radau IIA with 3 stages and step size control
+  y(0) = 1; y(1) = 0;
+  std::ofstream ost4;
+  ost4.open ("C:/ESC/ASC-ODE/ASC-ODE/py_tests/output_radau.txt");
+  AdaptiveOptions opts;
+  opts.rtol = 1e-8;
+  auto stat = SolveODE_Radau(tend, y, rhs, 3, opts,
+                             [&ost4](double t, VectorView<double> y) { ost4 << t << "  " << y(0) << " " << y(1) << "\n"; });
+  ost4.close();
+  std::cout << "Radau IIA: " << stat << std::endl;
 }
@@ -2,6 +2,7 @@
 #include <cmath>          //has to be the FIRST include, otherwise does not work!
 #include <nonlinfunc.h>
 #include <ode.h>
+#include <autodiff.h>
 
 
 using namespace ASC_ode;
@@ -10,31 +11,18 @@ using namespace ASC_ode;
 
 // Lagrange = -f*y + lam*(x*x+y*y-1)
 // dLagrange
-class dLagrange : public NonlinearFunction
+class dLagrange
 {
-  size_t DimX() const override { return 3; }
-  size_t DimF() const override { return 3; }
+public:
+  size_t DimX() const { return 3; }
+  size_t DimF() const { return 3; }
   
-  void Evaluate (ASC_bla::VectorView<double> x, ASC_bla::VectorView<double> f) const override
+  template <typename T>
+  void Evaluate (ADVectorView<T> x, ADVectorView<T> f) const
   {
     f(0) = 2*x(0)*x(2);
     f(1) = 2*x(1)*x(2) - 1;
     f(2) = x(0)*x(0)+x(1)*x(1)-1;
-    
-  }
-  void EvaluateDeriv (ASC_bla::VectorView<double> x, ASC_bla::MatrixView<double, ColMajor> df) const override
-  {
-    df(0,0) = 2*x(2);
-    df(0,1) = 0;
-    df(0,2) = 2*x(0);
-
-    df(1,0) = 0;
-    df(1,1) = 2*x(2);
-    df(1,2) = 2*x(1);
-
-    df(2,0) = 2*x(0);
-    df(2,1) = 2*x(1);
-    df(2,2) = 0;
   }
 };
 
@@ -46,7 +34,7 @@ int main()
   Vector<double> x { 1, 0, 0, };
   Vector<double> dx { 0, 0, 0 };
   Vector<double> ddx { 0, 0, 0 };
-  auto rhs = std::make_shared<dLagrange>();
+  auto rhs = std::make_shared<AutoDiffFunction<dLagrange>>();
   auto mass = std::make_shared<Projector>(3, 0, 2);
   std::ofstream ost;
   ost.open ("../py_tests/output_alpha.txt");
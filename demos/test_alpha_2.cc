@@ -2,6 +2,7 @@
 #include <cmath>          //has to be the FIRST include, otherwise does not work!
 #include <nonlinfunc.h>
 #include <ode.h>
+#include <autodiff.h>
 
 
 using namespace ASC_ode;
@@ -10,12 +11,15 @@ using namespace ASC_ode;
 
 // Lagrange = -mg*x(1) - mg*x(3) + x(4) * (x(0)^2 + x(1)^2 - 1) + x(5) * ((x(0) - x(2))^2 + (x(1)-x(3))^2 - 1)
 // dLagrange
-class dLagrange : public NonlinearFunction
+class dLagrange
 {
-  size_t DimX() const override { return 6; }
-  size_t DimF() const override { return 6; }
+public:
+  size_t DimX() const { return 6; }
+  size_t DimF() const { return 6; }
   
-  void Evaluate (ASC_bla::VectorView<double> x, ASC_bla::VectorView<double> f) const override
+  // the Jacobian is generated by AutoDiffFunction
+  template <typename T>
+  void Evaluate (ADVectorView<T> x, ADVectorView<T> f) const
   {
     f(0) = 2*x(0)*x(4) + 2*x(5)*(x(0)-x(2));
     f(1) = - 1 + 2 * x(4) * x(1) + 2* x(5) * (x(1) - x(3));
@@ -24,45 +28,6 @@ class dLagrange : public NonlinearFunction
     f(4) = x(0)*x(0) + x(1)*x(1) - 1;
     f(5) = (x(0) - x(2))*(x(0) - x(2)) + (x(1)-x(3))*(x(1)-x(3)) - 1;    
   }
-  void EvaluateDeriv (ASC_bla::VectorView<double> x, ASC_bla::MatrixView<double, ColMajor> df) const override
-  {
-    df(0,0) = 2*x(4) + 2*x(5);
-    df(0,1) = 0;
-    df(1,0) = 0;
-    df(0,2) = -2*x(5);
-    df(2,0) = -2*x(5);
-    df(3,0) = 0;
-    df(0,3) = 0;
-    df(0,4) = 2*x(0);
-    df(4,0) = 2*x(0);
-    df(5,0) = 2*(x(0)-x(2));
-    df(0,5) = 2*(x(0)-x(2));
-    df(1,1) = 2*x(4) + 2*x(5);
-    df(1,2) = 0;
-    df(2,1) = 0;
-    df(1,3) = -2*x(5);
-    df(3,1) = -2*x(5);
-    df(1,4) = 2*x(1);
-    df(4,1) = 2*x(1);
-    df(1,5) = 2*(x(1) - x(3));
-    df(5,1) = 2*(x(1) - x(3));
-    df(2,2) = x(5)*2;
-    df(2,3) = 0;
-    df(3,2) = 0;
-    df(2,4) = 0;
-    df(4,2) = 0;
-    df(2,5) = -2*(x(0) - x(2));
-    df(5,2) = -2*(x(0) - x(2));
-    df(3,3) = 2*x(5);
-    df(3,4) = 0;
-    df(4,3) = 0;
-    df(5,3) = -2*(x(1)-x(3));
-    df(3,5) = -2*(x(1)-x(3));
-    df(4,4) = 0;
-    df(4,5) = 0;
-    df(5,4) = 0;
-    df(5,5) = 0;
-  }
 };
 
 
@@ -73,7 +38,7 @@ int main()
   Vector<double> x { 1, 0, 1, -1, 0, 0 };
   Vector<double> dx { 0, 0, 0, 0, 0, 0 };
   Vector<double> ddx { 0, 0, 0, 0, 0, 0 };
-  auto rhs = std::make_shared<dLagrange>();
+  auto rhs = std::make_shared<AutoDiffFunction<dLagrange>>();
   auto mass = std::make_shared<Projector>(6, 0, 4);
   std::ofstream ost;
   ost.open ("../py_tests/output_alpha_2.txt");
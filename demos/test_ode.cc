@@ -2,6 +2,7 @@
 #include <cmath>        //has to be the FIRST include, otherwise does not work!
 #include <nonlinfunc.h>
 #include <ode.h>
+#include <autodiff.h>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -29,26 +30,22 @@ class MassSpring : public NonlinearFunction
   }
 };
 
-class Circuit : public NonlinearFunction{
-
+class Circuit
+{
   double resistance = 1;
   double capacity = 1;
 
-  size_t DimX() const override {return 2;}
-  size_t DimF() const override {return 2;}
+public:
+  size_t DimX() const {return 2;}
+  size_t DimF() const {return 2;}
 
-  void Evaluate(VectorView<double> x, VectorView<double> f) const override 
+  template <typename T>
+  void Evaluate(ADVectorView<T> x, ADVectorView<T> f) const
   {
+    using std::cos;
     //x(0) - time //x(1) - y(t)
     f(0)=1;   
-    f(1)=( std::cos(100* M_PI* x(0))-x(1) ) / (resistance*capacity);
-  }
-
-  void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
-  {
-    df = 0.0;
-    df(1,0) =(-100 * M_PI* std::sin(100 * M_PI* x(0))-x(1))/(resistance* capacity) ;
-    df(1,1) = -1 / (resistance*capacity);
+    f(1)=( cos(100* M_PI* x(0))-x(1) ) / (resistance*capacity);
   }
 };
 
@@ -79,10 +76,61 @@ int main()
 
   y(0)=0; y(1)=0;
   tend=0.1;
-  auto rhs_circuit = std::make_shared<Circuit>();
+  auto rhs_circuit = std::make_shared<AutoDiffFunction<Circuit>>();
   std::ofstream ost4;
   ost4.open ("C:/Users/stein/Documents/ODE7.1.24/ASC-ODE/py_tests/output_circuit.txt");
   SolveODE_IE(tend, steps, y, rhs_circuit,
               [&ost4](double t, VectorView<double> y) { ost4 << t << "  " << y(1) << "\n"; });
   ost4.close();
+
+  // same circuit with Dormand-Prince and step size control
+  y(0)=0; y(1)=0;
+  AdaptiveOptions adaptive;
+  adaptive.rtol = 1e-6;
+  std::ofstream ost5;
+  ost5.open ("C:/Users/stein/Documents/ODE7.1.24/ASC-ODE/py_tests/output_circuit_adaptive.txt");
+  auto stat = SolveODE_Adaptive(tend, y, rhs_circuit, DormandPrince54(), adaptive,
+                                [&ost5](double t, VectorView<double> y) { ost5 << t << "  " << y(1) << "\n"; });
+  ost5.close();
+  std::cout << "adaptive circuit: " << stat << std::endl;
+
+  // and with variable order BDF
+  y(0)=0; y(1)=0;
+  std::ofstream ost6;
+  ost6.open ("C:/Users/stein/Documents/ODE7.1.24/ASC-ODE/py_tests/output_circuit_bdf.txt");
+  stat = SolveODE_BDF(tend, y, rhs_circuit, 5, adaptive,
+                      [&ost6](double t, VectorView<double> y) { ost6 << t << "  " << y(1) << "\n"; });
+  ost6.close();
+  std::cout << "BDF circuit: " << stat << std::endl;
+
+  // Newton iterations of implicit Euler, starting from the old value
+  // and from the quadratic extrapolation of the last steps
+  for (int predictor : { 0, 2 })
+    {
+      y(0)=0; y(1)=0;
+      NewtonOptions newton;
+      newton.predictor = predictor;
+      auto newton_stat = SolveODE_IE(tend, steps, y, rhs_circuit, nullptr, newton);
+      std::cout << "IE circuit, predictor " << predictor << ": " << newton_stat << std::endl;
+    }
+
+  // Newton and the AD evaluations take their temporaries from the workspace,
+  // after the first step there are no more heap allocations
+  y(0)=0; y(1)=0;
+  ImplicitEuler ie(rhs_circuit);
+  ie.Init(y);
+  ie.StepWithRetry(tend/steps);
+  size_t allocs = ie.GetNewtonState().num_workspace_allocations;
+  for (int i = 1; i < steps; i++)
+    ie.StepWithRetry(tend/steps);
+  std::cout << "IE circuit, workspace allocations: " << allocs << " in the first step, "
+            << ie.GetNewtonState().num_workspace_allocations - allocs << " in the others" << std::endl;
+
+  // the same with Jacobian-free Newton-Krylov
+  y(0)=0; y(1)=0;
+  NewtonOptions jfnk;
+  jfnk.matrix_free = true;
+  jfnk.preconditioner = std::make_shared<JacobiPreconditioner>();
+  auto jfnk_stat = SolveODE_IE(tend, steps, y, rhs_circuit, nullptr, jfnk);
+  std::cout << "IE circuit, matrix-free: " << jfnk_stat << std::endl;
 }
@@ -0,0 +1,262 @@
+#include <chrono>
+#include <utility>
+#include <random>
+#include "mass_spring.h"
+
+// cost per spring of MSS_Function::Evaluate on a 3d cloth with about
+// 1e6 springs, compared with the older kernels: Vector temporaries per
+// spring, and stack arrays spring by spring with branches on the connectors
+// (the spring arrays need no branches, their colour order is for the threads).
+// Then forces and sparse Jacobian with several threads, and with masses
+// in random order before and after Reorder. At last the contact pairs
+// against all pairs, the Jacobian with contacts against finite differences,
+// and Newton with the sparse Jacobian against the dense one
+
+template <int D>
+void EvaluateOld (const MassSpringSystem<D> & mss, VectorView<double> x, VectorView<double> f)
+{
+  f = 0.0;
+  for (auto spring : mss.Springs())
+    {
+      auto [c1,c2] = spring.connections;
+      Vector<double> p1(D), p2(D);
+      for (int k = 0; k < D; k++)
+        {
+          p1(k) = (c1.type == Connector::FIX) ? mss.Fixes()[c1.nr].pos(k) : x(D*c1.nr+k);
+          p2(k) = (c2.type == Connector::FIX) ? mss.Fixes()[c2.nr].pos(k) : x(D*c2.nr+k);
+        }
+      double force = spring.stiffness * (Vector<double>(p1 + (-1)*p2).L2Norm()-spring.length);
+      Vector<double> dir12 = 1.0/(Vector<double>(p1 + (-1)*p2).L2Norm()) * (p2+(-1)*p1);
+      for (int k = 0; k < D; k++)
+        {
+          if (c1.type == Connector::MASS)
+            f(D*c1.nr+k) += force*dir12(k);
+          if (c2.type == Connector::MASS)
+            f(D*c2.nr+k) -= force*dir12(k);
+        }
+    }
+}
+
+template <int D>
+void EvaluateSpringwise (const MassSpringSystem<D> & mss, const MSS_Function<D> & func,
+                         VectorView<double> x, VectorView<double> f)
+{
+  f = 0.0;
+  for (auto & spring : mss.Springs())
+    {
+      double F[D];
+      func.SpringForce(spring, x, F);
+      auto [c1,c2] = spring.connections;
+      for (int k = 0; k < D; k++)
+        {
+          if (c1.type == Connector::MASS)
+            f(D*c1.nr+k) += F[k];
+          if (c2.type == Connector::MASS)
+            f(D*c2.nr+k) -= F[k];
+        }
+    }
+}
+
+template <typename FUNC>
+double NanoSecondsPerCall (FUNC func, int runs)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++)
+    func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end-start).count() / runs;
+}
+
+// max |i-j| of the Jacobian entries
+size_t Bandwidth (const SparsityPattern & pattern)
+{
+  size_t bw = 0;
+  for (size_t i = 0; i < pattern.Height(); i++)
+    for (size_t j : pattern.Row(i))
+      bw = std::max(bw, i > j ? i-j : j-i);
+  return bw;
+}
+
+double MaxDiff (VectorView<double> a, VectorView<double> b)
+{
+  double diff = 0;
+  for (size_t i = 0; i < a.Size(); i++)
+    diff = std::max(diff, std::fabs(a(i)-b(i)));
+  return diff;
+}
+
+int main()
+{
+  // nx x ny masses, springs to the right and upper neighbour,
+  // the lower edge hangs on fixes
+  size_t nx = 1000, ny = 500;
+  int runs = 10;
+
+  MassSpringSystem<3> mss;
+  std::vector<Connector> below(nx);
+  for (size_t i = 0; i < nx; i++)
+    below[i] = mss.AddFix( { { double(i), 0.0, 0.0 } } );
+  for (size_t j = 1; j <= ny; j++)
+    for (size_t i = 0; i < nx; i++)
+      {
+        auto mij = mss.AddMass( { 1, { 1.01*i, 0.99*j, 0.01*((i+j)%7) } } );
+        mss.AddSpring ( { 1, 10, { below[i], mij } } );
+        if (i > 0)
+          mss.AddSpring ( { 1, 10, { Connector{ Connector::MASS, mij.nr-1 }, mij } } );
+        below[i] = mij;
+      }
+
+  MSS_Function<3> func(mss, true);
+  Vector<double> x(func.DimX()), dx(func.DimX()), ddx(func.DimX());
+  Vector<double> f(func.DimF()), fold(func.DimF()), fsw(func.DimF());
+  mss.GetState (x, dx, ddx);
+  func.Evaluate(x, f);   // builds the spring arrays
+
+  double told = NanoSecondsPerCall([&] { EvaluateOld(mss, x, fold); }, runs);
+  double tsw = NanoSecondsPerCall([&] { EvaluateSpringwise(mss, func, x, fsw); }, runs);
+  double tnew = NanoSecondsPerCall([&] { func.Evaluate(x, f); }, runs);
+
+  size_t ns = mss.Springs().size();
+  std::cout << ns << " springs" << std::endl;
+  std::cout << "Vector temporaries:  " << told/ns << " ns/spring" << std::endl;
+  std::cout << "spring by spring:    " << tsw/ns << " ns/spring" << std::endl;
+  std::cout << "spring arrays:       " << tnew/ns << " ns/spring" << std::endl;
+  std::cout << "max difference:      " << std::max(MaxDiff(f, fold), MaxDiff(f, fsw)) << std::endl;
+
+  // results must not depend on the number of threads, bit by bit
+  auto pattern = func.DerivPattern();
+  SparseMatrix jac(pattern), jac1(pattern);
+  Vector<double> f1(func.DimF());
+  func.EvaluateWithSparseDeriv(x, f1, jac1);
+  for (size_t threads : { 1, 2, 4, 8 })
+    {
+      func.SetThreadPool(threads > 1 ? std::make_shared<ThreadPool>(threads) : nullptr);
+      double tf = NanoSecondsPerCall([&] { func.Evaluate(x, f); }, runs);
+      double tj = NanoSecondsPerCall([&] { func.EvaluateWithSparseDeriv(x, f, jac); }, runs);
+      bool same = true;
+      for (size_t i = 0; i < f.Size(); i++)
+        same &= (f(i) == f1(i));
+      for (size_t i = 0; i < jac.Height(); i++)
+        for (size_t j : pattern.Row(i))
+          same &= (std::as_const(jac)(i,j) == std::as_const(jac1)(i,j));
+      std::cout << threads << " threads: forces " << tf/ns << " ns/spring, with Jacobian "
+                << tj/ns << " ns/spring, " << (same ? "identical" : "DIFFERENT") << std::endl;
+    }
+
+  // the same cloth with masses and springs numbered randomly,
+  // as from a Python loop over an unstructured mesh
+  func.SetThreadPool(nullptr);
+  std::mt19937 rng(17);
+  std::vector<size_t> shuffle(mss.Masses().size());
+  for (size_t i = 0; i < shuffle.size(); i++)
+    shuffle[i] = i;
+  std::shuffle(shuffle.begin(), shuffle.end(), rng);
+  MassSpringSystem<3> mss2;
+  for (auto & fix : mss.Fixes())
+    mss2.AddFix(fix);
+  std::vector<Mass<3>> shuffled(mss.Masses().size());
+  for (size_t i = 0; i < shuffle.size(); i++)
+    shuffled[shuffle[i]] = mss.Masses()[i];
+  for (auto & m : shuffled)
+    mss2.AddMass(m);
+  std::vector<Spring> springs = mss.Springs();
+  std::shuffle(springs.begin(), springs.end(), rng);
+  for (auto spring : springs)
+    {
+      for (auto & c : spring.connections)
+        if (c.type == Connector::MASS)
+          c.nr = shuffle[c.nr];
+      mss2.AddSpring(spring);
+    }
+
+  MSS_Function<3> func2(mss2, true);
+  for (int reordered = 0; reordered < 2; reordered++)
+    {
+      if (reordered)
+        mss2.Reorder();
+      mss2.GetState (x, dx, ddx);
+      auto pattern2 = func2.DerivPattern();
+      SparseMatrix jac2(pattern2);
+      func2.Evaluate(x, f);
+      double tf = NanoSecondsPerCall([&] { func2.Evaluate(x, f); }, runs);
+      double tj = NanoSecondsPerCall([&] { func2.EvaluateWithSparseDeriv(x, f, jac2); }, runs);
+      std::cout << (reordered ? "reordered: " : "random:    ") << "forces " << tf/ns
+                << " ns/spring, with Jacobian " << tj/ns << " ns/spring, bandwidth "
+                << Bandwidth(pattern2) << std::endl;
+    }
+
+  // contact: a random cloud, about 6 masses within the search radius of a mass
+  {
+    size_t nm = 20000;
+    double dist = 0.3;
+    double len = std::cbrt(nm/8.0);
+    std::uniform_real_distribution<double> coord(0, len);
+    MassSpringSystem<3> cloud;
+    for (size_t i = 0; i < nm; i++)
+      cloud.AddMass( { 1, { coord(rng), coord(rng), coord(rng) } } );
+    cloud.SetContact(dist, 100);
+    MSS_Function<3> cfunc(cloud, true);
+    Vector<double> xc(cfunc.DimX()), vc(cfunc.DimX()), ac(cfunc.DimX()), fc(cfunc.DimF());
+    cloud.GetState(xc, vc, ac);
+
+    double tpairs = NanoSecondsPerCall([&] { cfunc.UpdateContacts(xc); }, 1);
+    // all pairs within the search radius, by pairs in sorted order
+    double radius = (1+cfunc.Contacts().skin_factor) * dist;
+    std::vector<std::array<size_t,2>> all;
+    double tall = NanoSecondsPerCall([&]
+    {
+      all.clear();
+      for (size_t i = 0; i < nm; i++)
+        for (size_t j = i+1; j < nm; j++)
+          {
+            double d2 = 0;
+            for (int k = 0; k < 3; k++)
+              d2 += (xc(3*j+k)-xc(3*i+k)) * (xc(3*j+k)-xc(3*i+k));
+            if (d2 < radius*radius)
+              all.push_back({ i, j });
+          }
+    }, 1);
+    std::cout << "contact pairs: " << cfunc.Contacts().Pairs().size() << " in " << tpairs/nm
+              << " ns/mass, all pairs: " << all.size() << " in " << tall/nm << " ns/mass, "
+              << (all == cfunc.Contacts().Pairs() ? "same" : "DIFFERENT") << std::endl;
+
+    // Jacobians at a small cloud with a plane, springs and many contacts
+    MassSpringSystem<3> small;
+    for (size_t i = 0; i < 200; i++)
+      small.AddMass( { 1+coord(rng)/len, { 2*coord(rng)/len, 2*coord(rng)/len, 2*coord(rng)/len } } );
+    for (size_t i = 1; i < 200; i += 3)
+      small.AddSpring( { 0.3, 5, { Connector{ Connector::MASS, i-1 }, Connector{ Connector::MASS, i } } } );
+    small.SetContact(0.4, 100);
+    small.AddPlane( { { 0.0, 0.0, 1.0 }, 0.1 } );
+    MSS_Function<3> sfunc(small);
+    Vector<double> xs(sfunc.DimX()), vs(sfunc.DimX()), as(sfunc.DimX());
+    small.GetState(xs, vs, as);
+    std::cout << "contact Jacobians - finite differences: " << sfunc.CheckDeriv(xs) << std::endl;
+
+    // a column of masses falls on the floor, Newton iterations of the
+    // implicit method with dense and sparse Jacobian
+    for (std::string solver : { "direct", "sparse", "cg" })
+      {
+        MassSpringSystem<3> pile;
+        pile.SetGravity( { 0, 0, -9.81 } );
+        for (int i = 0; i < 3; i++)
+          for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 6; k++)
+              pile.AddMass( { 1, { 0.25*i+0.01*k, 0.25*j, 0.3*k } } );
+        pile.SetContact(0.2, 1e4);
+        pile.AddPlane( { { 0.0, 0.0, 1.0 }, -1.0 } );
+        MSS_Simulator<3> sim(pile, 0.8, MSSNewtonOptions<3>(solver));
+        size_t its = 0, last = 0;
+        for (int s = 0; s < 1000; s++)
+          {
+            sim.Simulate(0.002, 1);
+            // the stepper restarts with a new pattern when contacts appear
+            size_t now = sim.GetNewtonState()->num_iterations;
+            its += (now >= last) ? now-last : now;
+            last = now;
+          }
+        std::cout << "pile, " << solver << ": " << its << " Newton iterations, z of mass 5 "
+                  << pile.Masses()[5].pos(2) << std::endl;
+      }
+  }
+}
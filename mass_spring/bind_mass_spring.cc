@@ -31,7 +31,7 @@ PYBIND11_MODULE(mass_spring, m) {
                     [](Mass<3> & m) { return m.mass; },
                     [](Mass<3> & m, double mass) { m.mass = mass; })
       .def_property_readonly("pos",
-                             [](Mass<3> & m) { return m.pos; });
+                             [](Mass<3> & m) { return std::array<double,3>{ m.pos(0), m.pos(1), m.pos(2) }; });
     ;
 
     
@@ -43,7 +43,7 @@ PYBIND11_MODULE(mass_spring, m) {
     
     py::class_<Fix<3>> (m, "Fix3d")
       .def_property_readonly("pos",
-                             [](Fix<3> & f) { return f.pos; });
+                             [](Fix<3> & f) { return std::array<double,3>{ f.pos(0), f.pos(1), f.pos(2) }; });
     
 
     m.def("Fix", [](std::array<double,3> p)
@@ -51,10 +51,34 @@ PYBIND11_MODULE(mass_spring, m) {
       return Fix<3>{ { p[0], p[1], p[2] } };
     });
 
-    py::class_<Connector> (m, "Connector");
+    py::class_<Connector> connector(m, "Connector");
+    py::enum_<Connector::CONTYPE> (connector, "Type")
+      .value("FIX", Connector::FIX)
+      .value("MASS", Connector::MASS)
+      ;
+    connector
+      .def(py::init<Connector::CONTYPE, size_t>(), py::arg("type"), py::arg("nr"))
+      .def_readwrite("type", &Connector::type)
+      .def_readwrite("nr", &Connector::nr)
+      .def("__str__", [](Connector & c) {
+        stringstream sstr;
+        sstr << c;
+        return sstr.str();
+      })
+      ;
+
+    // new numbers after Reorder: masses[old], springs[old], and
+    // perm(connector) maps a handle kept from Add
+    py::class_<MSSPermutation> (m, "MSSPermutation")
+      .def_readonly("masses", &MSSPermutation::masses)
+      .def_readonly("springs", &MSSPermutation::springs)
+      .def("__call__", [](MSSPermutation & perm, Connector c) { return perm(c); })
+      ;
 
     py::class_<Spring> (m, "Spring")
       .def(py::init<double, double, std::array<Connector,2>>())
+      .def_property_readonly("length", [](Spring & s) { return s.length; })
+      .def_property_readonly("stiffness", [](Spring & s) { return s.stiffness; })
       .def_property_readonly("connections",
                              [](Spring & s) { return s.connections; })
       ;
@@ -78,14 +102,34 @@ PYBIND11_MODULE(mass_spring, m) {
         sstr << mss;
         return sstr.str();
       })
-      .def_property("gravity", [](MassSpringSystem<3> & mss) { return mss.Gravity(); },
+      .def_property("gravity", [](MassSpringSystem<3> & mss) {
+                      auto & g = mss.Gravity();
+                      return std::array<double,3>{ g(0), g(1), g(2) }; },
                     [](MassSpringSystem<3> & mss, std::array<double,3> g) { mss.SetGravity(Vec<3>{g[0],g[1],g[2]}); })
       .def("Add", [](MassSpringSystem<3> & mss, Mass<3> m) { return mss.AddMass(m); })
       .def("Add", [](MassSpringSystem<3> & mss, Fix<3> f) { return mss.AddFix(f); })
       .def("Add", [](MassSpringSystem<3> & mss, Spring s) { return mss.AddSpring(s); })            
+      // penalty contact between masses closer than distance and with the
+      // planes normal * x >= offset, off for stiffness 0
+      .def("SetContact", [](MassSpringSystem<3> & mss, double distance, double stiffness) {
+        mss.SetContact(distance, stiffness);
+      }, py::arg("distance"), py::arg("stiffness"))
+      .def("AddPlane", [](MassSpringSystem<3> & mss, std::array<double,3> normal, double offset) {
+        return mss.AddPlane(Plane<3>{ Vec<3>{ normal[0], normal[1], normal[2] }, offset });
+      }, py::arg("normal"), py::arg("offset")=0.0)
+      // renumbering for cache locality, returns the MSSPermutation
+      // for the handles of masses and springs
+      .def("Reorder", [](MassSpringSystem<3> & mss) { return mss.Reorder(); })
       .def_property_readonly("masses", [](MassSpringSystem<3> & mss) -> auto& { return mss.Masses(); })
       .def_property_readonly("fixes", [](MassSpringSystem<3> & mss) -> auto& { return mss.Fixes(); })
       .def_property_readonly("springs", [](MassSpringSystem<3> & mss) -> auto& { return mss.Springs(); })            
+      // reading masses, fixes and springs keeps a running Simulator,
+      // spring changes by SetSpring restart it
+      .def("SetSpring", [](MassSpringSystem<3> & mss, size_t nr, double length, double stiffness) {
+        mss.SetSpring(nr, length, stiffness);
+      }, py::arg("nr"), py::arg("length"), py::arg("stiffness"))
+      // fixes or springs were replaced through mss.fixes or mss.springs
+      .def("MarkChanged", [](MassSpringSystem<3> & mss) { mss.MarkChanged(); })
       .def("__getitem__", [](MassSpringSystem<3> mss, Connector & c) {
         if (c.type==Connector::FIX) return py::cast(mss.Fixes()[c.nr]);
         else return py::cast(mss.Masses()[c.nr]);
@@ -101,19 +145,33 @@ PYBIND11_MODULE(mass_spring, m) {
       ;
     
 
-    m.def("Simulate", [](MassSpringSystem<3> & mss, double tend, size_t steps) {
-      Vector<> x(3*mss.Masses().size());
-      Vector<> dx(3*mss.Masses().size());
-      Vector<> ddx(3*mss.Masses().size());
-      mss.GetState (x, dx, ddx);
-      
-      auto mss_func = make_shared<MSS_Function<3>> (mss);
-      auto mass = make_shared<IdentityFunction> (x.Size());      
-      
-      SolveODE_Alpha(tend, steps, 0.8, x, dx, ddx, mss_func, mass);
-
-      mss.SetState (x, dx, ddx);
-    });
+    // method: "alpha" (implicit, default), "verlet", "leapfrog" or "yoshida4",
+    // the explicit methods need steps small compared to the stiffest spring.
+    // solver of alpha: "direct", "sparse" or "cg", preconditioner of cg:
+    // "none", "jacobi", "blockjacobi" or "ic0".
+    // threads > 1 assembles forces and Jacobians in parallel, with the
+    // same result for every number of threads
+    m.def("Simulate", [](MassSpringSystem<3> & mss, double tend, size_t steps, string method,
+                         string solver, string preconditioner, size_t threads) {
+      MSS_Simulator<3> sim(mss, 0.8, MSSNewtonOptions<3>(solver, preconditioner), ParseMSSMethod(method),
+                           threads);
+      sim.Simulate(tend, steps);
+    }, py::arg("mss"), py::arg("tend"), py::arg("steps"), py::arg("method")="alpha",
+       py::arg("solver")="direct", py::arg("preconditioner")="ic0", py::arg("threads")=1);
+
+    // keeps the integrator between calls, for stepping from a notebook loop
+    py::class_<MSS_Simulator<3>> (m, "Simulator")
+      .def(py::init([](MassSpringSystem<3> & mss, double rhoinf, string method,
+                       string solver, string preconditioner, size_t threads) {
+             return new MSS_Simulator<3>(mss, rhoinf, MSSNewtonOptions<3>(solver, preconditioner),
+                                         ParseMSSMethod(method), threads);
+           }),
+           py::arg("mss"), py::arg("rhoinf")=0.8, py::arg("method")="alpha",
+           py::arg("solver")="direct", py::arg("preconditioner")="ic0", py::arg("threads")=1,
+           py::keep_alive<1,2>())
+      .def("Simulate", &MSS_Simulator<3>::Simulate, py::arg("tend"), py::arg("steps"))
+      .def_property_readonly("time", &MSS_Simulator<3>::Time)
+      ;
       
     
 }
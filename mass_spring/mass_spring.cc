@@ -21,10 +21,13 @@ int main()
   Vector<double> dx(2*mss.Masses().size());  
   Vector<double> ddx(2*mss.Masses().size());  
 
-  auto mss_func = std::make_shared<MSS_Function<2>> (mss);
-  auto mass = std::make_shared<IdentityFunction> (x.Size());      
+  // M d^2x/dt^2 = F(x) with the lumped mass matrix
+  auto mss_func = std::make_shared<MSS_Function<2>> (mss, true);
+  auto mass = std::make_shared<DiagonalFunction> (x.Size(), 1.0);
+  mss.GetMassDiagonal (mass->Diagonal());
 
   mss.GetState (x, dx, ddx);
+  std::cout << "Jacobian vs finite differences: " << mss_func->CheckDeriv(x) << std::endl;
   std::cout << "hello peeps"<<std::endl;
   SolveODE_Newmark(tend, steps, x, dx,  mss_func, mass,
                    [](double t, ASC_bla::VectorView<double> x) { std::cout << "t = " << t
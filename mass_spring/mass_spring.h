@@ -3,8 +3,14 @@
 
 
 
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
 #include <../src/nonlinfunc.h>
 #include <../src/ode.h>
+#include <../src/threadpool.h>
 
 using namespace ASC_ode;
 
@@ -13,14 +19,25 @@ using namespace ASC_bla;
 
 
 
+// all per-mass data has the fixed size D: no heap allocation per mass,
+// and the spring kernels below work on stack arrays only
+template <int D>
+inline Vec<D> ZeroVec ()
+{
+  Vec<D> v;
+  for (int k = 0; k < D; k++)
+    v(k) = 0.0;
+  return v;
+}
+
 template <int D>
 class Mass
 {
 public:
   double mass;
-  Vector<double> pos;
-  Vector<double> vel = {0.0,0.0,0.0};
-  Vector<double> acc = {0.0,0.0,0.0};
+  Vec<D> pos;
+  Vec<D> vel = ZeroVec<D>();
+  Vec<D> acc = ZeroVec<D>();
 };
 
 
@@ -28,7 +45,18 @@ template <int D>
 class Fix
 {
 public:
-  Vector<double> pos;
+  Vec<D> pos;
+};
+
+
+// wall for contact, the masses stay in the half space normal * x >= offset;
+// normal of length 1
+template <int D>
+class Plane
+{
+public:
+  Vec<D> normal;
+  double offset;
 };
 
 
@@ -54,20 +82,44 @@ public:
   std::array<Connector,2> connections;
 };
 
+
+// renumbering of a MassSpringSystem by Reorder: the new numbers of the
+// old masses and springs. Connectors kept by the user are mapped by
+// operator(), fixes keep their numbers
+class MSSPermutation
+{
+public:
+  std::vector<size_t> masses;
+  std::vector<size_t> springs;
+
+  Connector operator() (Connector c) const
+  {
+    if (c.type == Connector::MASS)
+      c.nr = masses[c.nr];
+    return c;
+  }
+};
+
+
 template <int D>
 class MassSpringSystem
 {
   std::vector<Fix<D>> fixes;
   std::vector<Mass<D>> masses;
   std::vector<Spring> springs;
-  Vector<double> gravity=0.0;
+  Vec<D> gravity = ZeroVec<D>();
+  size_t generation = 0;    // counts the renumberings
+  size_t modification = 0;  // counts changes of springs and fixes
+  std::vector<Plane<D>> planes;
+  double contact_distance = 0, contact_stiffness = 0;
 public:
-  void SetGravity (Vector<double> _gravity) { gravity = _gravity; }
-  Vector<double> Gravity() const { return gravity; }
+  void SetGravity (Vec<D> _gravity) { gravity = _gravity; }
+  const Vec<D> & Gravity() const { return gravity; }
   
   Connector AddFix (Fix<D> p)
   {
     fixes.push_back(p);
+    modification++;
     return { Connector::FIX, fixes.size()-1 };
   }
 
@@ -80,6 +132,7 @@ public:
   size_t AddSpring (Spring s) // double length, double stiffness, Connector c1, Connector c2)
   {
     springs.push_back (s); // Spring{length, stiffness, { c1, c2 } });
+    modification++;
     return springs.size()-1;
   }
 
@@ -89,38 +142,155 @@ public:
   auto & Fixes() { return fixes; } 
   auto & Masses() { return masses; } 
   auto & Springs() { return springs; }
+  const auto & Fixes() const { return fixes; }
+  const auto & Masses() const { return masses; }
+  const auto & Springs() const { return springs; }
 
-  void GetState (VectorView<double> values, VectorView<double> dvalues, VectorView<double> ddvalues)
+  // changes length and stiffness of spring nr, the simulation rebuilds its spring data
+  void SetSpring (size_t nr, double length, double stiffness)
   {
-    auto valmat = values.AsMatrix(Masses().size(), D);
-    auto dvalmat = dvalues.AsMatrix(Masses().size(), D);
-    auto ddvalmat = ddvalues.AsMatrix(Masses().size(), D);    
+    springs.at(nr).length = length;
+    springs.at(nr).stiffness = stiffness;
+    modification++;
+  }
 
-    for (size_t i = 0; i < Masses().size(); i++)
+  // springs or fixes were changed through Springs() or Fixes()
+  void MarkChanged() { modification++; }
+  // counts AddSpring, AddFix, SetSpring, MarkChanged and Reorder
+  size_t Modification() const { return modification; }
+
+  // Penalty contact, off for stiffness 0: two masses closer than distance
+  // repel like a compressed spring of this length, a mass closer than
+  // distance/2 to a plane is pushed back with force stiffness * penetration
+  void SetContact (double distance, double stiffness)
+  {
+    contact_distance = distance;
+    contact_stiffness = stiffness;
+  }
+  double ContactDistance() const { return contact_distance; }
+  double ContactStiffness() const { return contact_stiffness; }
+
+  // the normal is scaled to length 1
+  size_t AddPlane (Plane<D> p)
+  {
+    double len2 = 0;
+    for (int k = 0; k < D; k++)
+      len2 += p.normal(k)*p.normal(k);
+    if (len2 == 0)
+      throw std::invalid_argument("AddPlane: normal must not be zero");
+    for (int k = 0; k < D; k++)
+      p.normal(k) *= 1/std::sqrt(len2);
+    p.offset *= 1/std::sqrt(len2);
+    planes.push_back(p);
+    return planes.size()-1;
+  }
+  auto & Planes() { return planes; }
+  const auto & Planes() const { return planes; }
+
+  // changes with every Reorder, for data kept by mass or spring numbers
+  size_t Generation() const { return generation; }
+
+  // Renumbers the masses by Reverse Cuthill-McKee on the spring graph,
+  // and sorts the springs by their lower and then higher mass number.
+  // The spring loops then access nearby masses, and the Jacobian gets
+  // a small bandwidth and little fill-in in the sparse factorization
+  MSSPermutation Reorder ()
+  {
+    size_t nm = masses.size();
+    std::vector<std::vector<size_t>> graph(nm);
+    for (auto & spring : springs)
+      {
+        auto [c1,c2] = spring.connections;
+        if (c1.type == Connector::MASS && c2.type == Connector::MASS && c1.nr != c2.nr)
+          {
+            graph[c1.nr].push_back(c2.nr);
+            graph[c2.nr].push_back(c1.nr);
+          }
+      }
+    for (auto & adj : graph)
       {
-        valmat.Row(i) = Masses()[i].pos;
-        dvalmat.Row(i) = Masses()[i].vel;
-        ddvalmat.Row(i) = Masses()[i].acc;
+        std::sort(adj.begin(), adj.end());
+        adj.erase(std::unique(adj.begin(), adj.end()), adj.end());
       }
+
+    MSSPermutation perm;
+    auto order = ReverseCuthillMcKee(graph);
+    perm.masses.resize(nm);
+    for (size_t i = 0; i < nm; i++)
+      perm.masses[order[i]] = i;
+
+    std::vector<Mass<D>> newmasses;
+    newmasses.reserve(nm);
+    for (size_t i = 0; i < nm; i++)
+      newmasses.push_back(masses[order[i]]);
+    masses = std::move(newmasses);
+
+    for (auto & spring : springs)
+      for (auto & c : spring.connections)
+        c = perm(c);
+
+    // fixes sort behind all masses
+    auto key = [nm] (const Spring & s)
+    {
+      auto nr = [nm] (Connector c) { return c.type == Connector::MASS ? c.nr : nm; };
+      size_t n1 = nr(s.connections[0]), n2 = nr(s.connections[1]);
+      return std::pair(std::min(n1,n2), std::max(n1,n2));
+    };
+    std::vector<size_t> sorder(springs.size());
+    for (size_t i = 0; i < sorder.size(); i++)
+      sorder[i] = i;
+    std::stable_sort(sorder.begin(), sorder.end(),
+                     [&] (size_t a, size_t b) { return key(springs[a]) < key(springs[b]); });
+
+    perm.springs.resize(springs.size());
+    std::vector<Spring> newsprings;
+    newsprings.reserve(springs.size());
+    for (size_t i = 0; i < sorder.size(); i++)
+      {
+        perm.springs[sorder[i]] = i;
+        newsprings.push_back(springs[sorder[i]]);
+      }
+    springs = std::move(newsprings);
+
+    generation++;
+    modification++;
+    return perm;
+  }
+
+  // the lumped mass matrix, D equal entries per mass
+  void GetMassDiagonal (VectorView<double> diag) const
+  {
+    for (size_t i = 0; i < Masses().size(); i++)
+      for (int k = 0; k < D; k++)
+        diag(D*i+k) = Masses()[i].mass;
+  }
+
+  // coordinates of mass i are D*i ... D*i+D-1
+  void GetState (VectorView<double> values, VectorView<double> dvalues, VectorView<double> ddvalues) const
+  {
+    for (size_t i = 0; i < Masses().size(); i++)
+      for (int k = 0; k < D; k++)
+        {
+          values(D*i+k) = Masses()[i].pos(k);
+          dvalues(D*i+k) = Masses()[i].vel(k);
+          ddvalues(D*i+k) = Masses()[i].acc(k);
+        }
   }
   
   void SetState (VectorView<double> values, VectorView<double> dvalues, VectorView<double> ddvalues)
   {
-    auto valmat = values.AsMatrix(Masses().size(), D);
-    auto dvalmat = dvalues.AsMatrix(Masses().size(), D);
-    auto ddvalmat = ddvalues.AsMatrix(Masses().size(), D);
-
     for (size_t i = 0; i < Masses().size(); i++)
-      {
-        Masses()[i].pos = valmat.Row(i);
-        Masses()[i].vel = dvalmat.Row(i);
-        Masses()[i].acc = ddvalmat.Row(i);        
-      }
+      for (int k = 0; k < D; k++)
+        {
+          Masses()[i].pos(k) = values(D*i+k);
+          Masses()[i].vel(k) = dvalues(D*i+k);
+          Masses()[i].acc(k) = ddvalues(D*i+k);
+        }
   }
 };
 
 template <int D>
-std::ostream & operator<< (std::ostream & ost, MassSpringSystem<D> & mss)
+std::ostream & operator<< (std::ostream & ost, const MassSpringSystem<D> & mss)
 {
   ost << "fixes:" << std::endl;
   for (auto f : mss.Fixes())
@@ -138,56 +308,784 @@ std::ostream & operator<< (std::ostream & ost, MassSpringSystem<D> & mss)
 }
 
 
+// structure-of-arrays copy of the springs for the kernels: springs
+// between two masses by their mass numbers, springs to a fix by the mass
+// and the constant fix position. Springs between two fixes are dropped.
+// The springs are coloured such that no two springs of a colour share a
+// mass. Colour by colour they touch disjoint rows, so the blocks of one
+// colour can run in parallel, and every mass receives its contributions
+// in colour order, independent of the number of threads.
+template <int D>
+class SpringArrays
+{
+public:
+  static constexpr size_t BS = 64;    // springs per task of a parallel loop
+
+  // mass - mass springs
+  std::vector<size_t> m1, m2;
+  std::vector<double> length, stiffness;
+  std::vector<size_t> mm_first, mm_num;   // per colour
+
+  // mass - fix springs
+  std::vector<size_t> mf;
+  std::vector<double> fixpos[D];      // one row per coordinate
+  std::vector<double> flength, fstiffness;
+  std::vector<size_t> mf_first, mf_num;   // per colour
+
+  // state of the system the arrays were built from
+  size_t generation = 0, modification = 0;
+
+  // value positions in a sparse Jacobian of the first entries of the
+  // rows of the D x D blocks, the D columns of a block follow each other:
+  // the diagonal block of mass m at diagpos[D*m+k], the blocks (m1,m2)
+  // and (m2,m1) of mass - mass spring i at pos12[D*i+k] and pos21[D*i+k]
+  std::vector<size_t> diagpos, pos12, pos21;
+  size_t pattern_id = 0;      // of the matrix the positions were found in
+
+  bool UpToDate (const MassSpringSystem<D> & mss) const
+  {
+    return generation == mss.Generation() && modification == mss.Modification();
+  }
+
+  void Build (const MassSpringSystem<D> & mss)
+  {
+    // greedy colouring: the smallest colour not yet used at the masses
+    std::vector<std::vector<size_t>> used_mm(mss.Masses().size());
+    std::vector<size_t> used_mf(mss.Masses().size(), 0);
+    std::vector<size_t> col_mm, col_mf;
+    std::vector<const Spring*> springs_mm, springs_mf;
+    size_t ncol_mm = 0, ncol_mf = 0;
+
+    for (auto & spring : mss.Springs())
+      {
+        auto [c1,c2] = spring.connections;
+        if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+          {
+            auto & u1 = used_mm[c1.nr];
+            auto & u2 = used_mm[c2.nr];
+            size_t col = 0;
+            while (std::find(u1.begin(), u1.end(), col) != u1.end() ||
+                   std::find(u2.begin(), u2.end(), col) != u2.end())
+              col++;
+            u1.push_back(col);
+            u2.push_back(col);
+            springs_mm.push_back(&spring);
+            col_mm.push_back(col);
+            ncol_mm = std::max(ncol_mm, col+1);
+          }
+        else if (c1.type == Connector::MASS || c2.type == Connector::MASS)
+          {
+            size_t nr = (c1.type == Connector::MASS) ? c1.nr : c2.nr;
+            size_t col = used_mf[nr]++;
+            springs_mf.push_back(&spring);
+            col_mf.push_back(col);
+            ncol_mf = std::max(ncol_mf, col+1);
+          }
+      }
+
+    size_t size_mm = Layout(col_mm, ncol_mm, mm_first, mm_num);
+    size_t size_mf = Layout(col_mf, ncol_mf, mf_first, mf_num);
+
+    m1.assign(size_mm, 0); m2.assign(size_mm, 0);
+    length.assign(size_mm, 0.0); stiffness.assign(size_mm, 0.0);
+    mf.assign(size_mf, 0);
+    flength.assign(size_mf, 0.0); fstiffness.assign(size_mf, 0.0);
+    for (int k = 0; k < D; k++) fixpos[k].assign(size_mf, 0.0);
+
+    std::vector<size_t> pos(mm_first);
+    for (size_t s = 0; s < springs_mm.size(); s++)
+      {
+        size_t i = pos[col_mm[s]]++;
+        auto & spring = *springs_mm[s];
+        m1[i] = spring.connections[0].nr;
+        m2[i] = spring.connections[1].nr;
+        length[i] = spring.length;
+        stiffness[i] = spring.stiffness;
+      }
+
+    pos = mf_first;
+    for (size_t s = 0; s < springs_mf.size(); s++)
+      {
+        size_t i = pos[col_mf[s]]++;
+        auto & spring = *springs_mf[s];
+        auto [c1,c2] = spring.connections;
+        auto [cm,cf] = (c1.type == Connector::MASS) ? std::pair(c1,c2) : std::pair(c2,c1);
+        mf[i] = cm.nr;
+        for (int k = 0; k < D; k++)
+          fixpos[k][i] = mss.Fixes()[cf.nr].pos(k);
+        flength[i] = spring.length;
+        fstiffness[i] = spring.stiffness;
+      }
+
+    generation = mss.Generation();
+    modification = mss.Modification();
+    pattern_id = 0;
+  }
+
+  // the positions for the pattern of df, with a binary search per row
+  // of a block only when df has a new pattern
+  void FindPositions (const SparseMatrix & df)
+  {
+    if (pattern_id == df.PatternId()) return;
+    auto find = [&] (std::vector<size_t> & pos, size_t nr, size_t i, size_t j)
+    {
+      for (int k = 0; k < D; k++)
+        {
+          pos[D*nr+k] = df.Position(D*i+k, D*j);
+          if (pos[D*nr+k] == SparseMatrix::npos)
+            throw std::out_of_range("SpringArrays: spring block not in sparsity pattern");
+        }
+    };
+    size_t nm = df.Height() / D;
+    diagpos.resize(D*nm);
+    for (size_t m = 0; m < nm; m++)
+      find(diagpos, m, m, m);
+    pos12.resize(D*m1.size());
+    pos21.resize(D*m1.size());
+    for (size_t i = 0; i < m1.size(); i++)
+      {
+        find(pos12, i, m1[i], m2[i]);
+        find(pos21, i, m2[i], m1[i]);
+      }
+    pattern_id = df.PatternId();
+  }
+
+  // func(first, nb) for all blocks of springs, colour by colour;
+  // the blocks of one colour are distributed over the pool
+  template <typename FUNC>
+  static void ForBlocks (const std::vector<size_t> & first, const std::vector<size_t> & num,
+                         ThreadPool * pool, FUNC && func)
+  {
+    for (size_t c = 0; c < first.size(); c++)
+      {
+        size_t nblocks = (num[c]+BS-1) / BS;
+        auto block = [&] (size_t b)
+        {
+          func(first[c]+b*BS, std::min(BS, num[c]-b*BS));
+        };
+        if (pool)
+          pool->ParallelFor(nblocks, block);
+        else
+          for (size_t b = 0; b < nblocks; b++)
+            block(b);
+      }
+  }
+
+  template <typename FUNC>
+  void ForMassMassBlocks (ThreadPool * pool, FUNC && func) const
+  { ForBlocks(mm_first, mm_num, pool, func); }
+
+  template <typename FUNC>
+  void ForMassFixBlocks (ThreadPool * pool, FUNC && func) const
+  { ForBlocks(mf_first, mf_num, pool, func); }
+
+  // f += spring forces, spring by spring in colour order
+  void AddForces (VectorView<double> x, VectorView<double> f, ThreadPool * pool = nullptr) const
+  {
+    ForMassMassBlocks (pool, [&] (size_t first, size_t nb)
+    {
+      for (size_t i = first; i < first+nb; i++)
+        {
+          size_t i1 = m1[i], i2 = m2[i];
+          double d[D];
+          for (int k = 0; k < D; k++)
+            d[k] = x(D*i2+k) - x(D*i1+k);
+          double fac = ForceFactor(d, length[i], stiffness[i]);
+          for (int k = 0; k < D; k++)
+            {
+              f(D*i1+k) += fac * d[k];
+              f(D*i2+k) -= fac * d[k];
+            }
+        }
+    });
+
+    ForMassFixBlocks (pool, [&] (size_t first, size_t nb)
+    {
+      for (size_t i = first; i < first+nb; i++)
+        {
+          size_t im = mf[i];
+          double d[D];
+          for (int k = 0; k < D; k++)
+            d[k] = fixpos[k][i] - x(D*im+k);
+          double fac = ForceFactor(d, flength[i], fstiffness[i]);
+          for (int k = 0; k < D; k++)
+            f(D*im+k) += fac * d[k];
+        }
+    });
+  }
+
+private:
+  // first and number of the springs of every colour, returns the total size
+  static size_t Layout (const std::vector<size_t> & col, size_t ncol,
+                        std::vector<size_t> & first, std::vector<size_t> & num)
+  {
+    num.assign(ncol, 0);
+    for (size_t c : col) num[c]++;
+    first.resize(ncol);
+    size_t size = 0;
+    for (size_t c = 0; c < ncol; c++)
+      {
+        first[c] = size;
+        size += num[c];
+      }
+    return size;
+  }
+
+  // force on the first end is fac * d, fac = k (L-l0) / L
+  static double ForceFactor (const double (&d)[D], double len0, double stiff)
+  {
+    double len2 = 0;
+    for (int k = 0; k < D; k++)
+      len2 += d[k]*d[k];
+    double len = std::sqrt(len2);
+    return stiff * (len-len0) / len;
+  }
+};
+
+
+// candidate pairs of masses for contact, from a uniform grid hashed into
+// a table of about 2 cells per mass: counting sort of the masses by cell,
+// then every mass looks at the 3^D neighbouring cells, so building is
+// linear in the number of masses.
+// The pairs are found with the contact distance plus a skin; they stay
+// valid while no mass moved more than skin/2 since the last build, so in
+// most evaluations only the displacements are checked
+template <int D>
+class ContactPairs
+{
+  std::vector<double> xref;               // positions at the last build
+  double built_distance = -1;
+  size_t built_generation = 0;
+
+  std::vector<size_t> cell;               // hash bucket of every mass
+  std::vector<size_t> bucketstart, bucketmasses;
+  std::vector<std::array<size_t,2>> pairs;
+  size_t num_builds = 0;
+
+public:
+  double skin_factor = 0.5;               // skin relative to the contact distance
+
+  const std::vector<std::array<size_t,2>> & Pairs() const { return pairs; }
+  size_t NumBuilds() const { return num_builds; }
+
+  void Update (VectorView<double> x, double distance, size_t generation)
+  {
+    size_t nm = x.Size() / D;
+    double skin = skin_factor*distance;
+    bool valid = xref.size() == x.Size() && built_distance == distance
+      && built_generation == generation;
+    for (size_t i = 0; valid && i < nm; i++)
+      {
+        double move2 = 0;
+        for (int k = 0; k < D; k++)
+          move2 += (x(D*i+k)-xref[D*i+k]) * (x(D*i+k)-xref[D*i+k]);
+        valid = 4*move2 < skin*skin;
+      }
+    if (!valid)
+      Build (x, distance, generation);
+  }
+
+private:
+  size_t Bucket (const long (&c)[D]) const
+  {
+    static constexpr size_t primes[3] = { 73856093, 19349663, 83492791 };
+    size_t h = 0;
+    for (int k = 0; k < D; k++)
+      h ^= size_t(c[k]) * primes[k%3];
+    return h % (bucketstart.size()-1);
+  }
+
+  void Build (VectorView<double> x, double distance, size_t generation)
+  {
+    size_t nm = x.Size() / D;
+    double h = (1+skin_factor) * distance;    // cell size = search radius
+    num_builds++;
+    xref.resize(x.Size());
+    for (size_t i = 0; i < x.Size(); i++)
+      xref[i] = x(i);
+    built_distance = distance;
+    built_generation = generation;
+
+    auto cellcoord = [&] (size_t i, long (&c)[D])
+    {
+      for (int k = 0; k < D; k++)
+        c[k] = long(std::floor(x(D*i+k) / h));
+    };
+
+    // counting sort of the masses into the buckets
+    bucketstart.assign(2*nm+2, 0);
+    cell.resize(nm);
+    for (size_t i = 0; i < nm; i++)
+      {
+        long c[D];
+        cellcoord(i, c);
+        cell[i] = Bucket(c);
+        bucketstart[cell[i]+1]++;
+      }
+    for (size_t b = 1; b < bucketstart.size(); b++)
+      bucketstart[b] += bucketstart[b-1];
+    bucketmasses.resize(nm);
+    {
+      std::vector<size_t> pos(bucketstart.begin(), bucketstart.end()-1);
+      for (size_t i = 0; i < nm; i++)
+        bucketmasses[pos[cell[i]]++] = i;
+    }
+
+    // neighbouring cells, different cells may share a bucket
+    pairs.clear();
+    constexpr int nneigh = (D == 1) ? 3 : (D == 2) ? 9 : 27;
+    for (size_t i = 0; i < nm; i++)
+      {
+        long c[D];
+        cellcoord(i, c);
+        size_t buckets[nneigh];
+        for (int nb = 0; nb < nneigh; nb++)
+          {
+            long cn[D];
+            for (int k = 0, rest = nb; k < D; k++, rest /= 3)
+              cn[k] = c[k] + rest%3 - 1;
+            buckets[nb] = Bucket(cn);
+          }
+        std::sort(buckets, buckets+nneigh);
+        size_t nbuckets = std::unique(buckets, buckets+nneigh) - buckets;
+
+        for (size_t b = 0; b < nbuckets; b++)
+          for (size_t k = bucketstart[buckets[b]]; k < bucketstart[buckets[b]+1]; k++)
+            {
+              size_t j = bucketmasses[k];
+              if (j <= i) continue;
+              double dist2 = 0;
+              for (int l = 0; l < D; l++)
+                dist2 += (x(D*j+l)-x(D*i+l)) * (x(D*j+l)-x(D*i+l));
+              if (dist2 < h*h)
+                pairs.push_back({ i, j });
+            }
+      }
+    std::sort(pairs.begin(), pairs.end());
+  }
+};
+
+
 template <int D>
 class MSS_Function : public NonlinearFunction
 {
-  MassSpringSystem<D> & mss;
+  const MassSpringSystem<D> & mss;
+  bool forces;   // the forces instead of the accelerations, for M a = F(x)
+  mutable SpringArrays<D> arrays;   // rebuilt when springs or fixes were modified or reordered
+  std::shared_ptr<ThreadPool> pool;  // parallel assembly if set
+  mutable ContactPairs<D> contacts;
+  // contact pairs in the last DerivPattern
+  mutable std::vector<std::array<size_t,2>> pattern_pairs;
+  mutable bool has_pattern = false;
+
+  const SpringArrays<D> & Arrays() const
+  {
+    if (!arrays.UpToDate(mss))
+      arrays.Build(mss);
+    return arrays;
+  }
 public:
-  MSS_Function (MassSpringSystem<D> & _mss)
-    : mss(_mss) { }
+  MSS_Function (MassSpringSystem<D> & _mss, bool _forces = false)
+    : mss(_mss), forces(_forces) { }
+
+  const ContactPairs<D> & Contacts() const { return contacts; }
+
+  // candidate contact pairs at x, before DerivPattern is called
+  void UpdateContacts (VectorView<double> x) const
+  {
+    double kc = mss.ContactStiffness(), dist = mss.ContactDistance();
+    if (kc != 0 && dist > 0)
+      contacts.Update(x, dist, mss.Generation());
+  }
+
+  // the contact pairs were rebuilt with pairs outside of DerivPattern,
+  // the sparse Jacobian misses their coupling blocks until the pattern
+  // is set up again
+  bool ContactPatternOutdated () const
+  {
+    if (mss.ContactStiffness() == 0 || mss.ContactDistance() <= 0) return false;
+    auto & pairs = contacts.Pairs();
+    return has_pattern && !std::includes(pattern_pairs.begin(), pattern_pairs.end(),
+                                         pairs.begin(), pairs.end());
+  }
+
+  // forces, Jacobians and directional derivatives with the threads of
+  // the pool, the results are bitwise the same for every number of threads
+  void SetThreadPool (std::shared_ptr<ThreadPool> _pool) { pool = _pool; }
+
+  // factor of the rows of mass i
+  double InvMass (size_t i) const { return forces ? 1.0 : 1/mss.Masses()[i].mass; }
 
   virtual size_t DimX() const { return D*mss.Masses().size(); }
   virtual size_t DimF() const { return D*mss.Masses().size(); }
   
   virtual void Evaluate (VectorView<double> x, VectorView<double> f) const
   {
-    f = 0.0;
-    
-    auto xmat = x.AsMatrix(mss.Masses().size(), D);
-    auto fmat = f.AsMatrix(mss.Masses().size(), D);
-    
-    for (size_t i = 0; i < mss.Masses().size(); i++)
-      fmat.Row(i) = mss.Masses()[i].mass*mss.Gravity();
-    
-    for (auto spring : mss.Springs())
+    size_t nm = mss.Masses().size();
+    auto & gravity = mss.Gravity();
+    for (size_t i = 0; i < nm; i++)
+      for (int k = 0; k < D; k++)
+        f(D*i+k) = mss.Masses()[i].mass * gravity(k);
+
+    Arrays().AddForces(x, f, pool.get());
+    ForContacts (x, [&] (size_t i, size_t j, const double (&F)[D], const double (&)[D][D])
+    {
+      for (int k = 0; k < D; k++)
+        {
+          f(D*i+k) += F[k];
+          if (j != NOMASS) f(D*j+k) -= F[k];
+        }
+    });
+
+    if (!forces)
+      for (size_t i = 0; i < nm; i++)
+        for (int k = 0; k < D; k++)
+          f(D*i+k) *= 1/ mss.Masses()[i].mass;
+  }
+  
+  // d = p2 - p1 of a spring, returns its length
+  double SpringVector (const Spring & spring, VectorView<double> x, double (&d)[D]) const
+  {
+    auto [c1,c2] = spring.connections;
+    double len2 = 0;
+    for (int k = 0; k < D; k++)
       {
-        auto [c1,c2] = spring.connections;
-        Vector<double> p1 (xmat.Width()), p2(xmat.Width());
-        if (c1.type == Connector::FIX)
-          p1 = mss.Fixes()[c1.nr].pos;
-        else
-          p1 = xmat.Row(c1.nr);
-        if (c2.type == Connector::FIX)
-          p2 = mss.Fixes()[c2.nr].pos;
-        else
-          p2 = xmat.Row(c2.nr);
+        double p1 = (c1.type == Connector::FIX) ? mss.Fixes()[c1.nr].pos(k) : x(D*c1.nr+k);
+        double p2 = (c2.type == Connector::FIX) ? mss.Fixes()[c2.nr].pos(k) : x(D*c2.nr+k);
+        d[k] = p2-p1;
+        len2 += d[k]*d[k];
+      }
+    return std::sqrt(len2);
+  }
+
+  // force on c1: F = k (L-l0) n, n = (p2-p1)/L
+  void SpringForce (const Spring & spring, VectorView<double> x, double (&F)[D]) const
+  {
+    double d[D];
+    double len = SpringVector(spring, x, d);
+    double fac = spring.stiffness * (len-spring.length) / len;
+    for (int k = 0; k < D; k++)
+      F[k] = fac * d[k];
+  }
+
+  // force on the first end and closed form D x D stiffness block of a spring
+  // from d = p2 - p1: F = k (L-l0) n,
+  // K = d force_on_c1 / d p2 = k ( (1-l0/L) I + l0/L n n^T ), n = d/L
+  static void ForceStiffness (const double (&d)[D], double len0, double stiff,
+                              double (&F)[D], double (&K)[D][D])
+  {
+    double len2 = 0;
+    for (int k = 0; k < D; k++) len2 += d[k]*d[k];
+    double len = std::sqrt(len2);
+    double force = stiff * (len-len0);
+    for (int k = 0; k < D; k++)
+      F[k] = force * (1.0/len * d[k]);
+    double ratio = len0 / len;
+    for (int k = 0; k < D; k++)
+      for (int l = 0; l < D; l++)
+        K[k][l] = stiff * (ratio * d[k]*d[l]/len2 + (k==l ? 1-ratio : 0.0));
+  }
+
+  static constexpr size_t NOMASS = size_t(-1);
 
-        double force = spring.stiffness * (Vector<double>(p1 + (-1)*p2).L2Norm()-spring.length);
-        Vector<double> dir12 = 1.0/(Vector<double>(p1 + (-1)*p2).L2Norm()) * (p2+(-1)*p1);
-        if (c1.type == Connector::MASS)
-          fmat.Row(c1.nr) = fmat.Row(c1.nr) + force*dir12;
-        if (c2.type == Connector::MASS)
-          fmat.Row(c2.nr) = fmat.Row(c2.nr) + (-1) * force*dir12;
+  // func(i, j, F, K) for every active contact: F is the force on mass i
+  // and dF/dp_i = -K. Between two masses, mass j gets -F and dF/dp_j = K;
+  // for a plane j is NOMASS
+  template <typename FUNC>
+  void ForContacts (VectorView<double> x, FUNC && func) const
+  {
+    double kc = mss.ContactStiffness(), dist = mss.ContactDistance();
+    if (kc == 0 || dist <= 0) return;
+
+    UpdateContacts(x);
+    for (auto [i,j] : contacts.Pairs())
+      {
+        double d[D], F[D], K[D][D];
+        double len2 = 0;
+        for (int k = 0; k < D; k++)
+          {
+            d[k] = x(D*j+k) - x(D*i+k);
+            len2 += d[k]*d[k];
+          }
+        if (len2 >= dist*dist || len2 == 0) continue;
+        ForceStiffness(d, dist, kc, F, K);
+        func(i, j, F, K);
       }
 
-    for (size_t i = 0; i < mss.Masses().size(); i++)
-      fmat.Row(i) = (1/ mss.Masses()[i].mass)*fmat.Row(i) ;
+    for (auto & plane : mss.Planes())
+      for (size_t i = 0; i < mss.Masses().size(); i++)
+        {
+          double height = -plane.offset;
+          for (int k = 0; k < D; k++)
+            height += plane.normal(k) * x(D*i+k);
+          double penetration = dist/2 - height;
+          if (penetration <= 0) continue;
+          double F[D], K[D][D];
+          for (int k = 0; k < D; k++)
+            {
+              F[k] = kc * penetration * plane.normal(k);
+              for (int l = 0; l < D; l++)
+                K[k][l] = kc * plane.normal(k) * plane.normal(l);
+            }
+          func(i, NOMASS, F, K);
+        }
   }
-  
+
+  // df += fac * K in the D x D block (i,j)
+  static void AddBlock (MatrixView<double, ColMajor> & df, size_t i, size_t j,
+                        double fac, const double (&K)[D][D])
+  {
+    for (int k = 0; k < D; k++)
+      for (int l = 0; l < D; l++)
+        df(D*i+k, D*j+l) += fac*K[k][l];
+  }
+
+  // the same in a SparseMatrix, by the value positions of the rows of the block
+  static void AddBlock (SparseMatrix & df, const size_t * pos, double fac, const double (&K)[D][D])
+  {
+    for (int k = 0; k < D; k++)
+      for (int l = 0; l < D; l++)
+        df.Value(pos[k]+l) += fac*K[k][l];
+  }
+
+  // forces and Jacobian with one geometry computation per spring;
+  // without f only the Jacobian is assembled. The rows are scaled by
+  // the inverse masses; TJAC is a dense MatrixView or a SparseMatrix
+  // containing DerivPattern, written through the positions of the spring
+  // arrays. Blocks of springs of one colour write to disjoint rows
+  template <typename TJAC>
+  void AssembleWithDeriv (VectorView<double> x, VectorView<double> * f, TJAC & df) const
+  {
+    constexpr bool sparse = std::is_same_v<TJAC, SparseMatrix>;
+    size_t nm = mss.Masses().size();
+    if (f)
+      {
+        auto & gravity = mss.Gravity();
+        for (size_t i = 0; i < nm; i++)
+          for (int k = 0; k < D; k++)
+            (*f)(D*i+k) = mss.Masses()[i].mass*gravity(k);
+      }
+
+    auto & sa = Arrays();
+    if constexpr (sparse)
+      arrays.FindPositions(df);
+
+    sa.ForMassMassBlocks (pool.get(), [&] (size_t first, size_t nb)
+    {
+      for (size_t i = first; i < first+nb; i++)
+        {
+          size_t i1 = sa.m1[i], i2 = sa.m2[i];
+          double d[D], F[D], K[D][D];
+          for (int k = 0; k < D; k++)
+            d[k] = x(D*i2+k) - x(D*i1+k);
+          ForceStiffness(d, sa.length[i], sa.stiffness[i], F, K);
+          if (f)
+            for (int k = 0; k < D; k++)
+              {
+                (*f)(D*i1+k) += F[k];
+                (*f)(D*i2+k) -= F[k];
+              }
+          double s1 = InvMass(i1), s2 = InvMass(i2);
+          if constexpr (sparse)
+            {
+              AddBlock(df, &sa.diagpos[D*i1], -s1, K);
+              AddBlock(df, &sa.diagpos[D*i2], -s2, K);
+              AddBlock(df, &sa.pos12[D*i], s1, K);
+              AddBlock(df, &sa.pos21[D*i], s2, K);
+            }
+          else
+            {
+              AddBlock(df, i1, i1, -s1, K);
+              AddBlock(df, i2, i2, -s2, K);
+              AddBlock(df, i1, i2, s1, K);
+              AddBlock(df, i2, i1, s2, K);
+            }
+        }
+    });
+
+    sa.ForMassFixBlocks (pool.get(), [&] (size_t first, size_t nb)
+    {
+      for (size_t i = first; i < first+nb; i++)
+        {
+          size_t im = sa.mf[i];
+          double d[D], F[D], K[D][D];
+          for (int k = 0; k < D; k++)
+            d[k] = sa.fixpos[k][i] - x(D*im+k);
+          ForceStiffness(d, sa.flength[i], sa.fstiffness[i], F, K);
+          if (f)
+            for (int k = 0; k < D; k++)
+              (*f)(D*im+k) += F[k];
+          if constexpr (sparse)
+            AddBlock(df, &sa.diagpos[D*im], -InvMass(im), K);
+          else
+            AddBlock(df, im, im, -InvMass(im), K);
+        }
+    });
+
+    // contact pairs found after the last DerivPattern may be outside of
+    // the pattern, the sparse Jacobian gets only their diagonal blocks
+    ForContacts (x, [&] (size_t i, size_t j, const double (&F)[D], const double (&K)[D][D])
+    {
+      if (f)
+        for (int k = 0; k < D; k++)
+          {
+            (*f)(D*i+k) += F[k];
+            if (j != NOMASS) (*f)(D*j+k) -= F[k];
+          }
+      double si = InvMass(i);
+      double sj = (j != NOMASS) ? InvMass(j) : 0.0;
+      if constexpr (sparse)
+        {
+          AddBlock(df, &sa.diagpos[D*i], -si, K);
+          if (j == NOMASS) return;
+          AddBlock(df, &sa.diagpos[D*j], -sj, K);
+          size_t pij[D], pji[D];
+          for (int k = 0; k < D; k++)
+            {
+              pij[k] = df.Position(D*i+k, D*j);
+              pji[k] = df.Position(D*j+k, D*i);
+            }
+          if (pij[0] == SparseMatrix::npos) return;
+          AddBlock(df, pij, si, K);
+          AddBlock(df, pji, sj, K);
+        }
+      else
+        {
+          AddBlock(df, i, i, -si, K);
+          if (j == NOMASS) return;
+          AddBlock(df, j, j, -sj, K);
+          AddBlock(df, i, j, si, K);
+          AddBlock(df, j, i, sj, K);
+        }
+    });
+
+    if (f && !forces)
+      for (size_t i = 0; i < nm; i++)
+        for (int k = 0; k < D; k++)
+          (*f)(D*i+k) *= 1/ mss.Masses()[i].mass;
+  }
+
+  // exact Jacobian, assembled spring by spring
   virtual void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const
   {
-    // TODO: exact differentiation
-    double eps = 1e-8;
+    df = 0.0;
+    AssembleWithDeriv(x, nullptr, df);
+  }
+
+  virtual void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                                  MatrixView<double, ColMajor> df) const
+  {
+    df = 0.0;
+    AssembleWithDeriv(x, &f, df);
+  }
+
+  // one D x D block per mass, per spring connecting two masses and per
+  // candidate contact pair of the last evaluation or UpdateContacts
+  virtual SparsityPattern DerivPattern () const
+  {
+    SparsityPattern pattern(DimF(), DimX());
+    for (size_t i = 0; i < mss.Masses().size(); i++)
+      pattern.AddDense(D*i, D*(i+1), D*i, D*(i+1));
+    auto add = [&] (size_t i, size_t j)
+    {
+      pattern.AddDense(D*i, D*(i+1), D*j, D*(j+1));
+      pattern.AddDense(D*j, D*(j+1), D*i, D*(i+1));
+    };
+    for (auto & spring : mss.Springs())
+      {
+        auto [c1,c2] = spring.connections;
+        if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+          add(c1.nr, c2.nr);
+      }
+    pattern_pairs.clear();
+    if (mss.ContactStiffness() != 0 && mss.ContactDistance() > 0)
+      pattern_pairs = contacts.Pairs();
+    has_pattern = true;
+    for (auto [i,j] : pattern_pairs)
+      add(i, j);
+    return pattern;
+  }
+
+  virtual void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const
+  {
+    df = 0.0;
+    AssembleWithDeriv(x, nullptr, df);
+  }
+
+  virtual void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                        SparseMatrix & df) const
+  {
+    df = 0.0;
+    AssembleWithDeriv(x, &f, df);
+  }
+
+  // directional derivative spring by spring, no Jacobian is formed:
+  // the force on the first end changes by K (v2 - v1), fixes do not move
+  virtual void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const
+  {
+    jv = 0.0;
+    auto & sa = Arrays();
+    sa.ForMassMassBlocks (pool.get(), [&] (size_t first, size_t nb)
+    {
+      for (size_t i = first; i < first+nb; i++)
+        {
+          size_t i1 = sa.m1[i], i2 = sa.m2[i];
+          double d[D], dv[D], F[D], K[D][D];
+          for (int k = 0; k < D; k++)
+            {
+              d[k] = x(D*i2+k) - x(D*i1+k);
+              dv[k] = v(D*i2+k) - v(D*i1+k);
+            }
+          ForceStiffness(d, sa.length[i], sa.stiffness[i], F, K);
+          for (int k = 0; k < D; k++)
+            {
+              double kdv = 0;
+              for (int l = 0; l < D; l++)
+                kdv += K[k][l] * dv[l];
+              jv(D*i1+k) += kdv * InvMass(i1);
+              jv(D*i2+k) -= kdv * InvMass(i2);
+            }
+        }
+    });
+
+    sa.ForMassFixBlocks (pool.get(), [&] (size_t first, size_t nb)
+    {
+      for (size_t i = first; i < first+nb; i++)
+        {
+          size_t im = sa.mf[i];
+          double d[D], F[D], K[D][D];
+          for (int k = 0; k < D; k++)
+            d[k] = sa.fixpos[k][i] - x(D*im+k);
+          ForceStiffness(d, sa.flength[i], sa.fstiffness[i], F, K);
+          for (int k = 0; k < D; k++)
+            {
+              double kv = 0;
+              for (int l = 0; l < D; l++)
+                kv += K[k][l] * v(D*im+l);
+              jv(D*im+k) -= kv * InvMass(im);
+            }
+        }
+    });
+
+    ForContacts (x, [&] (size_t i, size_t j, const double (&)[D], const double (&K)[D][D])
+    {
+      double dv[D];
+      for (int k = 0; k < D; k++)
+        dv[k] = ((j != NOMASS) ? v(D*j+k) : 0.0) - v(D*i+k);
+      for (int k = 0; k < D; k++)
+        {
+          double kdv = 0;
+          for (int l = 0; l < D; l++)
+            kdv += K[k][l] * dv[l];
+          jv(D*i+k) += kdv * InvMass(i);
+          if (j != NOMASS) jv(D*j+k) -= kdv * InvMass(j);
+        }
+    });
+  }
+
+  // central finite differences, 2*DimX evaluations, kept for checking
+  void EvaluateDerivFD (VectorView<double> x, MatrixView<double, ColMajor> df, double eps = 1e-8) const
+  {
     Vector<double> xl(DimX()), xr(DimX()), fl(DimF()), fr(DimF());
     for (size_t i = 0; i < DimX(); i++)
       {
@@ -200,7 +1098,194 @@ public:
         df.Col(i) = 1/(2*eps) * (fr + (-1) * fl);
       }
   }
+
+  // check mode: max deviation of the exact dense and sparse Jacobians and
+  // of the directional derivatives in the unit directions from finite differences
+  double CheckDeriv (VectorView<double> x, double eps = 1e-6) const
+  {
+    UpdateContacts(x);
+    Matrix<double, ColMajor> exact(DimF(), DimX()), fd(DimF(), DimX()), sparse(DimF(), DimX());
+    EvaluateDeriv(x, exact);
+    EvaluateDerivFD(x, fd, eps);
+    SparseMatrix sparse_exact(DerivPattern());
+    EvaluateSparseDeriv(x, sparse_exact);
+    sparse_exact.ToDense(sparse);
+
+    double err = 0;
+    Vector<double> e(DimX()), jv(DimF());
+    for (size_t j = 0; j < DimX(); j++)
+      {
+        e = 0.0;
+        e(j) = 1;
+        ApplyDeriv(x, e, jv);
+        for (size_t i = 0; i < DimF(); i++)
+          {
+            err = std::max(err, std::fabs(exact(i,j)-fd(i,j)));
+            err = std::max(err, std::fabs(sparse(i,j)-fd(i,j)));
+            err = std::max(err, std::fabs(jv(i)-fd(i,j)));
+          }
+      }
+    return err;
+  }
   
 };
 
+
+
+// linear solver of the implicit methods by name, for the Python interface:
+// "direct" (dense LU), "sparse" (sparse LU) or "cg" (preconditioned CG
+// with "none", "jacobi", "blockjacobi" (D x D per mass) or "ic0")
+template <int D>
+NewtonOptions MSSNewtonOptions (const std::string & solver, const std::string & preconditioner = "ic0")
+{
+  NewtonOptions newton;
+  if (solver == "sparse")
+    newton.sparse = true;
+  else if (solver == "cg")
+    {
+      newton.cg = true;
+      newton.preconditioner = MakePreconditioner(preconditioner, D);
+    }
+  else if (solver != "direct")
+    throw std::invalid_argument("unknown solver '"+solver+"', use direct, sparse or cg");
+  return newton;
+}
+
+
+// time integrators for the mass-spring system: the implicit generalized alpha
+// method, or explicit symplectic methods evaluating only the forces
+enum MSS_METHOD { MSS_ALPHA, MSS_VERLET, MSS_LEAPFROG, MSS_YOSHIDA4 };
+
+inline MSS_METHOD ParseMSSMethod (const std::string & name)
+{
+  if (name == "alpha") return MSS_ALPHA;
+  if (name == "verlet") return MSS_VERLET;
+  if (name == "leapfrog") return MSS_LEAPFROG;
+  if (name == "yoshida4") return MSS_YOSHIDA4;
+  throw std::invalid_argument("unknown method '"+name+"', use alpha, verlet, leapfrog or yoshida4");
+}
+
+
+// persistent simulation of a mass-spring system: equations, Jacobian
+// factorization and accelerations are kept between calls, so the system
+// can be advanced in small chunks.
+// The implicit method solves M a = F(x) with the diagonal mass matrix, its
+// Newton matrix M - c K is symmetric; the explicit ones use a = F(x) / m
+template <int D>
+class MSS_Simulator
+{
+  MassSpringSystem<D> & mss;
+  double rhoinf;
+  NewtonOptions newton;
+  MSS_METHOD method;
+  std::shared_ptr<MSS_Function<D>> func;
+  std::shared_ptr<ThreadPool> pool;
+  std::shared_ptr<DiagonalFunction> mass;
+  std::shared_ptr<MSS_Function<D>> forcefunc;   // of the implicit method
+  std::unique_ptr<SecondOrderStepper> stepper;
+  // of the system when the stepper was started
+  size_t generation = 0, modification = 0;
+
+  std::unique_ptr<SecondOrderStepper> MakeStepper (VectorView<double> x)
+  {
+    forcefunc = nullptr;
+    switch (method)
+      {
+      case MSS_VERLET: return std::make_unique<VelocityVerlet>(func);
+      case MSS_LEAPFROG: return std::make_unique<Leapfrog>(func);
+      case MSS_YOSHIDA4: return std::make_unique<Yoshida4>(func);
+      default:
+        mass = std::make_shared<DiagonalFunction>(x.Size(), 1.0);
+        mss.GetMassDiagonal(mass->Diagonal());
+        forcefunc = std::make_shared<MSS_Function<D>>(mss, true);
+        forcefunc->SetThreadPool(pool);
+        // the Jacobian pattern contains the contact pairs at x
+        forcefunc->UpdateContacts(x);
+        return std::make_unique<GeneralizedAlpha>(forcefunc, mass, rhoinf, newton);
+      }
+  }
+
+  void Start (VectorView<double> x, VectorView<double> dx, VectorView<double> ddx, double t0)
+  {
+    stepper = MakeStepper(x);
+    stepper->Init(x, dx, ddx, t0);
+    generation = mss.Generation();
+    modification = mss.Modification();
+  }
+
+  // masses changed from outside
+  bool MassesChanged ()
+  {
+    if (!mass) return false;
+    auto diag = mass->Diagonal();
+    for (size_t i = 0; i < mss.Masses().size(); i++)
+      if (diag(D*i) != mss.Masses()[i].mass)
+        return true;
+    return false;
+  }
+public:
+  MSS_Simulator (MassSpringSystem<D> & _mss, double _rhoinf = 0.8,
+                 const NewtonOptions & _newton = NewtonOptions(),
+                 MSS_METHOD _method = MSS_ALPHA, size_t threads = 1)
+    : mss(_mss), rhoinf(_rhoinf), newton(_newton), method(_method),
+      func(std::make_shared<MSS_Function<D>>(_mss))
+  {
+    if (threads > 1)
+      pool = std::make_shared<ThreadPool>(threads);
+    func->SetThreadPool(pool);
+  }
+
+  double Time() const { return stepper ? stepper->Time() : 0.0; }
+  const NewtonState * GetNewtonState() const { return stepper ? &stepper->GetNewtonState() : nullptr; }
+
+  // advance by time interval 'tend' in 'steps' equal steps and store the new state in the system
+  void Simulate (double tend, size_t steps)
+  {
+    size_t n = D*mss.Masses().size();
+    Vector<double> x(n), dx(n), ddx(n);
+    mss.GetState(x, dx, ddx);
+
+    if (!stepper || stepper->X().Size() != n || MassesChanged()
+        || generation != mss.Generation() || modification != mss.Modification())
+      {
+        // (re)start, e.g. after masses or springs were changed or the
+        // system was reordered: the Jacobian pattern may be different
+        Start(x, dx, ddx, Time());
+      }
+    else
+      {
+        // restart from the system if its state was changed from outside
+        bool changed = false;
+        for (size_t i = 0; i < n; i++)
+          if (x(i) != stepper->X()(i) || dx(i) != stepper->V()(i) || ddx(i) != stepper->A()(i))
+            changed = true;
+        if (changed)
+          stepper->Init(x, dx, ddx, stepper->Time());
+      }
+
+    stepper->SetStepSize(tend/steps);
+    if (!forcefunc || !(newton.sparse || newton.cg))
+      stepper->Advance(stepper->Time()+tend);
+    else
+      {
+        // step by step: after the contact pairs were rebuilt with pairs
+        // outside of the sparse Jacobian, restart with a new pattern
+        double t0 = stepper->Time();
+        for (size_t i = 1; i <= steps; i++)
+          {
+            if (forcefunc->ContactPatternOutdated())
+              {
+                x = stepper->X();
+                dx = stepper->V();
+                ddx = stepper->A();
+                Start(x, dx, ddx, stepper->Time());
+                stepper->SetStepSize(tend/steps);
+              }
+            stepper->Advance(t0 + i*tend/steps);
+          }
+      }
+    mss.SetState(stepper->X(), stepper->V(), stepper->A());
+  }
+};
+
 #endif
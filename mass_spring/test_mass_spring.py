@@ -26,6 +26,24 @@ Simulate (mss, 0.1, 10)
 
 print ("state = ", mss.GetState())
 
+# the Simulator keeps the integrator, stepping in chunks is as cheap as one long run
+sim = Simulator(mss)
+for i in range(10):
+    sim.Simulate (0.01, 1)
+print ("t = ", sim.time, "state = ", mss.GetState())
+
+# reading the springs keeps the running Simulator, SetSpring takes effect in it
+for s in mss.springs:
+    print ("length =", s.length, "stiffness =", s.stiffness)
+sim.Simulate (0.01, 1)
+mss.SetSpring (1, length=1, stiffness=40)
+sim.Simulate (0.01, 1)
+print ("stiffness changed: t = ", sim.time, "state = ", mss.GetState())
+
+# explicit symplectic integrator, only force evaluations per step
+Simulate (mss, 0.1, 100, method="verlet")
+print ("verlet: state = ", mss.GetState())
+
 for m in mss.masses:
     print (m.mass, m.pos)
 
@@ -33,3 +51,25 @@ mss.masses[0].mass = 5
 
 for m in mss.masses:
     print (m.mass, m.pos)
+
+# implicit alpha with preconditioned conjugate gradients for the Newton systems
+Simulate (mss, 0.1, 10, solver="cg", preconditioner="ic0")
+print ("cg: state = ", mss.GetState())
+
+# parallel assembly of forces and Jacobians, same result for any number of threads
+Simulate (mss, 0.1, 10, solver="sparse", threads=4)
+print ("4 threads: state = ", mss.GetState())
+
+# renumber masses and springs for cache locality, the handles from Add
+# are mapped by the permutation: old mass i is now mass perm.masses[i]
+posA = mss[mA].pos
+perm = mss.Reorder()
+print ("reordered masses:", perm.masses, "springs:", perm.springs)
+mA, mB = perm(mA), perm(mB)
+print ("mA:", mA, "pos:", mss[mA].pos, "before:", posA)
+
+# contact: masses keep a distance of 0.2 from each other and stay above the floor z = -1
+mss.SetContact (distance=0.2, stiffness=1e4)
+mss.AddPlane (normal=(0,0,1), offset=-1)
+Simulate (mss, 0.1, 10)
+print ("with contact: state = ", mss.GetState())
@@ -1,36 +1,474 @@
 #ifndef Newton_h
 #define Newton_h
 
+#include <memory>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <cmath>
+#include <stdexcept>
 #include "nonlinfunc.h"
+#include "linsolve.h"
+#include "krylov.h"
 
 namespace ASC_ode
 {
 
   using namespace ASC_bla;
 
-  void NewtonSolver (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
-                     double tol = 1e-10, int maxsteps = 50,
-                     std::function<void(int,double,VectorView<double>)> callback = nullptr)
+  struct NewtonOptions
   {
-    Vector<double> res (func->DimF());
-    Matrix<double, ColMajor> fprime(func->DimF(), func->DimX());
+    double tol = 1e-10;
+    int maxsteps = 50;
+    // simplified Newton: keep the factored Jacobian over iterations and
+    // over several calls (time steps), refactor only if contraction gets bad
+    bool simplified = false;
+    double max_contraction = 0.5;  // refactor if |dx_k| / |dx_{k-1}| exceeds this
+    // Jacobian is symmetric: factor with L D L^T instead of LU
+    bool symmetric = false;
+    // assemble the Jacobian with the sparse derivative path and use SparseLU
+    bool sparse = false;
+    // SparseLU does not pivot: after a zero pivot factor the Jacobian as a
+    // dense matrix with pivoting, O(n^2) memory and O(n^3) time. Otherwise
+    // the zero pivot makes Newton fail
+    bool dense_fallback = false;
+    // damped Newton: halve the correction until the next correction
+    // decreases (sufficient decrease test), at most line_search_steps times,
+    // then Newton fails
+    bool line_search = false;
+    int line_search_steps = 8;
+    // give up early if the correction grows in this many successive
+    // iterations with a fresh Jacobian, 0 to always run maxsteps
+    int max_diverging = 3;
+    // time steppers: initial guess by extrapolation of the last predictor+1
+    // steps, 0 starts from the previous value, 1 linear, 2 quadratic
+    int predictor = 0;
+    // Jacobian-free Newton-Krylov: J w = F is solved inexactly by GMRES
+    // with directional derivatives (ApplyDeriv), the Jacobian is never
+    // assembled. The relative tolerance is the Eisenstat-Walker forcing
+    // term, at most eta_max
+    bool matrix_free = false;
+    int krylov_restart = 30;
+    int krylov_maxsteps = 200;
+    double eta_max = 0.9;
+    std::shared_ptr<Preconditioner> preconditioner;   // none if empty
+    // symmetric definite Jacobian: assemble it sparse and solve with
+    // preconditioned CG instead of a factorization. The preconditioner
+    // above is set up where the direct solvers factor. The first solve of
+    // every Newton call is warm started from the first correction of the last call
+    bool cg = false;
+    double cg_tol = 1e-8;       // relative, but not below 0.1 tol
+    int cg_maxsteps = 500;
+  };
 
-    for (int i = 0; i < maxsteps; i++)
+
+  // Newton iterations per time step
+  struct NewtonStatistics
+  {
+    size_t steps = 0;
+    size_t iterations = 0;
+    size_t max_iterations = 0;
+    size_t rejected = 0;             // steps repeated with half the size
+    std::vector<size_t> histogram;   // histogram[k]: steps with k iterations
+
+    void Add (size_t its)
+    {
+      steps++;
+      iterations += its;
+      max_iterations = std::max(max_iterations, its);
+      if (histogram.size() <= its)
+        histogram.resize(its+1, 0);
+      histogram[its]++;
+    }
+    double Average() const { return steps ? double(iterations) / steps : 0.0; }
+  };
+
+  inline std::ostream & operator<< (std::ostream & ost, const NewtonStatistics & stat)
+  {
+    ost << "steps = " << stat.steps << ", iterations per step = " << stat.Average()
+        << ", max = " << stat.max_iterations << ", rejected = " << stat.rejected
+        << ", histogram =";
+    for (auto h : stat.histogram)
+      ost << " " << h;
+    return ost;
+  }
+
+
+  // everything which survives between Newton calls, e.g. over time steps
+  class NewtonState
+  {
+  public:
+    enum SOLVER { DENSE_LU, DENSE_LDLT, SPARSE, CG };
+
+    std::unique_ptr<Matrix<double, ColMajor>> jacobian;
+    std::unique_ptr<SparseMatrix> sparse_jacobian;
+    DenseLU lu;
+    DenseLDLt ldlt;
+    SparseLU sparse_lu;     // keeps the symbolic factorization of the fixed pattern
+    SOLVER solver = DENSE_LU;
+    GMRES gmres;            // matrix-free: the Krylov basis, O(restart n)
+    mutable ConjugateGradient cg;
+    std::vector<double> cg_guess;           // the first correction of the last call
+    const Preconditioner * cg_pre = nullptr;
+    double cg_rtol = 0, cg_atol = 0;
+    int cg_maxsteps = 0;
+    bool factored = false;  // matrix-free: the preconditioner is set up
+
+    size_t num_factorizations = 0;
+    size_t num_dense_fallbacks = 0;   // sparse factorizations done dense after a zero pivot
+    size_t num_iterations = 0;
+    size_t num_failures = 0;
+    size_t num_line_search_reductions = 0;
+    size_t num_krylov_iterations = 0;
+    mutable size_t num_cg_iterations = 0;
+    // heap allocations of the scratch workspace during Newton calls,
+    // stays constant once the workspace has grown to the peak size
+    size_t num_workspace_allocations = 0;
+
+    // forget the factorization, e.g. after dt was changed
+    void Reset() { factored = false; }
+
+    void Allocate (const NonlinearFunction & func, const NewtonOptions & opts)
+    {
+      size_t n = func.DimF();
+      if (opts.sparse || opts.cg)
+        {
+          if (!sparse_jacobian || sparse_jacobian->Height() != n)
+            {
+              sparse_jacobian = std::make_unique<SparseMatrix>(func.DerivPattern());
+              sparse_lu = SparseLU();
+              factored = false;
+            }
+        }
+      else if (!jacobian || jacobian->Height() != n)
+        {
+          jacobian = std::make_unique<Matrix<double, ColMajor>>(n, func.DimX());
+          factored = false;
+        }
+    }
+
+    // residual and Jacobian in one call, sharing the work inside func
+    void EvaluateWithDeriv (const NonlinearFunction & func, VectorView<double> x,
+                            VectorView<double> f, const NewtonOptions & opts)
+    {
+      if (opts.sparse || opts.cg)
+        func.EvaluateWithSparseDeriv(x, f, *sparse_jacobian);
+      else
+        func.EvaluateWithDeriv(x, f, *jacobian);
+    }
+
+    void Factor (const NewtonOptions & opts)
+    {
+      factored = true;
+      num_factorizations++;
+
+      if (opts.cg)
+        {
+          cg_pre = opts.preconditioner.get();
+          if (cg_pre)
+            opts.preconditioner->Setup(*sparse_jacobian);
+          cg_rtol = opts.cg_tol;
+          cg_atol = 0.1 * opts.tol;
+          cg_maxsteps = opts.cg_maxsteps;
+          solver = CG;
+          return;
+        }
+
+      if (opts.sparse)
+        {
+          try
+            {
+              if (!sparse_lu.Analyzed())
+                sparse_lu.Analyze(*sparse_jacobian, opts.symmetric);
+              sparse_lu.Factor(*sparse_jacobian);
+              solver = SPARSE;
+              return;
+            }
+          catch (std::domain_error &)
+            {
+              // no pivoting in the sparse factorization, fall back to dense LU
+              if (!opts.dense_fallback)
+                throw;
+              num_dense_fallbacks++;
+              if (!jacobian || jacobian->Height() != sparse_jacobian->Height())
+                jacobian = std::make_unique<Matrix<double, ColMajor>>(sparse_jacobian->Height(),
+                                                                      sparse_jacobian->Width());
+              sparse_jacobian->ToDense(*jacobian);
+              lu.Factor(*jacobian);
+              solver = DENSE_LU;
+              return;
+            }
+        }
+
+      solver = opts.symmetric ? DENSE_LDLT : DENSE_LU;
+      if (solver == DENSE_LDLT)
+        {
+          try { ldlt.Factor(*jacobian); }
+          catch (std::domain_error &) { solver = DENSE_LU; }
+        }
+      if (solver == DENSE_LU)
+        lu.Factor(*jacobian);
+    }
+
+    void Solve (VectorView<double> b) const
+    {
+      switch (solver)
+        {
+        case DENSE_LU: lu.Solve(b); break;
+        case DENSE_LDLT: ldlt.Solve(b); break;
+        case SPARSE: sparse_lu.Solve(b); break;
+        case CG: SolveCG(b, nullptr); break;
+        }
+    }
+
+    // the first correction of a Newton call, CG starts from the last one
+    void SolveFirst (VectorView<double> b)
+    {
+      if (solver != CG)
+        {
+          Solve(b);
+          return;
+        }
+      cg_guess.resize(b.Size(), 0.0);
+      VectorView<double> guess(b.Size(), cg_guess.data());
+      SolveCG(b, &guess);
+    }
+
+  private:
+    // b = A^{-1} b, guess is the initial guess on input and the solution on output
+    void SolveCG (VectorView<double> b, VectorView<double> * guess) const
+    {
+      auto mult = [this] (VectorView<double> x, VectorView<double> y) { sparse_jacobian->Mult(x, y); };
+      WorkspaceScope ws;
+      VectorView<double> x = guess ? *guess : ws.Vec(b.Size());
+      num_cg_iterations += cg.Solve(mult, cg_pre, b, x, cg_rtol, cg_atol, cg_maxsteps, guess != nullptr);
+      b = x;
+    }
+  };
+
+
+  // inexact Newton: the correction solves J w = F up to the relative
+  // residual eta by GMRES, which needs only products J v = ApplyDeriv.
+  // eta by Eisenstat-Walker (choice 2): 0.9 (|F_k| / |F_{k-1}|)^2, not
+  // much smaller than in the last iteration while eta is large. Memory
+  // is O(krylov_restart n). With simplified Newton the preconditioner is
+  // set up only when state.factored is reset
+  inline void NewtonKrylovSolver (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                                  const NewtonOptions & opts, NewtonState & state,
+                                  std::function<void(int,double,VectorView<double>)> callback = nullptr)
+  {
+    size_t n = func->DimF();
+    Workspace & ws = LocalWorkspace();
+    if (ws.InUse() == 0) ws.Reset();
+    size_t allocs = ws.NumAllocations();
+    WorkspaceScope scope(ws);
+    VectorView<double> res = scope.Vec(n);
+    VectorView<double> w = scope.Vec(n);
+    auto iteration_mark = ws.GetMark();
+
+    auto fail = [&] (const char * msg)
+    {
+      state.num_workspace_allocations += ws.NumAllocations() - allocs;
+      state.num_failures++;
+      state.factored = false;
+      throw std::domain_error(msg);
+    };
+
+    auto jacobian = [&] (VectorView<double> v, VectorView<double> jv)
+    {
+      func->ApplyDeriv(x, v, jv);
+    };
+
+    // eta_0 = 0.5 as by Eisenstat and Walker
+    double olderr = 0, eta = std::min(opts.eta_max, 0.5);
+    int diverging = 0;
+    for (int i = 0; i < opts.maxsteps; i++)
       {
+        ws.Release(iteration_mark);
         func->Evaluate(x, res);
-        std::cout << "|res| = " << std::endl;
-        func->EvaluateDeriv(x, fprime);
-        std::cout<<"is mir egal"<<std::endl;
-        fprime = fprime.invert();
-        //VectorView<double> tmp (fprime.Width(), );
-        x = Vector<double>(x) + (-1)* Vector<double>(fprime*res);
-        double err= res.L2Norm();
+
+        double err = res.L2Norm();
+        if (callback)
+          callback(i, err, x);
+        if (err < opts.tol)
+          {
+            state.num_workspace_allocations += ws.NumAllocations() - allocs;
+            return;
+          }
+        if (!std::isfinite(err))
+          fail("Newton: residual is not finite");
+
+        // divergence: the residual grows
+        if (i > 0 && err > olderr)
+          diverging++;
+        else
+          diverging = 0;
+        if (opts.max_diverging > 0 && diverging >= opts.max_diverging)
+          fail("Newton diverges");
+
+        if (i > 0)
+          {
+            double ratio = err / olderr;
+            double etanew = 0.9 * ratio * ratio;
+            if (0.9 * eta * eta > 0.1)
+              etanew = std::max(etanew, 0.9 * eta * eta);
+            eta = std::min(opts.eta_max, etanew);
+          }
+        // no need to solve beyond the Newton tolerance
+        eta = std::max(eta, 0.5 * opts.tol / err);
+
+        if (opts.preconditioner && (!opts.simplified || !state.factored))
+          {
+            opts.preconditioner->Setup(*func, x);
+            state.factored = true;
+          }
+
+        w = 0.0;
+        state.num_krylov_iterations +=
+          state.gmres.Solve(jacobian, opts.preconditioner.get(), res, w,
+                            eta, opts.krylov_restart, opts.krylov_maxsteps);
+        state.num_iterations++;
+
+        if (!std::isfinite(w.L2Norm()))
+          fail("Newton: correction is not finite");
+
+        for (size_t j = 0; j < n; j++)
+          x(j) -= w(j);
+
+        if (opts.simplified && i > 0 && err > opts.max_contraction * olderr)
+          state.factored = false;
+        olderr = err;
+      }
+
+    fail("Newton did not converge");
+  }
+
+
+  inline void NewtonSolver (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                            const NewtonOptions & opts, NewtonState & state,
+                            std::function<void(int,double,VectorView<double>)> callback = nullptr)
+  {
+    if (opts.matrix_free)
+      {
+        NewtonKrylovSolver(func, x, opts, state, callback);
+        return;
+      }
+
+    size_t n = func->DimF();
+    state.Allocate(*func, opts);
+
+    // residual, correction and all temporaries of the function evaluations
+    // come from the thread's workspace, which is rewound after every iteration
+    Workspace & ws = LocalWorkspace();
+    if (ws.InUse() == 0) ws.Reset();
+    size_t allocs = ws.NumAllocations();
+    WorkspaceScope scope(ws);
+    VectorView<double> res = scope.Vec(n);
+    VectorView<double> w = scope.Vec(n);
+    VectorView<double> xtrial = scope.Vec(opts.line_search ? x.Size() : 0);
+    VectorView<double> restrial = scope.Vec(opts.line_search ? n : 0);
+    auto iteration_mark = ws.GetMark();
+
+    auto fail = [&] (const char * msg)
+    {
+      state.num_workspace_allocations += ws.NumAllocations() - allocs;
+      state.num_failures++;
+      state.factored = false;
+      throw std::domain_error(msg);
+    };
+
+    double oldnorm = 0;
+    int diverging = 0;
+    for (int i = 0; i < opts.maxsteps; i++)
+      {
+        ws.Release(iteration_mark);
+
+        // the Jacobian is evaluated together with the residual whenever it
+        // is needed, it is wasted only in the final, converged iteration
+        bool newjacobian = !opts.simplified || !state.factored;
+        if (newjacobian)
+          state.EvaluateWithDeriv(*func, x, res, opts);
+        else
+          func->Evaluate(x, res);
+
+        double err = res.L2Norm();
         if (callback)
           callback(i, err, x);
-        if (err < tol) return;
+        if (err < opts.tol)
+          {
+            state.num_workspace_allocations += ws.NumAllocations() - allocs;
+            return;
+          }
+        if (!std::isfinite(err))
+          fail("Newton: residual is not finite");
+
+        if (newjacobian)
+          state.Factor(opts);
+
+        for (size_t j = 0; j < n; j++)
+          w(j) = res(j);
+        if (i == 0)
+          state.SolveFirst(w);
+        else
+          state.Solve(w);
+        state.num_iterations++;
+
+        double norm = w.L2Norm();
+        if (!std::isfinite(norm))
+          fail("Newton: correction is not finite");
+
+        // divergence: the correction grows although the Jacobian is fresh
+        if (newjacobian && i > 0 && norm > oldnorm)
+          diverging++;
+        else
+          diverging = 0;
+        if (opts.max_diverging > 0 && diverging >= opts.max_diverging)
+          fail("Newton diverges");
+
+        double lam = 1;
+        if (opts.line_search)
+          {
+            // backtracking with the natural monotonicity test: the simplified
+            // correction J^{-1} F(x - lam w) must be smaller than (1 - lam/4) |w|.
+            // Unlike |F| it is invariant to the scaling of the equations.
+            // Fails if there is no decrease after line_search_steps halvings
+            for (int k = 0; ; k++)
+              {
+                for (size_t j = 0; j < x.Size(); j++)
+                  xtrial(j) = x(j) - lam * w(j);
+                func->Evaluate(xtrial, restrial);
+                state.Solve(restrial);
+                double normtrial = restrial.L2Norm();
+                if (normtrial <= (1-lam/4) * norm)
+                  break;
+                if (k == opts.line_search_steps)
+                  fail("Newton: line search failed");
+                lam /= 2;
+                state.num_line_search_reductions++;
+              }
+          }
+        for (size_t j = 0; j < n; j++)
+          x(j) -= lam * w(j);
+
+        if (opts.simplified && i > 0 && norm > opts.max_contraction * oldnorm)
+          state.factored = false;
+        oldnorm = norm;
       }
 
-    throw std::domain_error("Newton did not converge");
+    fail("Newton did not converge");
+  }
+
+
+  inline void NewtonSolver (std::shared_ptr<NonlinearFunction> func, VectorView<double> x,
+                            double tol = 1e-10, int maxsteps = 50,
+                            std::function<void(int,double,VectorView<double>)> callback = nullptr)
+  {
+    NewtonOptions opts;
+    opts.tol = tol;
+    opts.maxsteps = maxsteps;
+    NewtonState state;
+    NewtonSolver (func, x, opts, state, callback);
   }
 
 }
@@ -0,0 +1,209 @@
+#ifndef AUTODIFF_H
+#define AUTODIFF_H
+
+#include <cmath>
+#include <new>
+#include <vector>
+#include <utility>
+
+#include "nonlinfunc.h"
+#include "workspace.h"
+
+
+namespace ASC_ode
+{
+
+  // forward mode automatic differentiation:
+  // a value together with its derivatives in N directions (lanes)
+  template <size_t N>
+  class AutoDiff
+  {
+    double val;
+    double deriv[N];
+  public:
+    AutoDiff () : AutoDiff(0.0) { }
+    AutoDiff (double _val) : val(_val)
+    {
+      for (size_t i = 0; i < N; i++) deriv[i] = 0;
+    }
+    // independent variable, seeded with derivative 1 in lane 'lane'
+    AutoDiff (double _val, size_t lane) : AutoDiff(_val)
+    {
+      deriv[lane] = 1;
+    }
+
+    double Value() const { return val; }
+    double & Value() { return val; }
+    double DValue (size_t i) const { return deriv[i]; }
+    double & DValue (size_t i) { return deriv[i]; }
+
+    AutoDiff & operator+= (const AutoDiff & b) { return *this = *this + b; }
+    AutoDiff & operator-= (const AutoDiff & b) { return *this = *this - b; }
+    AutoDiff & operator*= (const AutoDiff & b) { return *this = *this * b; }
+    AutoDiff & operator/= (const AutoDiff & b) { return *this = *this / b; }
+
+    // hidden friends, so that mixed expressions like 2*x(0) convert the double
+    friend AutoDiff operator+ (const AutoDiff & a, const AutoDiff & b)
+    {
+      AutoDiff res(a.val+b.val);
+      for (size_t i = 0; i < N; i++) res.deriv[i] = a.deriv[i]+b.deriv[i];
+      return res;
+    }
+    friend AutoDiff operator- (const AutoDiff & a, const AutoDiff & b)
+    {
+      AutoDiff res(a.val-b.val);
+      for (size_t i = 0; i < N; i++) res.deriv[i] = a.deriv[i]-b.deriv[i];
+      return res;
+    }
+    friend AutoDiff operator- (const AutoDiff & a)
+    {
+      AutoDiff res(-a.val);
+      for (size_t i = 0; i < N; i++) res.deriv[i] = -a.deriv[i];
+      return res;
+    }
+    friend AutoDiff operator* (const AutoDiff & a, const AutoDiff & b)
+    {
+      AutoDiff res(a.val*b.val);
+      for (size_t i = 0; i < N; i++) res.deriv[i] = a.deriv[i]*b.val + a.val*b.deriv[i];
+      return res;
+    }
+    friend AutoDiff operator/ (const AutoDiff & a, const AutoDiff & b)
+    {
+      double inv = 1.0/b.val;
+      AutoDiff res(a.val*inv);
+      for (size_t i = 0; i < N; i++) res.deriv[i] = (a.deriv[i] - res.val*b.deriv[i]) * inv;
+      return res;
+    }
+
+    friend bool operator< (const AutoDiff & a, const AutoDiff & b) { return a.val < b.val; }
+    friend bool operator> (const AutoDiff & a, const AutoDiff & b) { return a.val > b.val; }
+
+    // chain rule for f(a), with f(a.val) = fval and f'(a.val) = dfval
+    static AutoDiff Chain (const AutoDiff & a, double fval, double dfval)
+    {
+      AutoDiff res(fval);
+      for (size_t i = 0; i < N; i++) res.deriv[i] = dfval*a.deriv[i];
+      return res;
+    }
+
+    friend AutoDiff sin (const AutoDiff & a) { return Chain(a, std::sin(a.val), std::cos(a.val)); }
+    friend AutoDiff cos (const AutoDiff & a) { return Chain(a, std::cos(a.val), -std::sin(a.val)); }
+    friend AutoDiff exp (const AutoDiff & a) { double e = std::exp(a.val); return Chain(a, e, e); }
+    friend AutoDiff log (const AutoDiff & a) { return Chain(a, std::log(a.val), 1/a.val); }
+    friend AutoDiff sqrt (const AutoDiff & a) { double s = std::sqrt(a.val); return Chain(a, s, 0.5/s); }
+    friend AutoDiff pow (const AutoDiff & a, double p)
+    {
+      return Chain(a, std::pow(a.val, p), p*std::pow(a.val, p-1));
+    }
+  };
+
+
+
+  // contiguous vector of doubles or AutoDiff numbers, as passed to
+  // the templated Evaluate of functions used with AutoDiffFunction
+  template <typename T>
+  class ADVectorView
+  {
+    T * data;
+    size_t size;
+  public:
+    ADVectorView (T * _data, size_t _size) : data(_data), size(_size) { }
+    ADVectorView (std::vector<T> & v) : data(v.data()), size(v.size()) { }
+    size_t Size() const { return size; }
+    T & operator() (size_t i) const { return data[i]; }
+  };
+
+
+
+  // turns a class with
+  //   size_t DimX() const; size_t DimF() const;
+  //   template <typename T> void Evaluate (ADVectorView<T> x, ADVectorView<T> f) const;
+  // into a NonlinearFunction. The Jacobian is computed exactly by forward mode AD,
+  // LANES columns per evaluation, i.e. DimX/LANES evaluations instead of 2*DimX for FD.
+  template <typename FUNC, size_t LANES = 4>
+  class AutoDiffFunction : public NonlinearFunction
+  {
+    FUNC func;
+  public:
+    template <typename ... ARGS>
+    AutoDiffFunction (ARGS && ... args) : func(std::forward<ARGS>(args)...) { }
+
+    FUNC & Func() { return func; }
+    size_t DimX() const override { return func.DimX(); }
+    size_t DimF() const override { return func.DimF(); }
+
+    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      WorkspaceScope ws;
+      ADVectorView<double> xv(ws.Alloc(DimX()), DimX()), fv(ws.Alloc(DimF()), DimF());
+      for (size_t i = 0; i < xv.Size(); i++) xv(i) = x(i);
+      func.Evaluate(xv, fv);
+      for (size_t i = 0; i < fv.Size(); i++) f(i) = fv(i);
+    }
+
+    void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
+    {
+      EvaluateAD(x, nullptr, df);
+    }
+
+    // the values are a by-product of the first AD pass
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      EvaluateAD(x, &f, df);
+    }
+
+    // one pass with the direction v as the single lane
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      WorkspaceScope ws;
+      auto xad = ADVec<1>(ws, DimX()), fad = ADVec<1>(ws, DimF());
+      for (size_t i = 0; i < xad.Size(); i++)
+        {
+          xad(i) = AutoDiff<1>(x(i));
+          xad(i).DValue(0) = v(i);
+        }
+      func.Evaluate(xad, fad);
+      for (size_t i = 0; i < fad.Size(); i++)
+        jv(i) = fad(i).DValue(0);
+    }
+
+  private:
+    // n AutoDiff numbers in the doubles of the workspace
+    template <size_t N>
+    static ADVectorView<AutoDiff<N>> ADVec (WorkspaceScope & ws, size_t n)
+    {
+      static_assert(sizeof(AutoDiff<N>) == (N+1)*sizeof(double), "AutoDiff must consist of doubles");
+      auto data = reinterpret_cast<AutoDiff<N>*>(ws.Alloc((N+1)*n));
+      for (size_t i = 0; i < n; i++)
+        new (data+i) AutoDiff<N>();
+      return ADVectorView<AutoDiff<N>>(data, n);
+    }
+
+    void EvaluateAD (VectorView<double> x, VectorView<double> * f, MatrixView<double, ColMajor> df) const
+    {
+      size_t n = DimX();
+      WorkspaceScope ws;
+      auto xad = ADVec<LANES>(ws, n), fad = ADVec<LANES>(ws, DimF());
+      for (size_t first = 0; first < n; first += LANES)
+        {
+          for (size_t i = 0; i < n; i++)
+            xad(i) = AutoDiff<LANES>(x(i));
+          for (size_t l = 0; l < LANES && first+l < n; l++)
+            xad(first+l).DValue(l) = 1;
+
+          func.Evaluate(xad, fad);
+
+          for (size_t i = 0; i < fad.Size(); i++)
+            for (size_t l = 0; l < LANES && first+l < n; l++)
+              df(i, first+l) = fad(i).DValue(l);
+          if (f && first == 0)
+            for (size_t i = 0; i < fad.Size(); i++)
+              (*f)(i) = fad(i).Value();
+        }
+    }
+  };
+
+}
+
+#endif
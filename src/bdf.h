@@ -0,0 +1,380 @@
+#ifndef BDF_H
+#define BDF_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "rungekutta.h"
+
+
+namespace ASC_ode
+{
+
+  // Variable step, variable order BDF (orders 1 to 5) for stiff dy/dt = rhs(y).
+  // With the interpolation polynomial p through y_{n+1}, y_n, ..., y_{n+1-q}
+  // the step solves p'(t_{n+1}) = rhs(y_{n+1}), i.e.
+  //   y_{n+1} = psi + h gamma rhs(y_{n+1}),
+  // psi and gamma from the past values and step sizes. It is one Newton
+  // solve of size n per step, written for k = rhs(y_{n+1}) as the stage
+  // equation  k - rhs(psi + h gamma k) = 0  of the DIRK methods.
+  // Simplified Newton keeps the factored I - h gamma J over many steps,
+  // it is refactored if h gamma changes by more than 30 percent or Newton
+  // contracts badly. The initial guess is the extrapolation of the past values.
+  //
+  // Advance(tend) controls step size and order as in LSODE: the local error
+  // is estimated by the distance to the predictor, step size and order are
+  // changed only after q+1 steps of constant size. Step(dt) makes steps of
+  // fixed size with the maximal order, the starting values are computed
+  // with control and a tolerance of about dt^(max_order+1), so that they
+  // do not spoil the order of the fixed steps.
+  class BDF : public TimeStepper
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    AdaptiveOptions opts;
+    size_t n;
+    int max_order;
+    std::shared_ptr<DIRKStageFunction> func;
+
+    // past values y_n, y_{n-1}, ... and their times
+    std::vector<double> hist;
+    std::vector<double> thist;
+    int nhist = 0;
+
+    Vector<double> y, ynew, ypred, psi, k, f0;
+    double tnew = 0;
+    int q = 1;                  // current order
+    int nconst = 0;             // steps with the current order and step size
+    double h = 0;               // proposed step size
+    double hg_factored = 0;
+    size_t num_rhs = 0;
+    StepStatistics stats;
+
+    // state before the last DoStep, for Reject
+    struct Saved
+    {
+      Vector<double> y;
+      std::vector<double> hist, thist;
+      int nhist, q, nconst;
+      double h, hg_factored;
+    } saved;
+
+  protected:
+    void Build (double dt) override { }
+    void DoStep (double dt) override
+    {
+      saved.y = y;
+      saved.hist = hist;
+      saved.thist = thist;
+      saved.nhist = nhist;
+      saved.q = q;
+      saved.nconst = nconst;
+      saved.h = h;
+      saved.hg_factored = hg_factored;
+
+      // starting values: until the history is long enough for the maximal
+      // order the step is integrated with step size and order control,
+      // the tolerance from the local error of the fixed steps
+      if (nhist <= max_order)
+        {
+          double t0 = t;
+          AdaptiveOptions fixed_opts = opts;
+          double tol = std::min(1e-6, std::max(1e-12, 0.01*std::pow(dt, max_order+1)));
+          opts.rtol = opts.atol = tol;
+          opts.dt_max = dt;
+          try
+            {
+              Advance(t0+dt);
+            }
+          catch (std::domain_error &)
+            {
+              opts = fixed_opts;
+              throw;
+            }
+          opts = fixed_opts;
+          t = t0;
+          return;
+        }
+      q = max_order;
+      if (!Solve(t, dt))
+        throw std::domain_error("BDF: Newton did not converge");
+      Accept(t+dt);
+      stats.accepted++;
+    }
+
+    void Reject () override
+    {
+      y = saved.y;
+      hist = saved.hist;
+      thist = saved.thist;
+      nhist = saved.nhist;
+      q = saved.q;
+      nconst = saved.nconst;
+      h = saved.h;
+      hg_factored = saved.hg_factored;
+    }
+
+  public:
+    BDF (std::shared_ptr<NonlinearFunction> _rhs, int _max_order = 5,
+         const AdaptiveOptions & _opts = AdaptiveOptions(),
+         const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), opts(_opts), n(_rhs->DimX()),
+        max_order(std::max(1, std::min(_max_order, 5))),
+        func(std::make_shared<DIRKStageFunction>(_rhs)),
+        hist((max_order+2)*n), thist(max_order+2),
+        y(n), ynew(n), ypred(n), psi(n), k(n), f0(n)
+    {
+      newton.simplified = true;
+    }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      nhist = 0;
+      q = 1;
+      nconst = 0;
+      h = opts.dt_init;
+      hg_factored = 0;
+      Restart(t0);
+      Push(t0);
+      // slope for the first predictor
+      rhs->Evaluate(y, f0);
+      num_rhs++;
+    }
+
+    VectorView<double> Solution() override { return y; }
+    int Order() const { return q; }
+    double ProposedStepSize() const { return h; }
+
+    StepStatistics Statistics() const
+    {
+      StepStatistics st = stats;
+      st.rhs_evaluations = num_rhs + func->num_rhs_evaluations;
+      st.jacobian_evaluations = func->num_jacobian_evaluations;
+      st.factorizations = newton_state.num_factorizations;
+      st.newton_iterations = newton_state.num_iterations;
+      return st;
+    }
+
+    void Advance (double tend, std::function<void(double,VectorView<double>)> callback = nullptr) override
+    {
+      if (h <= 0)
+        {
+          h = InitialStepSize(*rhs, y, opts);
+          num_rhs++;
+          if (!std::isfinite(h))
+            throw std::domain_error("BDF: rhs is not finite");
+        }
+      int nfail = 0;
+
+      while (t < tend)
+        {
+          double dt = std::min(h, tend-t);
+          bool last = (dt == tend-t);
+          q = std::min(q, nhist);
+
+          if (!Solve(t, dt))
+            {
+              // Newton failed with a fresh matrix: smaller step
+              stats.rejected++;
+              h = dt/4;
+              nconst = 0;
+              if (h < opts.dt_min)
+                throw std::domain_error("BDF: step size too small");
+              continue;
+            }
+
+          double sc_err = ScaledDistance(q+1) / (q+1);
+          if (sc_err > 1)
+            {
+              stats.rejected++;
+              nfail++;
+              double fac = 1 / (1.2 * std::pow(sc_err, 1.0/(q+1)));
+              h = dt * std::min(0.9, std::max(opts.facmin, fac));
+              if (nfail >= 3) q = 1;
+              nconst = 0;
+              if (h < opts.dt_min)
+                throw std::domain_error("BDF: step size too small");
+              continue;
+            }
+
+          nfail = 0;
+          // the candidates for the next order need y_{n+1} and the old history
+          double rh = 1 / (1.2 * std::pow(std::max(sc_err, 1e-10), 1.0/(q+1)));
+          int qnew = q;
+          nconst++;
+          if (nconst > q)
+            {
+              if (q > 1)
+                {
+                  double err = ScaledDistance(q) / q;
+                  double rdown = 1 / (1.3 * std::pow(std::max(err, 1e-10), 1.0/q));
+                  if (rdown > rh) { rh = rdown; qnew = q-1; }
+                }
+              if (q < max_order && nhist >= q+2)
+                {
+                  double err = ScaledDistance(q+2) / (q+2);
+                  double rup = 1 / (1.4 * std::pow(std::max(err, 1e-10), 1.0/(q+2)));
+                  if (rup > rh) { rh = rup; qnew = q+1; }
+                }
+            }
+
+          t = last ? tend : t+dt;
+          Accept(t);
+          stats.accepted++;
+
+          if (!last || dt == h)
+            {
+              // change step size and order only after q+1 constant steps,
+              // small increases are not worth a new matrix
+              if (nconst > q && (qnew != q || rh >= 1.2))
+                {
+                  h = dt * std::min(opts.facmax, rh);
+                  q = qnew;
+                  nconst = 0;
+                }
+              else
+                h = dt;
+            }
+          if (opts.dt_max > 0)
+            h = std::min(h, opts.dt_max);
+          if (callback) callback(t, y);
+        }
+    }
+
+  private:
+    VectorView<double> Past (int j) { return VectorView<double>(n, hist.data()+j*n); }
+
+    void Push (double tn)
+    {
+      int m = std::min(nhist, max_order+1);
+      for (int j = m; j > 0; j--)
+        {
+          thist[j] = thist[j-1];
+          std::copy_n(hist.data()+(j-1)*n, n, hist.data()+j*n);
+        }
+      thist[0] = tn;
+      for (size_t l = 0; l < n; l++)
+        hist[l] = y(l);
+      nhist = m+1;
+    }
+
+    void Accept (double tn)
+    {
+      y = ynew;
+      Push(tn);
+    }
+
+    // ypred = extrapolation of the last m values to tn,
+    // from the initial slope if there is only y_0
+    void Extrapolate (int m, double tn)
+    {
+      if (m == 1)
+        {
+          auto y0 = Past(0);
+          for (size_t l = 0; l < n; l++)
+            ypred(l) = y0(l) + (tn-thist[0]) * f0(l);
+          return;
+        }
+      ypred = 0.0;
+      for (int j = 0; j < m; j++)
+        {
+          double lj = 1;
+          for (int i = 0; i < m; i++)
+            if (i != j)
+              lj *= (tn - thist[i]) / (thist[j] - thist[i]);
+          auto yj = Past(j);
+          for (size_t l = 0; l < n; l++)
+            ypred(l) += lj * yj(l);
+        }
+    }
+
+    // error estimate: distance of the new value to the extrapolation
+    // of the m last values, in the scaled norm
+    double ScaledDistance (int m)
+    {
+      Extrapolate(std::min(m, nhist), tnew);
+      double sum = 0;
+      for (size_t l = 0; l < n; l++)
+        {
+          double sc = opts.atol + opts.rtol * std::max(std::fabs(y(l)), std::fabs(ynew(l)));
+          double d = (ynew(l) - ypred(l)) / sc;
+          sum += d*d;
+        }
+      return std::sqrt(sum / n);
+    }
+
+    // one BDF step of order q from tn to tn+dt, the result in ynew.
+    // false if Newton fails with a fresh matrix
+    bool Solve (double tn, double dt)
+    {
+      tnew = tn + dt;
+      // p'(t_{n+1}) = alpha_0 y_{n+1} + sum_j alpha_j y_{n+1-j}
+      //   alpha_0 = sum_{m>0} 1 / (t_{n+1} - t_{n+1-m})
+      //   alpha_j = prod_{m!=0,j} (t_{n+1} - t_{n+1-m}) / prod_{m!=j} (t_{n+1-j} - t_{n+1-m})
+      auto node = [&] (int m) { return m == 0 ? tnew : thist[m-1]; };
+      double alpha0 = 0;
+      for (int m = 1; m <= q; m++)
+        alpha0 += 1 / (tnew - node(m));
+
+      psi = 0.0;
+      for (int j = 1; j <= q; j++)
+        {
+          double num = 1, den = 1;
+          for (int m = 0; m <= q; m++)
+            {
+              if (m == j) continue;
+              if (m != 0) num *= tnew - node(m);
+              den *= node(j) - node(m);
+            }
+          double alphaj = num / den;
+          auto yj = Past(j-1);
+          for (size_t l = 0; l < n; l++)
+            psi(l) -= alphaj / alpha0 * yj(l);
+        }
+      double hg = 1 / alpha0;
+
+      // predictor: extrapolation of the q+1 last values (or less at start)
+      Extrapolate(std::min(q+1, nhist), tnew);
+      for (size_t l = 0; l < n; l++)
+        k(l) = (ypred(l) - psi(l)) / hg;
+
+      func->SetBase(psi);
+      func->SetH(hg);
+      if (std::fabs(hg - hg_factored) > 0.3*hg)
+        newton_state.Reset();
+      size_t nfact = newton_state.num_factorizations;
+      try
+        {
+          NewtonSolver(func, k, newton, newton_state);
+        }
+      catch (std::domain_error &)
+        {
+          bool fresh = newton_state.num_factorizations != nfact;
+          newton_state.Reset();
+          if (fresh) return false;
+          // stale matrix: once more with a new one
+          for (size_t l = 0; l < n; l++)
+            k(l) = (ypred(l) - psi(l)) / hg;
+          try
+            {
+              NewtonSolver(func, k, newton, newton_state);
+            }
+          catch (std::domain_error &)
+            {
+              newton_state.Reset();
+              return false;
+            }
+        }
+      if (newton_state.num_factorizations != nfact)
+        hg_factored = hg;
+
+      for (size_t l = 0; l < n; l++)
+        ynew(l) = psi(l) + hg * k(l);
+      return true;
+    }
+  };
+
+}
+
+#endif
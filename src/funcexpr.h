@@ -0,0 +1,534 @@
+#ifndef FUNCEXPR_H
+#define FUNCEXPR_H
+
+#include <memory>
+#include <type_traits>
+#include "nonlinfunc.h"
+
+
+namespace ASC_ode
+{
+  // Compile time expression templates for the function algebra.
+  // Linear combinations of Var/Const/Func/Compose nodes are statically typed,
+  // MakeFunction turns the whole expression into one NonlinearFunction which
+  // evaluates in a single fused loop. Leaves (Func, Compose) call the virtual
+  // interface and keep their buffers, so evaluation does not allocate.
+  //
+  // every node provides
+  //   DimX(), DimF()
+  //   Prepare(x, deriv, values)
+  //                          evaluate leaves into their buffers, with deriv
+  //                          also their Jacobians (EvaluateWithDeriv); without
+  //                          values only the points of the leaves are set,
+  //                          for a following AddDeriv or AddApplyDeriv
+  //   Eval(i, x)             component i, after Prepare
+  //   AddDeriv(x, df, fac, stored)
+  //                          df += fac * derivative, after Prepare; stored means
+  //                          the leaf Jacobians come from Prepare(x, DENSE_DERIV)
+  //   AddPattern, AddSparseDeriv for the sparse path
+  //   AddApplyDeriv(x, v, jv, fac)
+  //                          jv += fac * derivative * v, after Prepare
+  //   is_constant            derivative vanishes
+  //   is_scaled_identity     derivative is IdentityFactor() * I
+
+  template <typename T>
+  class FuncExpr
+  {
+  public:
+    const T & Upcast() const { return static_cast<const T&> (*this); }
+  };
+
+
+  class VarExpr : public FuncExpr<VarExpr>
+  {
+    size_t n;
+  public:
+    static constexpr bool is_constant = false;
+    static constexpr bool is_scaled_identity = true;
+
+    VarExpr (size_t _n) : n(_n) { }
+    size_t DimX() const { return n; }
+    size_t DimF() const { return n; }
+    double IdentityFactor() const { return 1.0; }
+    void Prepare (VectorView<double> x, DERIV_MODE deriv = NO_DERIV, bool values = true) const { }
+    double Eval (size_t i, VectorView<double> x) const { return x(i); }
+    void AddDeriv (VectorView<double> x, MatrixView<double, ColMajor> df, double fac, bool stored = false) const
+    {
+      for (size_t i = 0; i < n; i++) df(i,i) += fac;
+    }
+    void AddPattern (SparsityPattern & pattern) const { pattern.AddDiag(0, n); }
+    void AddSparseDeriv (VectorView<double> x, SparseMatrix & df, double fac, bool stored = false) const
+    {
+      for (size_t i = 0; i < n; i++) df(i,i) += fac;
+    }
+    void AddApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      LinComb(1.0, jv, fac, v);
+    }
+  };
+
+
+  // reads the current value of a ConstantFunction, so that Set() is seen
+  class ConstExpr : public FuncExpr<ConstExpr>
+  {
+    std::shared_ptr<ConstantFunction> c;
+  public:
+    static constexpr bool is_constant = true;
+    static constexpr bool is_scaled_identity = true;
+
+    ConstExpr (std::shared_ptr<ConstantFunction> _c) : c(_c) { }
+    size_t DimX() const { return 0; }    // taken from the other operand
+    size_t DimF() const { return c->DimF(); }
+    double IdentityFactor() const { return 0.0; }
+    void Prepare (VectorView<double> x, DERIV_MODE deriv = NO_DERIV, bool values = true) const { }
+    double Eval (size_t i, VectorView<double> x) const { return c->Get()(i); }
+    void AddDeriv (VectorView<double> x, MatrixView<double, ColMajor> df, double fac, bool stored = false) const { }
+    void AddPattern (SparsityPattern & pattern) const { }
+    void AddSparseDeriv (VectorView<double> x, SparseMatrix & df, double fac, bool stored = false) const { }
+    void AddApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const { }
+  };
+
+
+  template <typename TA, typename TB>
+  class SumExpr : public FuncExpr<SumExpr<TA,TB>>
+  {
+    TA a;
+    TB b;
+  public:
+    static constexpr bool is_constant = TA::is_constant && TB::is_constant;
+    static constexpr bool is_scaled_identity = TA::is_scaled_identity && TB::is_scaled_identity;
+
+    SumExpr (TA _a, TB _b) : a(_a), b(_b) { }
+    size_t DimX() const { return std::max(a.DimX(), b.DimX()); }
+    size_t DimF() const { return a.DimF(); }
+    double IdentityFactor() const { return a.IdentityFactor() + b.IdentityFactor(); }
+    void Prepare (VectorView<double> x, DERIV_MODE deriv = NO_DERIV, bool values = true) const
+    { a.Prepare(x, deriv, values); b.Prepare(x, deriv, values); }
+    double Eval (size_t i, VectorView<double> x) const { return a.Eval(i, x) + b.Eval(i, x); }
+    void AddDeriv (VectorView<double> x, MatrixView<double, ColMajor> df, double fac, bool stored = false) const
+    {
+      a.AddDeriv(x, df, fac, stored);
+      b.AddDeriv(x, df, fac, stored);
+    }
+    void AddPattern (SparsityPattern & pattern) const { a.AddPattern(pattern); b.AddPattern(pattern); }
+    void AddSparseDeriv (VectorView<double> x, SparseMatrix & df, double fac, bool stored = false) const
+    {
+      a.AddSparseDeriv(x, df, fac, stored);
+      b.AddSparseDeriv(x, df, fac, stored);
+    }
+    void AddApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      a.AddApplyDeriv(x, v, jv, fac);
+      b.AddApplyDeriv(x, v, jv, fac);
+    }
+  };
+
+
+  template <typename TA>
+  class ScaleExpr : public FuncExpr<ScaleExpr<TA>>
+  {
+    double s;
+    TA a;
+  public:
+    static constexpr bool is_constant = TA::is_constant;
+    static constexpr bool is_scaled_identity = TA::is_scaled_identity;
+
+    ScaleExpr (double _s, TA _a) : s(_s), a(_a) { }
+    size_t DimX() const { return a.DimX(); }
+    size_t DimF() const { return a.DimF(); }
+    double IdentityFactor() const { return s*a.IdentityFactor(); }
+    void Prepare (VectorView<double> x, DERIV_MODE deriv = NO_DERIV, bool values = true) const
+    { a.Prepare(x, deriv, values); }
+    double Eval (size_t i, VectorView<double> x) const { return s*a.Eval(i, x); }
+    void AddDeriv (VectorView<double> x, MatrixView<double, ColMajor> df, double fac, bool stored = false) const
+    {
+      a.AddDeriv(x, df, s*fac, stored);
+    }
+    void AddPattern (SparsityPattern & pattern) const { a.AddPattern(pattern); }
+    void AddSparseDeriv (VectorView<double> x, SparseMatrix & df, double fac, bool stored = false) const
+    {
+      a.AddSparseDeriv(x, df, s*fac, stored);
+    }
+    void AddApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      a.AddApplyDeriv(x, v, jv, s*fac);
+    }
+  };
+
+
+  // boundary to the virtual interface: f(x) for a NonlinearFunction f
+  class FuncLeafExpr : public FuncExpr<FuncLeafExpr>
+  {
+    std::shared_ptr<NonlinearFunction> f;
+    const DiagonalFunction * diag;        // Jacobian without a matrix
+    std::shared_ptr<Vector<double>> val;
+    mutable std::shared_ptr<Matrix<double, ColMajor>> jac;
+    mutable std::shared_ptr<SparseMatrix> sparse_jac;
+  public:
+    static constexpr bool is_constant = false;
+    static constexpr bool is_scaled_identity = false;
+
+    FuncLeafExpr (std::shared_ptr<NonlinearFunction> _f)
+      : f(_f), diag(dynamic_cast<const DiagonalFunction*>(_f.get())),
+        val(std::make_shared<Vector<double>>(_f->DimF())) { }
+    size_t DimX() const { return f->DimX(); }
+    size_t DimF() const { return f->DimF(); }
+    double IdentityFactor() const { return 0.0; }
+    void Prepare (VectorView<double> x, DERIV_MODE deriv = NO_DERIV, bool values = true) const
+    {
+      if (diag) deriv = NO_DERIV;
+      switch (deriv)
+        {
+        case NO_DERIV: if (values) f->Evaluate(x, *val); break;
+        case DENSE_DERIV: f->EvaluateWithDeriv(x, *val, Jac()); break;
+        case SPARSE_DERIV: f->EvaluateWithSparseDeriv(x, *val, SparseJac()); break;
+        }
+    }
+    double Eval (size_t i, VectorView<double> x) const { return (*val)(i); }
+    void AddDeriv (VectorView<double> x, MatrixView<double, ColMajor> df, double fac, bool stored = false) const
+    {
+      if (diag)
+        {
+          for (size_t i = 0; i < DimF(); i++)
+            df(i,i) += fac * diag->Diagonal()(i);
+          return;
+        }
+      if (!stored)
+        f->EvaluateDeriv(x, Jac());
+      for (size_t j = 0; j < DimX(); j++)
+        for (size_t i = 0; i < DimF(); i++)
+          df(i,j) += fac * (*jac)(i,j);
+    }
+    void AddPattern (SparsityPattern & pattern) const { pattern.Add(f->DerivPattern()); }
+    void AddSparseDeriv (VectorView<double> x, SparseMatrix & df, double fac, bool stored = false) const
+    {
+      if (diag)
+        {
+          for (size_t i = 0; i < DimF(); i++)
+            df(i,i) += fac * diag->Diagonal()(i);
+          return;
+        }
+      if (!stored)
+        f->EvaluateSparseDeriv(x, SparseJac());
+      df.Add(fac, *sparse_jac);
+    }
+    void AddApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(DimF());
+      f->ApplyDeriv(x, v, tmp);
+      LinComb(1.0, jv, fac, tmp);
+    }
+  private:
+    Matrix<double, ColMajor> & Jac() const
+    {
+      if (!jac)
+        jac = std::make_shared<Matrix<double, ColMajor>>(DimF(), DimX());
+      return *jac;
+    }
+    SparseMatrix & SparseJac() const
+    {
+      if (!sparse_jac)
+        sparse_jac = std::make_shared<SparseMatrix>(f->DerivPattern());
+      return *sparse_jac;
+    }
+  };
+
+
+  // fa(b(x)) with a NonlinearFunction fa and an expression b
+  template <typename TB>
+  class ComposeExpr : public FuncExpr<ComposeExpr<TB>>
+  {
+    std::shared_ptr<NonlinearFunction> fa;
+    const DiagonalFunction * diag;        // fa, its Jacobian scales the rows
+    TB b;
+    std::shared_ptr<Vector<double>> inner, val;
+    mutable std::shared_ptr<Matrix<double, ColMajor>> jaca, jacb;
+    mutable std::shared_ptr<SparseMatrix> sparse_jaca, sparse_jacb, sparse_prod;
+  public:
+    static constexpr bool is_constant = TB::is_constant;
+    static constexpr bool is_scaled_identity = false;
+
+    ComposeExpr (std::shared_ptr<NonlinearFunction> _fa, TB _b)
+      : fa(_fa), diag(dynamic_cast<const DiagonalFunction*>(_fa.get())), b(_b),
+        inner(std::make_shared<Vector<double>>(_fa->DimX())),
+        val(std::make_shared<Vector<double>>(_fa->DimF())) { }
+    size_t DimX() const { return b.DimX(); }
+    size_t DimF() const { return fa->DimF(); }
+    double IdentityFactor() const { return 0.0; }
+
+    void Prepare (VectorView<double> x, DERIV_MODE deriv = NO_DERIV, bool values = true) const
+    {
+      // the inner point is always needed, fa(inner) only for the values:
+      // fa may have state (time, parameters), its results are not kept
+      // from one call to the next
+      b.Prepare(x, deriv);
+      for (size_t i = 0; i < inner->Size(); i++)
+        (*inner)(i) = b.Eval(i, x);
+      if (TB::is_constant || diag)
+        deriv = NO_DERIV;     // Jacobian of fa is not needed
+      switch (deriv)
+        {
+        case NO_DERIV: if (values) fa->Evaluate(*inner, *val); break;
+        case DENSE_DERIV: fa->EvaluateWithDeriv(*inner, *val, JacA()); break;
+        case SPARSE_DERIV: fa->EvaluateWithSparseDeriv(*inner, *val, SparseJacA()); break;
+        }
+    }
+    double Eval (size_t i, VectorView<double> x) const { return (*val)(i); }
+
+    void AddDeriv (VectorView<double> x, MatrixView<double, ColMajor> df, double fac, bool stored = false) const
+    {
+      if constexpr (TB::is_constant)
+        return;
+      else
+        {
+          if (diag)
+            {
+              AddDiagDeriv(x, df, fac, stored);
+              return;
+            }
+          if (!stored)
+            fa->EvaluateDeriv(*inner, JacA());
+
+          if constexpr (TB::is_scaled_identity)
+            {
+              // inner derivative is c*I: no matrix product
+              double c = fac * b.IdentityFactor();
+              for (size_t j = 0; j < jaca->Width(); j++)
+                for (size_t i = 0; i < jaca->Height(); i++)
+                  df(i,j) += c * (*jaca)(i,j);
+            }
+          else
+            {
+              if (!jacb)
+                jacb = std::make_shared<Matrix<double, ColMajor>>(fa->DimX(), DimX());
+              *jacb = 0.0;
+              b.AddDeriv(x, *jacb, 1.0, stored);
+              for (size_t j = 0; j < DimX(); j++)
+                for (size_t k = 0; k < jaca->Width(); k++)
+                  {
+                    double bkj = fac * (*jacb)(k,j);
+                    if (bkj == 0.0) continue;
+                    for (size_t i = 0; i < jaca->Height(); i++)
+                      df(i,j) += (*jaca)(i,k) * bkj;
+                  }
+            }
+        }
+    }
+
+    void AddPattern (SparsityPattern & pattern) const
+    {
+      if constexpr (TB::is_scaled_identity && !TB::is_constant)
+        pattern.Add(fa->DerivPattern());
+      else if constexpr (!TB::is_constant)
+        {
+          SparsityPattern patb(fa->DimX(), DimX());
+          b.AddPattern(patb);
+          pattern.Add(PatternProduct(fa->DerivPattern(), patb));
+        }
+    }
+
+    void AddSparseDeriv (VectorView<double> x, SparseMatrix & df, double fac, bool stored = false) const
+    {
+      if constexpr (!TB::is_constant)
+        {
+          if (diag)
+            {
+              AddDiagDeriv(x, df, fac, stored);
+              return;
+            }
+          if (!stored)
+            fa->EvaluateSparseDeriv(*inner, SparseJacA());
+
+          if constexpr (TB::is_scaled_identity)
+            df.Add(fac * b.IdentityFactor(), *sparse_jaca);
+          else
+            {
+              if (!sparse_jacb)
+                {
+                  SparsityPattern patb(fa->DimX(), DimX());
+                  b.AddPattern(patb);
+                  sparse_jacb = std::make_shared<SparseMatrix>(patb);
+                  sparse_prod = std::make_shared<SparseMatrix>(PatternProduct(fa->DerivPattern(), patb));
+                }
+              *sparse_jacb = 0.0;
+              b.AddSparseDeriv(x, *sparse_jacb, 1.0, stored);
+              SparseProduct(*sparse_jaca, *sparse_jacb, *sparse_prod);
+              df.Add(fac, *sparse_prod);
+            }
+        }
+    }
+
+    void AddApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv, double fac) const
+    {
+      if constexpr (!TB::is_constant)
+        {
+          WorkspaceScope ws;
+          auto bv = ws.Vec(fa->DimX());
+          auto tmp = ws.Vec(DimF());
+          if constexpr (TB::is_scaled_identity)
+            for (size_t i = 0; i < bv.Size(); i++)
+              bv(i) = b.IdentityFactor() * v(i);
+          else
+            {
+              bv = 0.0;
+              b.AddApplyDeriv(x, v, bv, 1.0);
+            }
+          fa->ApplyDeriv(*inner, bv, tmp);
+          LinComb(1.0, jv, fac, tmp);
+        }
+    }
+  private:
+    // diag(d) b'(x): d c on the diagonal for b = c x + const, otherwise
+    // b' is accumulated alone and its rows are scaled
+    template <typename TJAC>
+    void AddDiagDeriv (VectorView<double> x, TJAC & df, double fac, bool stored) const
+    {
+      auto & d = diag->Diagonal();
+      if constexpr (TB::is_scaled_identity)
+        {
+          double c = fac * b.IdentityFactor();
+          for (size_t i = 0; i < d.Size(); i++)
+            df(i,i) += c * d(i);
+        }
+      else if constexpr (std::is_same_v<TJAC, SparseMatrix>)
+        {
+          if (!sparse_jacb)
+            {
+              SparsityPattern patb(fa->DimX(), DimX());
+              b.AddPattern(patb);
+              sparse_jacb = std::make_shared<SparseMatrix>(patb);
+            }
+          *sparse_jacb = 0.0;
+          b.AddSparseDeriv(x, *sparse_jacb, 1.0, stored);
+          for (size_t i = 0; i < sparse_jacb->Height(); i++)
+            for (size_t k = sparse_jacb->First(i); k < sparse_jacb->Next(i); k++)
+              df(i, sparse_jacb->ColNr(k)) += fac * d(i) * sparse_jacb->Value(k);
+        }
+      else
+        {
+          if (!jacb)
+            jacb = std::make_shared<Matrix<double, ColMajor>>(fa->DimX(), DimX());
+          *jacb = 0.0;
+          b.AddDeriv(x, *jacb, 1.0, stored);
+          for (size_t j = 0; j < DimX(); j++)
+            for (size_t i = 0; i < d.Size(); i++)
+              df(i,j) += fac * d(i) * (*jacb)(i,j);
+        }
+    }
+
+    Matrix<double, ColMajor> & JacA() const
+    {
+      if (!jaca)
+        jaca = std::make_shared<Matrix<double, ColMajor>>(fa->DimF(), fa->DimX());
+      return *jaca;
+    }
+    SparseMatrix & SparseJacA() const
+    {
+      if (!sparse_jaca)
+        sparse_jaca = std::make_shared<SparseMatrix>(fa->DerivPattern());
+      return *sparse_jaca;
+    }
+  };
+
+
+
+  inline VarExpr Var (size_t n) { return VarExpr(n); }
+  inline ConstExpr Const (std::shared_ptr<ConstantFunction> c) { return ConstExpr(c); }
+  inline FuncLeafExpr Func (std::shared_ptr<NonlinearFunction> f) { return FuncLeafExpr(f); }
+
+  template <typename TB>
+  auto Compose (std::shared_ptr<NonlinearFunction> fa, const FuncExpr<TB> & b)
+  {
+    return ComposeExpr<TB>(fa, b.Upcast());
+  }
+
+  template <typename TA, typename TB>
+  auto operator+ (const FuncExpr<TA> & a, const FuncExpr<TB> & b)
+  {
+    return SumExpr<TA,TB>(a.Upcast(), b.Upcast());
+  }
+
+  template <typename TA>
+  auto operator* (double s, const FuncExpr<TA> & a)
+  {
+    return ScaleExpr<TA>(s, a.Upcast());
+  }
+
+  template <typename TA, typename TB>
+  auto operator- (const FuncExpr<TA> & a, const FuncExpr<TB> & b)
+  {
+    return a + (-1.0)*b;
+  }
+
+
+
+  // the static expression as a NonlinearFunction
+  template <typename T>
+  class ExprFunction : public NonlinearFunction
+  {
+    T expr;
+  public:
+    ExprFunction (T _expr) : expr(_expr) { }
+
+    size_t DimX() const override { return expr.DimX(); }
+    size_t DimF() const override { return expr.DimF(); }
+    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      expr.Prepare(x);
+      for (size_t i = 0; i < f.Size(); i++)
+        f(i) = expr.Eval(i, x);
+    }
+    void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
+    {
+      df = 0.0;
+      expr.Prepare(x, NO_DERIV, false);
+      expr.AddDeriv(x, df, 1.0);
+    }
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(DimF(), DimX());
+      expr.AddPattern(pattern);
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      expr.Prepare(x, NO_DERIV, false);
+      expr.AddSparseDeriv(x, df, 1.0);
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      expr.Prepare(x, DENSE_DERIV);
+      for (size_t i = 0; i < f.Size(); i++)
+        f(i) = expr.Eval(i, x);
+      df = 0.0;
+      expr.AddDeriv(x, df, 1.0, true);
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      expr.Prepare(x, SPARSE_DERIV);
+      for (size_t i = 0; i < f.Size(); i++)
+        f(i) = expr.Eval(i, x);
+      df = 0.0;
+      expr.AddSparseDeriv(x, df, 1.0, true);
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      expr.Prepare(x, NO_DERIV, false);
+      jv = 0.0;
+      expr.AddApplyDeriv(x, v, jv, 1.0);
+    }
+  };
+
+  template <typename T>
+  auto MakeFunction (const FuncExpr<T> & expr)
+  {
+    return std::make_shared<ExprFunction<T>>(expr.Upcast());
+  }
+
+}
+
+#endif
@@ -0,0 +1,471 @@
+#ifndef KRYLOV_H
+#define KRYLOV_H
+
+#include <vector>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <stdexcept>
+
+#include "nonlinfunc.h"
+
+
+namespace ASC_ode
+{
+  using namespace ASC_bla;
+
+  // preconditioner for the Krylov solvers, z = P^{-1} r. It is built
+  // from the assembled sparse Jacobian; matrix-free Newton calls
+  // Setup(func, x) at a new linearization point, which assembles it
+  class Preconditioner
+  {
+    std::unique_ptr<SparseMatrix> jacobian;
+  public:
+    virtual ~Preconditioner() = default;
+    virtual void Setup (const SparseMatrix & a) = 0;
+    virtual void Setup (const NonlinearFunction & func, VectorView<double> x)
+    {
+      if (!jacobian || jacobian->Height() != func.DimF())
+        jacobian = std::make_unique<SparseMatrix>(func.DerivPattern());
+      func.EvaluateSparseDeriv(x, *jacobian);
+      Setup(*jacobian);
+    }
+    virtual void Apply (VectorView<double> r, VectorView<double> z) const = 0;
+  };
+
+
+  // inverse of the diagonal
+  class JacobiPreconditioner : public Preconditioner
+  {
+    std::vector<double> invdiag;
+  public:
+    using Preconditioner::Setup;
+    void Setup (const SparseMatrix & a) override
+    {
+      invdiag.resize(a.Height());
+      for (size_t i = 0; i < a.Height(); i++)
+        {
+          double d = a(i,i);
+          invdiag[i] = (d != 0.0) ? 1/d : 1.0;
+        }
+    }
+
+    void Apply (VectorView<double> r, VectorView<double> z) const override
+    {
+      for (size_t i = 0; i < r.Size(); i++)
+        z(i) = invdiag[i] * r(i);
+    }
+  };
+
+
+  // inverses of the bs x bs diagonal blocks, e.g. the D x D block of
+  // every mass. Singular blocks are replaced by the identity
+  class BlockJacobiPreconditioner : public Preconditioner
+  {
+    size_t bs;
+    size_t n = 0;
+    std::vector<double> inv;     // block k at k*bs*bs, column major
+  public:
+    BlockJacobiPreconditioner (size_t _bs) : bs(std::max<size_t>(_bs, 1)) { }
+
+    using Preconditioner::Setup;
+    void Setup (const SparseMatrix & a) override
+    {
+      n = a.Height();
+      size_t nblocks = (n+bs-1) / bs;
+      inv.assign(nblocks*bs*bs, 0.0);
+      std::vector<double> blk(bs*bs);
+      for (size_t k = 0; k < nblocks; k++)
+        {
+          size_t first = k*bs, m = std::min(bs, n-first);
+          double * bi = inv.data()+k*bs*bs;
+          for (size_t j = 0; j < m; j++)
+            for (size_t i = 0; i < m; i++)
+              {
+                blk[i+j*m] = a(first+i, first+j);
+                bi[i+j*m] = (i == j) ? 1.0 : 0.0;
+              }
+          if (!GaussJordan(m, blk.data(), bi))
+            for (size_t j = 0; j < m; j++)
+              for (size_t i = 0; i < m; i++)
+                bi[i+j*m] = (i == j) ? 1.0 : 0.0;
+        }
+    }
+
+    void Apply (VectorView<double> r, VectorView<double> z) const override
+    {
+      for (size_t first = 0; first < n; first += bs)
+        {
+          size_t m = std::min(bs, n-first);
+          const double * bi = inv.data()+(first/bs)*bs*bs;
+          for (size_t i = 0; i < m; i++)
+            {
+              double sum = 0;
+              for (size_t j = 0; j < m; j++)
+                sum += bi[i+j*m] * r(first+j);
+              z(first+i) = sum;
+            }
+        }
+    }
+
+  private:
+    // b = a^{-1} b with partial pivoting, a is overwritten. false if singular
+    static bool GaussJordan (size_t m, double * a, double * b)
+    {
+      for (size_t k = 0; k < m; k++)
+        {
+          size_t p = k;
+          for (size_t i = k+1; i < m; i++)
+            if (std::fabs(a[i+k*m]) > std::fabs(a[p+k*m])) p = i;
+          if (a[p+k*m] == 0.0) return false;
+          for (size_t j = 0; j < m; j++)
+            {
+              std::swap(a[k+j*m], a[p+j*m]);
+              std::swap(b[k+j*m], b[p+j*m]);
+            }
+          double piv = 1/a[k+k*m];
+          for (size_t j = 0; j < m; j++)
+            {
+              a[k+j*m] *= piv;
+              b[k+j*m] *= piv;
+            }
+          for (size_t i = 0; i < m; i++)
+            {
+              if (i == k) continue;
+              double fac = a[i+k*m];
+              if (fac == 0.0) continue;
+              for (size_t j = 0; j < m; j++)
+                {
+                  a[i+j*m] -= fac * a[k+j*m];
+                  b[i+j*m] -= fac * b[k+j*m];
+                }
+            }
+        }
+      return true;
+    }
+  };
+
+
+  // incomplete Cholesky without fill-in, A ~ L L^T on the lower part of
+  // the pattern of A (A symmetric). On a non-positive pivot the factorization
+  // is repeated for A + alpha diag(A) with growing alpha (Manteuffel)
+  class IC0Preconditioner : public Preconditioner
+  {
+    SparseMatrix l;                  // pattern of A, only j <= i is used
+    std::vector<size_t> diagpos;
+  public:
+    double shift = 0;                // alpha of the last Setup
+
+    using Preconditioner::Setup;
+    void Setup (const SparseMatrix & a) override
+    {
+      size_t n = a.Height();
+      diagpos.resize(n);
+      for (size_t i = 0; i < n; i++)
+        {
+          diagpos[i] = a.Position(i,i);
+          if (diagpos[i] == SparseMatrix::npos)
+            throw std::domain_error("IC0: no diagonal entry");
+        }
+
+      for (shift = 0; ; shift = (shift == 0) ? 1e-3 : 2*shift)
+        {
+          if (shift > 1e3)
+            throw std::domain_error("IC0: matrix is not positive definite");
+          l = a;
+          if (shift > 0)
+            for (size_t i = 0; i < n; i++)
+              l.Value(diagpos[i]) *= 1+shift;
+          if (Factor()) return;
+        }
+    }
+
+    // z = (L L^T)^{-1} r
+    void Apply (VectorView<double> r, VectorView<double> z) const override
+    {
+      size_t n = diagpos.size();
+      for (size_t i = 0; i < n; i++)
+        {
+          double sum = r(i);
+          for (size_t k = l.First(i); k < diagpos[i]; k++)
+            sum -= l.Value(k) * z(l.ColNr(k));
+          z(i) = sum / l.Value(diagpos[i]);
+        }
+      for (size_t i = n; i-- > 0; )
+        {
+          double zi = z(i) /= l.Value(diagpos[i]);
+          for (size_t k = l.First(i); k < diagpos[i]; k++)
+            z(l.ColNr(k)) -= l.Value(k) * zi;
+        }
+    }
+
+  private:
+    bool Factor ()
+    {
+      for (size_t i = 0; i < diagpos.size(); i++)
+        {
+          for (size_t k = l.First(i); k < diagpos[i]; k++)
+            {
+              size_t j = l.ColNr(k);
+              // l_ij = (a_ij - sum_{m<j} l_im l_jm) / l_jj, merging the sorted rows
+              double sum = l.Value(k);
+              size_t ki = l.First(i), kj = l.First(j);
+              while (ki < k && kj < diagpos[j])
+                {
+                  size_t ci = l.ColNr(ki), cj = l.ColNr(kj);
+                  if (ci == cj) sum -= l.Value(ki++) * l.Value(kj++);
+                  else if (ci < cj) ki++;
+                  else kj++;
+                }
+              l.Value(k) = sum / l.Value(diagpos[j]);
+            }
+          double d = l.Value(diagpos[i]);
+          for (size_t k = l.First(i); k < diagpos[i]; k++)
+            d -= l.Value(k) * l.Value(k);
+          if (!(d > 0)) return false;
+          l.Value(diagpos[i]) = std::sqrt(d);
+        }
+      return true;
+    }
+  };
+
+
+  // by name, for the Python interface: "none" (nullptr), "jacobi",
+  // "blockjacobi" (blocks of size bs) or "ic0"
+  inline std::shared_ptr<Preconditioner> MakePreconditioner (const std::string & name, size_t bs = 1)
+  {
+    if (name == "none") return nullptr;
+    if (name == "jacobi") return std::make_shared<JacobiPreconditioner>();
+    if (name == "blockjacobi") return std::make_shared<BlockJacobiPreconditioner>(bs);
+    if (name == "ic0") return std::make_shared<IC0Preconditioner>();
+    throw std::invalid_argument("unknown preconditioner '" + name + "'");
+  }
+
+
+
+  // preconditioned conjugate gradients for A x = b, A symmetric and
+  // definite, given by its action. With warm = true the input x is the
+  // initial guess, scaled by the factor that minimizes the error in the
+  // energy norm along x: a bad guess costs one more product, never more
+  // iterations. Stops at |b - A x| <= max(rtol |b|, atol) or after
+  // maxsteps iterations, returns the number of iterations
+  class ConjugateGradient
+  {
+    std::vector<double> rv, zv, pv, qv;
+    double resnorm = 0;
+
+  public:
+    // relative residual at the end of the last Solve
+    double Residual() const { return resnorm; }
+
+    int Solve (std::function<void(VectorView<double>,VectorView<double>)> apply,
+               const Preconditioner * pre,
+               VectorView<double> b, VectorView<double> x,
+               double rtol, double atol = 0, int maxsteps = 500, bool warm = false)
+    {
+      size_t n = b.Size();
+      rv.resize(n); zv.resize(n); pv.resize(n); qv.resize(n);
+      VectorView<double> r(n, rv.data()), z(n, zv.data()), p(n, pv.data()), q(n, qv.data());
+      auto dot = [n] (VectorView<double> a, VectorView<double> b)
+      {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) sum += a(i)*b(i);
+        return sum;
+      };
+
+      double bnorm = b.L2Norm();
+      r = b;
+      if (warm)
+        {
+          apply(x, q);
+          double xax = dot(x, q);
+          double alpha = (xax != 0.0) ? dot(x, b) / xax : 0.0;
+          for (size_t i = 0; i < n; i++)
+            {
+              x(i) *= alpha;
+              r(i) -= alpha * q(i);
+            }
+        }
+      else
+        x = 0.0;
+
+      double stop = std::max(rtol * bnorm, atol);
+      double rnorm = r.L2Norm();
+      int its = 0;
+      double rz = 0;
+      while (rnorm > stop && its < maxsteps)
+        {
+          if (pre)
+            pre->Apply(r, z);
+          else
+            z = r;
+          double rznew = dot(r, z);
+          if (its == 0)
+            p = z;
+          else
+            for (size_t i = 0; i < n; i++)
+              p(i) = z(i) + rznew / rz * p(i);
+          rz = rznew;
+
+          apply(p, q);
+          double pq = dot(p, q);
+          if (pq == 0.0 || rz == 0.0) break;     // breakdown
+          double alpha = rz / pq;
+          for (size_t i = 0; i < n; i++)
+            {
+              x(i) += alpha * p(i);
+              r(i) -= alpha * q(i);
+            }
+          rnorm = r.L2Norm();
+          its++;
+        }
+      resnorm = (bnorm > 0) ? rnorm / bnorm : 0.0;
+      return its;
+    }
+  };
+
+
+  // restarted GMRES(m) with right preconditioning for A x = b, A is only
+  // given by its action y = A x. Modified Gram-Schmidt and Givens rotations,
+  // the Krylov basis of m+1 vectors is kept for the next call.
+  // Stops at |b - A x| <= rtol |b| or after maxsteps iterations,
+  // x is the initial guess on input. Returns the number of iterations
+  class GMRES
+  {
+    std::vector<double> basis;       // column k is v_k
+    std::vector<double> h;           // (m+1) x m Hessenberg, column major
+    std::vector<double> cs, sn, g, y;
+    std::vector<double> tmp;
+    double resnorm = 0;
+
+  public:
+    // relative residual at the end of the last Solve
+    double Residual() const { return resnorm; }
+
+    int Solve (std::function<void(VectorView<double>,VectorView<double>)> apply,
+               const Preconditioner * pre,
+               VectorView<double> b, VectorView<double> x,
+               double rtol, int restart = 30, int maxsteps = 200)
+    {
+      size_t n = b.Size();
+      size_t m = std::max(restart, 1);
+      basis.resize((m+1)*n);
+      h.resize((m+1)*m);
+      cs.resize(m);
+      sn.resize(m);
+      g.resize(m+1);
+      y.resize(m);
+      tmp.resize(n);
+
+      auto V = [&] (size_t k) { return VectorView<double>(n, basis.data()+k*n); };
+      auto H = [&] (size_t i, size_t k) -> double & { return h[i+k*(m+1)]; };
+      VectorView<double> z(n, tmp.data());
+
+      double bnorm = b.L2Norm();
+      if (bnorm == 0.0)
+        {
+          x = 0.0;
+          resnorm = 0;
+          return 0;
+        }
+
+      int its = 0;
+      while (true)
+        {
+          // v_0 = b - A x
+          auto v0 = V(0);
+          apply(x, v0);
+          for (size_t l = 0; l < n; l++)
+            v0(l) = b(l) - v0(l);
+          double beta = v0.L2Norm();
+          resnorm = beta / bnorm;
+          if (resnorm <= rtol || its >= maxsteps)
+            return its;
+
+          for (size_t l = 0; l < n; l++)
+            v0(l) /= beta;
+          g.assign(m+1, 0.0);
+          g[0] = beta;
+
+          size_t k = 0;
+          while (k < m && its < maxsteps)
+            {
+              // v_{k+1} = A P^{-1} v_k, orthogonalized
+              if (pre)
+                pre->Apply(V(k), z);
+              else
+                z = V(k);
+              auto w = V(k+1);
+              apply(z, w);
+              for (size_t j = 0; j <= k; j++)
+                {
+                  auto vj = V(j);
+                  double hjk = 0;
+                  for (size_t l = 0; l < n; l++)
+                    hjk += vj(l) * w(l);
+                  for (size_t l = 0; l < n; l++)
+                    w(l) -= hjk * vj(l);
+                  H(j,k) = hjk;
+                }
+              double hnorm = w.L2Norm();
+              H(k+1,k) = hnorm;
+              if (hnorm != 0.0)           // else: lucky breakdown, x is exact
+                for (size_t l = 0; l < n; l++)
+                  w(l) /= hnorm;
+
+              // the old rotations on the new column, and a new one for H(k+1,k)
+              for (size_t j = 0; j < k; j++)
+                {
+                  double a = H(j,k), c = H(j+1,k);
+                  H(j,k) = cs[j]*a + sn[j]*c;
+                  H(j+1,k) = -sn[j]*a + cs[j]*c;
+                }
+              double r = std::hypot(H(k,k), H(k+1,k));
+              cs[k] = (r != 0.0) ? H(k,k) / r : 1.0;
+              sn[k] = (r != 0.0) ? H(k+1,k) / r : 0.0;
+              H(k,k) = r;
+              H(k+1,k) = 0;
+              g[k+1] = -sn[k] * g[k];
+              g[k] = cs[k] * g[k];
+
+              k++;
+              its++;
+              if (std::fabs(g[k]) <= rtol * bnorm)
+                break;
+            }
+
+          // y = H^{-1} g,  x += P^{-1} V y
+          for (size_t i = k; i-- > 0; )
+            {
+              double sum = g[i];
+              for (size_t j = i+1; j < k; j++)
+                sum -= H(i,j) * y[j];
+              y[i] = (H(i,i) != 0.0) ? sum / H(i,i) : 0.0;
+            }
+          auto sum = V(m);     // only v_0 ... v_{k-1} are needed, k <= m
+          sum = 0.0;
+          for (size_t j = 0; j < k; j++)
+            {
+              auto vj = V(j);
+              for (size_t l = 0; l < n; l++)
+                sum(l) += y[j] * vj(l);
+            }
+          if (pre)
+            pre->Apply(sum, z);
+          else
+            z = sum;
+          for (size_t l = 0; l < n; l++)
+            x(l) += z(l);
+
+          resnorm = std::fabs(g[k]) / bnorm;
+          if (resnorm <= rtol || its >= maxsteps)
+            return its;
+        }
+    }
+  };
+
+}
+
+#endif
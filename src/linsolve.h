@@ -0,0 +1,493 @@
+#ifndef LINSOLVE_H
+#define LINSOLVE_H
+
+#include <vector>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+
+#include <../ASC-bla/src/vector.h>
+#include <../ASC-bla/src/matrix.h>
+#include "sparsematrix.h"
+
+
+namespace ASC_ode
+{
+  using namespace ASC_bla;
+
+  // dense LU factorization with partial pivoting, P A = L U
+  // factor once in O(n^3), then every Solve is O(n^2)
+  class DenseLU
+  {
+    size_t n = 0;
+    std::vector<double> lu;     // column major, L below diagonal (unit diag), U on and above
+    std::vector<size_t> piv;    // row i was swapped with row piv[i] in step i
+  public:
+    size_t Size() const { return n; }
+
+    void Factor (MatrixView<double, ColMajor> a)
+    {
+      n = a.Height();
+      lu.resize(n*n);
+      piv.resize(n);
+      for (size_t j = 0; j < n; j++)
+        for (size_t i = 0; i < n; i++)
+          lu[i+j*n] = a(i,j);
+
+      for (size_t k = 0; k < n; k++)
+        {
+          size_t p = k;
+          double maxval = std::fabs(lu[k+k*n]);
+          for (size_t i = k+1; i < n; i++)
+            if (std::fabs(lu[i+k*n]) > maxval)
+              {
+                maxval = std::fabs(lu[i+k*n]);
+                p = i;
+              }
+          if (maxval == 0.0)
+            throw std::domain_error("DenseLU: matrix is singular");
+          piv[k] = p;
+          if (p != k)
+            for (size_t j = 0; j < n; j++)
+              std::swap(lu[k+j*n], lu[p+j*n]);
+
+          double invpiv = 1.0 / lu[k+k*n];
+          for (size_t i = k+1; i < n; i++)
+            lu[i+k*n] *= invpiv;
+
+          // rank-1 update of the trailing block, column by column
+          for (size_t j = k+1; j < n; j++)
+            {
+              double ukj = lu[k+j*n];
+              if (ukj == 0.0) continue;
+              double * colj = &lu[j*n];
+              const double * colk = &lu[k*n];
+              for (size_t i = k+1; i < n; i++)
+                colj[i] -= colk[i] * ukj;
+            }
+        }
+    }
+
+    // overwrites b with A^{-1} b
+    void Solve (VectorView<double> b) const
+    {
+      for (size_t k = 0; k < n; k++)
+        if (piv[k] != k)
+          std::swap(b(k), b(piv[k]));
+
+      // forward substitution, L has unit diagonal
+      for (size_t j = 0; j < n; j++)
+        {
+          double bj = b(j);
+          if (bj == 0.0) continue;
+          for (size_t i = j+1; i < n; i++)
+            b(i) -= lu[i+j*n] * bj;
+        }
+      // backward substitution
+      for (size_t j = n; j-- > 0; )
+        {
+          b(j) /= lu[j+j*n];
+          double bj = b(j);
+          for (size_t i = 0; i < j; i++)
+            b(i) -= lu[i+j*n] * bj;
+        }
+    }
+  };
+
+
+
+  // dense L D L^T factorization for symmetric matrices, no pivoting
+  // needs about half the flops of LU, intended for SPD or quasi-definite matrices
+  class DenseLDLt
+  {
+    size_t n = 0;
+    std::vector<double> l;      // column major, unit lower triangular part used
+    std::vector<double> d;
+  public:
+    size_t Size() const { return n; }
+
+    void Factor (MatrixView<double, ColMajor> a)
+    {
+      n = a.Height();
+      l.resize(n*n);
+      d.resize(n);
+      for (size_t j = 0; j < n; j++)
+        for (size_t i = j; i < n; i++)
+          l[i+j*n] = a(i,j);
+
+      // right-looking, only the lower triangle is touched
+      for (size_t k = 0; k < n; k++)
+        {
+          double dk = l[k+k*n];
+          if (std::fabs(dk) < 1e-14 * (1+std::fabs(a(k,k))))
+            throw std::domain_error("DenseLDLt: zero pivot, matrix not quasi-definite");
+          d[k] = dk;
+          double invd = 1.0 / dk;
+          for (size_t j = k+1; j < n; j++)
+            {
+              // column k is still unscaled here, i.e. holds l_ik * d_k
+              double ljk = l[j+k*n] * invd;
+              if (ljk == 0.0) continue;
+              double * colj = &l[j*n];
+              const double * colk = &l[k*n];
+              for (size_t i = j; i < n; i++)
+                colj[i] -= colk[i] * ljk;
+            }
+          for (size_t i = k+1; i < n; i++)
+            l[i+k*n] *= invd;
+        }
+    }
+
+    // overwrites b with A^{-1} b
+    void Solve (VectorView<double> b) const
+    {
+      for (size_t j = 0; j < n; j++)
+        {
+          double bj = b(j);
+          if (bj == 0.0) continue;
+          for (size_t i = j+1; i < n; i++)
+            b(i) -= l[i+j*n] * bj;
+        }
+      for (size_t i = 0; i < n; i++)
+        b(i) /= d[i];
+      for (size_t j = n; j-- > 0; )
+        {
+          double sum = b(j);
+          for (size_t i = j+1; i < n; i++)
+            sum -= l[i+j*n] * b(i);
+          b(j) = sum;
+        }
+    }
+  };
+
+
+
+  // dense LU with partial pivoting of  shift I - a  for a complex shift and
+  // real a, as needed for the complex eigenvalue pairs of Radau IIA methods
+  class ComplexShiftedLU
+  {
+    size_t n = 0;
+    std::vector<std::complex<double>> lu;   // column major, as in DenseLU
+    std::vector<size_t> piv;
+    mutable std::vector<std::complex<double>> tmp;
+  public:
+    size_t Size() const { return n; }
+
+    void Factor (std::complex<double> shift, MatrixView<double, ColMajor> a)
+    {
+      n = a.Height();
+      lu.resize(n*n);
+      piv.resize(n);
+      tmp.resize(n);
+      for (size_t j = 0; j < n; j++)
+        for (size_t i = 0; i < n; i++)
+          lu[i+j*n] = -a(i,j);
+      for (size_t i = 0; i < n; i++)
+        lu[i+i*n] += shift;
+
+      for (size_t k = 0; k < n; k++)
+        {
+          size_t p = k;
+          double maxval = std::abs(lu[k+k*n]);
+          for (size_t i = k+1; i < n; i++)
+            if (std::abs(lu[i+k*n]) > maxval)
+              {
+                maxval = std::abs(lu[i+k*n]);
+                p = i;
+              }
+          if (maxval == 0.0)
+            throw std::domain_error("ComplexShiftedLU: matrix is singular");
+          piv[k] = p;
+          if (p != k)
+            for (size_t j = 0; j < n; j++)
+              std::swap(lu[k+j*n], lu[p+j*n]);
+
+          std::complex<double> invpiv = 1.0 / lu[k+k*n];
+          for (size_t i = k+1; i < n; i++)
+            lu[i+k*n] *= invpiv;
+
+          for (size_t j = k+1; j < n; j++)
+            {
+              std::complex<double> ukj = lu[k+j*n];
+              if (ukj == 0.0) continue;
+              for (size_t i = k+1; i < n; i++)
+                lu[i+j*n] -= lu[i+k*n] * ukj;
+            }
+        }
+    }
+
+    // overwrites b with (shift I - a)^{-1} b
+    void Solve (std::complex<double> * b) const
+    {
+      for (size_t k = 0; k < n; k++)
+        if (piv[k] != k)
+          std::swap(b[k], b[piv[k]]);
+      for (size_t j = 0; j < n; j++)
+        {
+          std::complex<double> bj = b[j];
+          if (bj == 0.0) continue;
+          for (size_t i = j+1; i < n; i++)
+            b[i] -= lu[i+j*n] * bj;
+        }
+      for (size_t j = n; j-- > 0; )
+        {
+          b[j] /= lu[j+j*n];
+          std::complex<double> bj = b[j];
+          for (size_t i = 0; i < j; i++)
+            b[i] -= lu[i+j*n] * bj;
+        }
+    }
+
+    // the right hand side re + i im, overwritten by the solution
+    void Solve (VectorView<double> re, VectorView<double> im) const
+    {
+      for (size_t i = 0; i < n; i++)
+        tmp[i] = std::complex<double>(re(i), im(i));
+      Solve(tmp.data());
+      for (size_t i = 0; i < n; i++)
+        {
+          re(i) = tmp[i].real();
+          im(i) = tmp[i].imag();
+        }
+    }
+  };
+
+
+
+  // sparse direct solver for matrices with fixed sparsity pattern.
+  // Analyze computes a Reverse Cuthill-McKee ordering of the symmetrized
+  // pattern and the envelope (profile) of the factors, this symbolic part is
+  // done once and reused for every Factor with the same pattern.
+  // Factorization is without pivoting (LU, or L D L^T if symmetric),
+  // a zero pivot throws std::domain_error.
+  class SparseLU
+  {
+    size_t n = 0;
+    bool symmetric = false;
+    std::vector<size_t> order;     // order[new] = old
+    std::vector<size_t> inv;       // inv[old] = new
+    std::vector<size_t> first;     // first non-zero column of row i (= row of column i) of the envelope
+    std::vector<size_t> lstart;    // row i of L: columns first[i] <= k < i, at lvals[lstart[i]+k-first[i]]
+    std::vector<size_t> ustart;    // column j of U: rows first[j] <= k < j, at uvals[ustart[j]+k-first[j]]
+    std::vector<double> lvals, uvals, d;   // d is the diagonal of U (or D)
+    std::vector<size_t> lpos, upos;  // CSR entry -> position in lvals/uvals/d
+    mutable std::vector<double> tmp;
+    size_t nze_pattern = 0;
+    bool analyzed = false;
+
+    static constexpr size_t DIAG = size_t(-1);
+  public:
+    bool Analyzed() const { return analyzed; }
+    size_t Size() const { return n; }
+    size_t EnvelopeSize() const { return lvals.size() + uvals.size() + n; }
+
+    void Analyze (const SparseMatrix & a, bool _symmetric = false)
+    {
+      n = a.Height();
+      symmetric = _symmetric;
+      nze_pattern = a.NZE();
+
+      std::vector<std::vector<size_t>> graph(n);
+      for (size_t i = 0; i < n; i++)
+        for (size_t k = a.First(i); k < a.Next(i); k++)
+          {
+            size_t j = a.ColNr(k);
+            if (i == j) continue;
+            graph[i].push_back(j);
+            graph[j].push_back(i);
+          }
+      for (auto & adj : graph)
+        {
+          std::sort(adj.begin(), adj.end());
+          adj.erase(std::unique(adj.begin(), adj.end()), adj.end());
+        }
+      order = ReverseCuthillMcKee(graph);
+      inv.resize(n);
+      for (size_t i = 0; i < n; i++)
+        inv[order[i]] = i;
+
+      first.resize(n);
+      for (size_t i = 0; i < n; i++)
+        first[i] = i;
+      for (size_t i = 0; i < n; i++)
+        for (size_t j : graph[i])
+          {
+            size_t ni = inv[i], nj = inv[j];
+            if (nj < ni) first[ni] = std::min(first[ni], nj);
+          }
+
+      lstart.resize(n+1);
+      ustart.resize(n+1);
+      lstart[0] = ustart[0] = 0;
+      for (size_t i = 0; i < n; i++)
+        {
+          lstart[i+1] = lstart[i] + (i-first[i]);
+          ustart[i+1] = ustart[i] + (i-first[i]);
+        }
+      lvals.resize(lstart[n]);
+      uvals.resize(symmetric ? 0 : ustart[n]);
+      d.resize(n);
+      tmp.resize(n);
+
+      // where every entry of a goes, in the permuted numbering
+      lpos.resize(a.NZE());
+      upos.resize(a.NZE());
+      for (size_t i = 0; i < n; i++)
+        for (size_t k = a.First(i); k < a.Next(i); k++)
+          {
+            size_t ni = inv[i], nj = inv[a.ColNr(k)];
+            lpos[k] = upos[k] = DIAG;
+            if (ni > nj)
+              lpos[k] = lstart[ni] + nj - first[ni];
+            else if (ni < nj)
+              upos[k] = ustart[nj] + ni - first[nj];
+          }
+      analyzed = true;
+    }
+
+    void Factor (const SparseMatrix & a)
+    {
+      if (!analyzed || a.Height() != n || a.NZE() != nze_pattern)
+        Analyze(a, symmetric);
+
+      std::fill(lvals.begin(), lvals.end(), 0.0);
+      std::fill(uvals.begin(), uvals.end(), 0.0);
+      std::fill(d.begin(), d.end(), 0.0);
+      for (size_t i = 0; i < n; i++)
+        for (size_t k = a.First(i); k < a.Next(i); k++)
+          {
+            if (lpos[k] != DIAG)
+              lvals[lpos[k]] += a.Value(k);
+            else if (upos[k] != DIAG)
+              {
+                if (!symmetric) uvals[upos[k]] += a.Value(k);
+              }
+            else
+              d[inv[i]] += a.Value(k);
+          }
+
+      if (symmetric)
+        FactorLDLt();
+      else
+        FactorLU();
+    }
+
+    // overwrites b with A^{-1} b
+    void Solve (VectorView<double> b) const
+    {
+      for (size_t i = 0; i < n; i++)
+        tmp[i] = b(order[i]);
+
+      // L y = b, unit lower triangular
+      for (size_t i = 0; i < n; i++)
+        {
+          const double * li = lvals.data() + lstart[i];
+          double sum = tmp[i];
+          for (size_t k = first[i]; k < i; k++)
+            sum -= li[k-first[i]] * tmp[k];
+          tmp[i] = sum;
+        }
+
+      if (symmetric)
+        {
+          for (size_t i = 0; i < n; i++)
+            tmp[i] /= d[i];
+          // L^T x = y, column j of L^T is row j of L
+          for (size_t j = n; j-- > 0; )
+            {
+              const double * lj = lvals.data() + lstart[j];
+              double xj = tmp[j];
+              for (size_t k = first[j]; k < j; k++)
+                tmp[k] -= lj[k-first[j]] * xj;
+            }
+        }
+      else
+        {
+          // U x = y, column oriented
+          for (size_t j = n; j-- > 0; )
+            {
+              const double * uj = uvals.data() + ustart[j];
+              double xj = tmp[j] / d[j];
+              tmp[j] = xj;
+              for (size_t k = first[j]; k < j; k++)
+                tmp[k] -= uj[k-first[j]] * xj;
+            }
+        }
+
+      for (size_t i = 0; i < n; i++)
+        b(order[i]) = tmp[i];
+    }
+
+  private:
+    void CheckPivot (size_t i, double scale) const
+    {
+      if (!(std::fabs(d[i]) > 1e-14 * scale))
+        throw std::domain_error("SparseLU: zero pivot");
+    }
+
+    // row i of L and column i of U computed from the previous rows/columns
+    void FactorLU ()
+    {
+      for (size_t i = 0; i < n; i++)
+        {
+          // entry k of row i of L is li[k-fi], of column i of U ui[k-fi]
+          size_t fi = first[i];
+          double * li = lvals.data() + lstart[i];
+          double * ui = uvals.data() + ustart[i];
+          double scale = std::fabs(d[i]);
+          for (size_t j = fi; j < i; j++)
+            {
+              size_t fj = first[j];
+              const double * lj = lvals.data() + lstart[j];
+              const double * uj = uvals.data() + ustart[j];
+              size_t k0 = std::max(fi, fj);
+              double suml = li[j-fi], sumu = ui[j-fi];
+              for (size_t k = k0; k < j; k++)
+                {
+                  suml -= li[k-fi] * uj[k-fj];
+                  sumu -= lj[k-fj] * ui[k-fi];
+                }
+              li[j-fi] = suml / d[j];
+              ui[j-fi] = sumu;
+            }
+          double sum = d[i];
+          for (size_t k = fi; k < i; k++)
+            sum -= li[k-fi] * ui[k-fi];
+          d[i] = sum;
+          CheckPivot(i, scale);
+        }
+    }
+
+    void FactorLDLt ()
+    {
+      for (size_t i = 0; i < n; i++)
+        {
+          size_t fi = first[i];
+          double * li = lvals.data() + lstart[i];
+          double scale = std::fabs(d[i]);
+          // li[j-fi] holds (L D)_ij until it is scaled below
+          for (size_t j = fi; j < i; j++)
+            {
+              size_t fj = first[j];
+              const double * lj = lvals.data() + lstart[j];
+              double sum = li[j-fi];
+              for (size_t k = std::max(fi, fj); k < j; k++)
+                sum -= li[k-fi] * lj[k-fj];
+              li[j-fi] = sum;
+            }
+          double sum = d[i];
+          for (size_t k = fi; k < i; k++)
+            {
+              double lik = li[k-fi] / d[k];
+              sum -= lik * li[k-fi];
+              li[k-fi] = lik;
+            }
+          d[i] = sum;
+          CheckPivot(i, scale);
+        }
+    }
+  };
+
+}
+
+#endif
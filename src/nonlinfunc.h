@@ -1,13 +1,50 @@
 #ifndef NONLINFUNC_H
 #define NONLINFUNC_H
 
+#include <memory>
+#include <cmath>
 #include <../ASC-bla/src/vector.h>
 #include <../ASC-bla/src/matrix.h>
+#include "sparsematrix.h"
+#include "workspace.h"
 
 
 namespace ASC_ode
 {
   using namespace ASC_bla;
+
+  // which Jacobian is computed together with the values
+  enum DERIV_MODE { NO_DERIV, DENSE_DERIV, SPARSE_DERIV };
+
+  // y = a*y + b*x and c = a*b, written as loops so that the
+  // combinators below never create temporaries
+  inline void LinComb (double a, VectorView<double> y, double b, VectorView<double> x)
+  {
+    for (size_t i = 0; i < y.Size(); i++)
+      y(i) = a*y(i) + b*x(i);
+  }
+
+  inline void LinComb (double a, MatrixView<double, ColMajor> y, double b, MatrixView<double, ColMajor> x)
+  {
+    for (size_t j = 0; j < y.Width(); j++)
+      for (size_t i = 0; i < y.Height(); i++)
+        y(i,j) = a*y(i,j) + b*x(i,j);
+  }
+
+  inline void MultMatMat (MatrixView<double, ColMajor> a, MatrixView<double, ColMajor> b,
+                          MatrixView<double, ColMajor> c)
+  {
+    c = 0.0;
+    for (size_t j = 0; j < c.Width(); j++)
+      for (size_t k = 0; k < a.Width(); k++)
+        {
+          double bkj = b(k,j);
+          if (bkj == 0.0) continue;
+          for (size_t i = 0; i < c.Height(); i++)
+            c(i,j) += a(i,k) * bkj;
+        }
+  }
+
   class NonlinearFunction
   {
   public:
@@ -16,14 +53,129 @@ namespace ASC_ode
     virtual size_t DimF() const = 0;
     virtual void Evaluate (VectorView<double> x, VectorView<double> f) const = 0;
     virtual void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const = 0;
+
+    // optional sparse derivative: the pattern is queried once,
+    // the default is a dense pattern filled from EvaluateDeriv
+    virtual SparsityPattern DerivPattern () const
+    {
+      SparsityPattern pattern(DimF(), DimX());
+      pattern.AddDense(0, DimF(), 0, DimX());
+      return pattern;
+    }
+    // df must contain the pattern returned by DerivPattern, all its entries are set
+    virtual void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const
+    {
+      WorkspaceScope ws;
+      auto dense = ws.Mat(DimF(), DimX());
+      EvaluateDeriv(x, dense);
+      df.SetFromDense(dense);
+    }
+
+    // value and Jacobian at the same point, as needed by Newton's method.
+    // functions override these to share intermediate results (inner values,
+    // geometry) between f and df, the defaults just call both
+    virtual void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                                    MatrixView<double, ColMajor> df) const
+    {
+      Evaluate(x, f);
+      EvaluateDeriv(x, df);
+    }
+    virtual void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                          SparseMatrix & df) const
+    {
+      Evaluate(x, f);
+      EvaluateSparseDeriv(x, df);
+    }
+
+    // directional derivative jv = df(x) v, for matrix-free Newton-Krylov.
+    // The default is a central difference, two evaluations and no Jacobian
+    virtual void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const
+    {
+      double normv = v.L2Norm();
+      if (normv == 0.0)
+        {
+          jv = 0.0;
+          return;
+        }
+      double eps = 5e-6 * (1 + x.L2Norm()) / normv;
+      WorkspaceScope ws;
+      auto xe = ws.Vec(DimX());
+      auto fm = ws.Vec(DimF());
+      for (size_t i = 0; i < xe.Size(); i++)
+        xe(i) = x(i) - eps*v(i);
+      Evaluate(xe, fm);
+      for (size_t i = 0; i < xe.Size(); i++)
+        xe(i) = x(i) + eps*v(i);
+      Evaluate(xe, jv);
+      LinComb(1/(2*eps), jv, -1/(2*eps), fm);
+    }
   };
 
 
-  class IdentityFunction : public NonlinearFunction
+  // f = diag(d) x, e.g. a lumped mass matrix. Value, Jacobian and directional
+  // derivative in O(n). Compose, the expressions and the compiled tapes
+  // recognize it and never form diag(d) as a dense matrix product
+  class DiagonalFunction : public NonlinearFunction
+  {
+  protected:
+    Vector<double> diag;
+  public:
+    DiagonalFunction (VectorView<double> _diag) : diag(_diag) { }
+    DiagonalFunction (size_t n, double val) : diag(n) { diag = val; }
+
+    // the entries may be changed, e.g. for new masses
+    VectorView<double> Diagonal() { return diag; }
+    const Vector<double> & Diagonal() const { return diag; }
+
+    size_t DimX() const override { return diag.Size(); }
+    size_t DimF() const override { return diag.Size(); }
+    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      for (size_t i = 0; i < diag.Size(); i++)
+        f(i) = diag(i) * x(i);
+    }
+    void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < diag.Size(); i++)
+        df(i,i) = diag(i);
+    }
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(diag.Size(), diag.Size());
+      pattern.AddDiag(0, diag.Size());
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < diag.Size(); i++)
+        df(i,i) = diag(i);
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      Evaluate(x, f);
+      EvaluateDeriv(x, df);
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      Evaluate(x, f);
+      EvaluateSparseDeriv(x, df);
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      Evaluate(v, jv);
+    }
+  };
+
+
+  class IdentityFunction : public DiagonalFunction
   {
     size_t n;
   public:
-    IdentityFunction (size_t _n) : n(_n) { } 
+    IdentityFunction (size_t _n) : DiagonalFunction(_n, 1.0), n(_n) { } 
     size_t DimX() const override { return n; }
     size_t DimF() const override { return n; }
     void Evaluate (VectorView<double> x, VectorView<double> f) const override
@@ -36,6 +188,34 @@ namespace ASC_ode
       df = 0.0;
       df.Diag() = 1.0;
     }
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(n, n);
+      pattern.AddDiag(0, n);
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < n; i++)
+        df(i,i) = 1.0;
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      f = x;
+      EvaluateDeriv(x, df);
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      f = x;
+      EvaluateSparseDeriv(x, df);
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = v;
+    }
   };
 
 
@@ -59,6 +239,30 @@ namespace ASC_ode
     {
       df = 0.0;
     }
+    SparsityPattern DerivPattern () const override
+    {
+      return SparsityPattern(DimF(), DimX());
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      f = val;
+      df = 0.0;
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      f = val;
+      df = 0.0;
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+    }
   };
 
   
@@ -67,29 +271,82 @@ namespace ASC_ode
   {
     std::shared_ptr<NonlinearFunction> fa, fb;
     double faca, facb;
+    mutable std::unique_ptr<SparseMatrix> sparse_tmp;
   public:
     SumFunction (std::shared_ptr<NonlinearFunction> _fa,
                  std::shared_ptr<NonlinearFunction> _fb,
                  double _faca, double _facb)
       : fa(_fa), fb(_fb), faca(_faca), facb(_facb) { } 
+
+    auto FuncA() const { return fa; }
+    auto FuncB() const { return fb; }
+    double FacA() const { return faca; }
+    double FacB() const { return facb; }
     
     size_t DimX() const override { return fa->DimX(); }
     size_t DimF() const override { return fa->DimF(); }
     void Evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       fa->Evaluate(x, f);
-      f = faca * f;
-      Vector<double> tmp(DimF());
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(DimF());
       fb->Evaluate(x, tmp);
-      f = f + facb*tmp;
+      LinComb(faca, f, facb, tmp);
     }
     void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
     {
       fa->EvaluateDeriv(x, df);
-      Matrix<double, ColMajor> tmp(DimF(), DimX());
-      tmp = faca * tmp;
+      WorkspaceScope ws;
+      auto tmp = ws.Mat(DimF(), DimX());
       fb->EvaluateDeriv(x, tmp);
-      df = df + facb*tmp;
+      LinComb(faca, df, facb, tmp);
+    }
+    SparsityPattern DerivPattern () const override
+    {
+      auto pattern = fa->DerivPattern();
+      pattern.Add(fb->DerivPattern());
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      fa->EvaluateSparseDeriv(x, df);
+      df.Scale(faca);
+      if (!sparse_tmp)
+        sparse_tmp = std::make_unique<SparseMatrix>(fb->DerivPattern());
+      fb->EvaluateSparseDeriv(x, *sparse_tmp);
+      df.Add(facb, *sparse_tmp);
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      fa->EvaluateWithDeriv(x, f, df);
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(DimF());
+      auto tmpdf = ws.Mat(DimF(), DimX());
+      fb->EvaluateWithDeriv(x, tmp, tmpdf);
+      LinComb(faca, f, facb, tmp);
+      LinComb(faca, df, facb, tmpdf);
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      fa->EvaluateWithSparseDeriv(x, f, df);
+      df.Scale(faca);
+      if (!sparse_tmp)
+        sparse_tmp = std::make_unique<SparseMatrix>(fb->DerivPattern());
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(DimF());
+      fb->EvaluateWithSparseDeriv(x, tmp, *sparse_tmp);
+      LinComb(faca, f, facb, tmp);
+      df.Add(facb, *sparse_tmp);
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      fa->ApplyDeriv(x, v, jv);
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(DimF());
+      fb->ApplyDeriv(x, v, tmp);
+      LinComb(faca, jv, facb, tmp);
     }
   };
 
@@ -113,19 +370,50 @@ namespace ASC_ode
     ScaleFunction (std::shared_ptr<NonlinearFunction> _fa,
                    double _fac)
       : fa(_fa), fac(_fac) { } 
+
+    auto Func() const { return fa; }
+    double Factor() const { return fac; }
     
     size_t DimX() const override { return fa->DimX(); }
     size_t DimF() const override { return fa->DimF(); }
     void Evaluate (VectorView<double> x, VectorView<double> f) const override
     {
       fa->Evaluate(x, f);
-      f = fac*f;
+      LinComb(fac, f, 0.0, f);
 
     }
     void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
     {
       fa->EvaluateDeriv(x, df);
-      df = fac*df;
+      LinComb(fac, df, 0.0, df);
+    }
+    SparsityPattern DerivPattern () const override
+    {
+      return fa->DerivPattern();
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      fa->EvaluateSparseDeriv(x, df);
+      df.Scale(fac);
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      fa->EvaluateWithDeriv(x, f, df);
+      LinComb(fac, f, 0.0, f);
+      LinComb(fac, df, 0.0, df);
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      fa->EvaluateWithSparseDeriv(x, f, df);
+      LinComb(fac, f, 0.0, f);
+      df.Scale(fac);
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      fa->ApplyDeriv(x, v, jv);
+      LinComb(fac, jv, 0.0, jv);
     }
   };
 
@@ -137,34 +425,171 @@ namespace ASC_ode
 
 
 
-  // fa(fb)
+  // fa(fb). If fa or fb is diagonal the Jacobian of the other one is
+  // scaled by rows or columns, there is no matrix product
   class ComposeFunction : public NonlinearFunction
   {
     std::shared_ptr<NonlinearFunction> fa, fb;
+    const DiagonalFunction * diaga, * diagb;
+    mutable std::unique_ptr<SparseMatrix> sparse_jaca, sparse_jacb;
   public:
     ComposeFunction (std::shared_ptr<NonlinearFunction> _fa,
                      std::shared_ptr<NonlinearFunction> _fb)
-      : fa(_fa), fb(_fb) { } 
+      : fa(_fa), fb(_fb),
+        diaga(dynamic_cast<const DiagonalFunction*>(_fa.get())),
+        diagb(dynamic_cast<const DiagonalFunction*>(_fb.get())) { } 
+
+    auto Outer() const { return fa; }
+    auto Inner() const { return fb; }
     
     size_t DimX() const override { return fb->DimX(); }
     size_t DimF() const override { return fa->DimF(); }
     void Evaluate (VectorView<double> x, VectorView<double> f) const override
     {
-      Vector<double> tmp(fb->DimF());
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(fb->DimF());
       fb->Evaluate (x, tmp);
       fa->Evaluate (tmp, f);
     }
     void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
     {
-      Vector<double> tmp(fb->DimF());
+      if (diaga)
+        {
+          fb->EvaluateDeriv(x, df);
+          ScaleRows(diaga->Diagonal(), df);
+          return;
+        }
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(fb->DimF());
       fb->Evaluate (x, tmp);
+      if (diagb)
+        {
+          fa->EvaluateDeriv(tmp, df);
+          ScaleCols(diagb->Diagonal(), df);
+          return;
+        }
       
-      Matrix<double, ColMajor> jaca(fa->DimF(), fa->DimX());
-      Matrix<double, ColMajor> jacb(fb->DimF(), fb->DimX());
+      auto jaca = ws.Mat(fa->DimF(), fa->DimX());
+      auto jacb = ws.Mat(fb->DimF(), fb->DimX());
 
       fb->EvaluateDeriv(x, jacb);
       fa->EvaluateDeriv(tmp, jaca);
-      df = jaca*jacb;
+      MultMatMat(jaca, jacb, df);
+    }
+    SparsityPattern DerivPattern () const override
+    {
+      return PatternProduct(fa->DerivPattern(), fb->DerivPattern());
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      if (diaga)
+        {
+          fb->EvaluateSparseDeriv(x, df);
+          df.ScaleRows(diaga->Diagonal());
+          return;
+        }
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(fb->DimF());
+      fb->Evaluate (x, tmp);
+      if (diagb)
+        {
+          fa->EvaluateSparseDeriv(tmp, df);
+          df.ScaleCols(diagb->Diagonal());
+          return;
+        }
+
+      if (!sparse_jaca)
+        {
+          sparse_jaca = std::make_unique<SparseMatrix>(fa->DerivPattern());
+          sparse_jacb = std::make_unique<SparseMatrix>(fb->DerivPattern());
+        }
+      fb->EvaluateSparseDeriv(x, *sparse_jacb);
+      fa->EvaluateSparseDeriv(tmp, *sparse_jaca);
+      SparseProduct(*sparse_jaca, *sparse_jacb, df);
+    }
+    // the inner function is evaluated once for value and derivative
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(fb->DimF());
+      if (diaga || diagb)
+        {
+          if (diaga)
+            {
+              fb->EvaluateWithDeriv(x, tmp, df);
+              fa->Evaluate(tmp, f);
+              ScaleRows(diaga->Diagonal(), df);
+            }
+          else
+            {
+              fb->Evaluate(x, tmp);
+              fa->EvaluateWithDeriv(tmp, f, df);
+              ScaleCols(diagb->Diagonal(), df);
+            }
+          return;
+        }
+      auto jaca = ws.Mat(fa->DimF(), fa->DimX());
+      auto jacb = ws.Mat(fb->DimF(), fb->DimX());
+
+      fb->EvaluateWithDeriv(x, tmp, jacb);
+      fa->EvaluateWithDeriv(tmp, f, jaca);
+      MultMatMat(jaca, jacb, df);
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(fb->DimF());
+      if (diaga || diagb)
+        {
+          if (diaga)
+            {
+              fb->EvaluateWithSparseDeriv(x, tmp, df);
+              fa->Evaluate(tmp, f);
+              df.ScaleRows(diaga->Diagonal());
+            }
+          else
+            {
+              fb->Evaluate(x, tmp);
+              fa->EvaluateWithSparseDeriv(tmp, f, df);
+              df.ScaleCols(diagb->Diagonal());
+            }
+          return;
+        }
+      if (!sparse_jaca)
+        {
+          sparse_jaca = std::make_unique<SparseMatrix>(fa->DerivPattern());
+          sparse_jacb = std::make_unique<SparseMatrix>(fb->DerivPattern());
+        }
+      fb->EvaluateWithSparseDeriv(x, tmp, *sparse_jacb);
+      fa->EvaluateWithSparseDeriv(tmp, f, *sparse_jaca);
+      SparseProduct(*sparse_jaca, *sparse_jacb, df);
+    }
+
+    // chain rule: fa'(fb(x)) (fb'(x) v)
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(fb->DimF());
+      auto tmpv = ws.Vec(fb->DimF());
+      fb->Evaluate (x, tmp);
+      fb->ApplyDeriv (x, v, tmpv);
+      fa->ApplyDeriv (tmp, tmpv, jv);
+    }
+
+  private:
+    static void ScaleRows (VectorView<double> d, MatrixView<double, ColMajor> df)
+    {
+      for (size_t j = 0; j < df.Width(); j++)
+        for (size_t i = 0; i < df.Height(); i++)
+          df(i,j) *= d(i);
+    }
+    static void ScaleCols (VectorView<double> d, MatrixView<double, ColMajor> df)
+    {
+      for (size_t j = 0; j < df.Width(); j++)
+        for (size_t i = 0; i < df.Height(); i++)
+          df(i,j) *= d(j);
     }
   };
   
@@ -179,6 +604,7 @@ namespace ASC_ode
     std::shared_ptr<NonlinearFunction> fa;
     size_t firstx, dimx, firstf, dimf;
     size_t nextx, nextf;
+    mutable std::unique_ptr<SparseMatrix> sparse_tmp;
   public:
     EmbedFunction (std::shared_ptr<NonlinearFunction> _fa,
                    size_t _firstx, size_t _dimx,
@@ -187,6 +613,10 @@ namespace ASC_ode
         firstx(_firstx), dimx(_dimx), firstf(_firstf), dimf(_dimf),
         nextx(_firstx+_fa->DimX()), nextf(_firstf+_fa->DimF())
     { }
+
+    auto Func() const { return fa; }
+    size_t FirstX() const { return firstx; }
+    size_t FirstF() const { return firstf; }
     
     size_t DimX() const override { return dimx; }
     size_t DimF() const override { return dimf; }
@@ -201,6 +631,43 @@ namespace ASC_ode
       fa->EvaluateDeriv(x.Range(firstx, nextx),
                         df.Rows(firstf, nextf).Cols(firstx, nextx));      
     }
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(dimf, dimx);
+      pattern.Add(fa->DerivPattern(), firstf, firstx);
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      if (!sparse_tmp)
+        sparse_tmp = std::make_unique<SparseMatrix>(fa->DerivPattern());
+      fa->EvaluateSparseDeriv(x.Range(firstx, nextx), *sparse_tmp);
+      df = 0.0;
+      df.Add(1.0, *sparse_tmp, firstf, firstx);
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      f = 0.0;
+      df = 0;
+      fa->EvaluateWithDeriv(x.Range(firstx, nextx), f.Range(firstf, nextf),
+                            df.Rows(firstf, nextf).Cols(firstx, nextx));
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      if (!sparse_tmp)
+        sparse_tmp = std::make_unique<SparseMatrix>(fa->DerivPattern());
+      f = 0.0;
+      fa->EvaluateWithSparseDeriv(x.Range(firstx, nextx), f.Range(firstf, nextf), *sparse_tmp);
+      df = 0.0;
+      df.Add(1.0, *sparse_tmp, firstf, firstx);
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+      fa->ApplyDeriv(x.Range(firstx, nextx), v.Range(firstx, nextx), jv.Range(firstf, nextf));
+    }
   };
 
   
@@ -211,6 +678,9 @@ namespace ASC_ode
     Projector (size_t _size, 
                size_t _first, size_t _next)
       : size(_size), first(_first), next(_next) { }
+
+    size_t First() const { return first; }
+    size_t Next() const { return next; }
     
     size_t DimX() const override { return size; }
     size_t DimF() const override { return size; }
@@ -224,12 +694,30 @@ namespace ASC_ode
       df = 0.0;
       df.Diag().Range(first, next) = 1; 
     }
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(size, size);
+      pattern.AddDiag(first, next);
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      df = 0.0;
+      for (size_t i = first; i < next; i++)
+        df(i,i) = 1.0;
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      jv = 0.0;
+      jv.Range(first, next) = v.Range(first, next);
+    }
   };
 
   class BlockFunction : public NonlinearFunction
   {
     size_t s;   // number of stages
     std::shared_ptr<NonlinearFunction>* funs;
+    mutable std::vector<std::unique_ptr<SparseMatrix>> sparse_tmp;
   public:
     BlockFunction(size_t _s, std::shared_ptr<NonlinearFunction>* _funs)
       : s(_s), funs(_funs) { }
@@ -241,22 +729,65 @@ namespace ASC_ode
       for(size_t i=0; i<s; i++){
         std::shared_ptr<NonlinearFunction> fun = funs[i];
         size_t dim_f = fun->DimF();
-        Vector<double> tmp(dim_f);
-        fun->Evaluate(x, tmp);
-        for(size_t j=0; j<dim_f; j++){
-          f(i * dim_f + j) = tmp(j);
-        }
+        fun->Evaluate(x, f.Range(i*dim_f, (i+1)*dim_f));
       }
     }
     void EvaluateDeriv(VectorView<double> x, MatrixView<double, ColMajor> df) const override{
       size_t dim_f = funs[0]->DimF();
-      Matrix<double, ColMajor> tmp (dim_f, s * dim_f);
       for(size_t j=0; j<s; j++){
         std::shared_ptr<NonlinearFunction> fun = funs[j];
-        fun->EvaluateDeriv(x, tmp);     // tmp = Df_j Jacobi-Matrix of j-th function 
-        df.Rows(j*dim_f, (j+1)*dim_f) = tmp;
+        fun->EvaluateDeriv(x, df.Rows(j*dim_f, (j+1)*dim_f));     // Df_j Jacobi-Matrix of j-th function
       }
     }
+    SparsityPattern DerivPattern () const override
+    {
+      size_t dim_f = funs[0]->DimF();
+      SparsityPattern pattern(DimF(), DimX());
+      for (size_t j = 0; j < s; j++)
+        pattern.Add(funs[j]->DerivPattern(), j*dim_f, 0);
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      size_t dim_f = funs[0]->DimF();
+      if (sparse_tmp.size() != s)
+        for (size_t j = 0; j < s; j++)
+          sparse_tmp.push_back(std::make_unique<SparseMatrix>(funs[j]->DerivPattern()));
+      df = 0.0;
+      for (size_t j = 0; j < s; j++)
+        {
+          funs[j]->EvaluateSparseDeriv(x, *sparse_tmp[j]);
+          df.Add(1.0, *sparse_tmp[j], j*dim_f, 0);
+        }
+    }
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      size_t dim_f = funs[0]->DimF();
+      for (size_t j = 0; j < s; j++)
+        funs[j]->EvaluateWithDeriv(x, f.Range(j*dim_f, (j+1)*dim_f),
+                                   df.Rows(j*dim_f, (j+1)*dim_f));
+    }
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      size_t dim_f = funs[0]->DimF();
+      if (sparse_tmp.size() != s)
+        for (size_t j = 0; j < s; j++)
+          sparse_tmp.push_back(std::make_unique<SparseMatrix>(funs[j]->DerivPattern()));
+      df = 0.0;
+      for (size_t j = 0; j < s; j++)
+        {
+          funs[j]->EvaluateWithSparseDeriv(x, f.Range(j*dim_f, (j+1)*dim_f), *sparse_tmp[j]);
+          df.Add(1.0, *sparse_tmp[j], j*dim_f, 0);
+        }
+    }
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      size_t dim_f = funs[0]->DimF();
+      for (size_t j = 0; j < s; j++)
+        funs[j]->ApplyDeriv(x, v, jv.Range(j*dim_f, (j+1)*dim_f));
+    }
   };
 
   class BlockMatVec : public NonlinearFunction
@@ -276,20 +807,50 @@ namespace ASC_ode
       f = 0.;
       size_t s = A.Height();
       size_t n = (vecfun->DimF())/s;
-      Vector<double> tmp (vecfun->DimF());
+      WorkspaceScope ws;
+      auto tmp = ws.Vec(vecfun->DimF());
       vecfun->Evaluate(x, tmp);
       for(size_t l=0; l<s; l++){
-        f = f + (A(j, l) * tmp.Range(n*l, n*(l+1)));
+        LinComb(1.0, f, A(j, l), tmp.Range(n*l, n*(l+1)));
       }
     }
     void EvaluateDeriv(VectorView<double> x, MatrixView<double, ColMajor> df) const override {
       size_t s = A.Height();
       size_t n = (vecfun->DimF())/s;
-      for(size_t l = 0; l < s; l++){
-        Matrix<double, ColMajor> tmp (n, n);
-        tmp.Diag() = A(j, l);
-        df.Cols(n*l, n*(l+1)) = tmp;
-      }
+      df = 0.0;
+      for(size_t l = 0; l < s; l++)
+        for(size_t i = 0; i < n; i++)
+          df(i, n*l+i) = A(j, l);
+    }
+    SparsityPattern DerivPattern () const override
+    {
+      size_t s = A.Height();
+      size_t n = (vecfun->DimF())/s;
+      SparsityPattern pattern(DimF(), DimX());
+      for (size_t l = 0; l < s; l++)
+        if (A(j, l) != 0.0)
+          for (size_t i = 0; i < n; i++)
+            pattern.Add(i, n*l+i);
+      return pattern;
+    }
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      size_t s = A.Height();
+      size_t n = (vecfun->DimF())/s;
+      df = 0.0;
+      for (size_t l = 0; l < s; l++)
+        if (A(j, l) != 0.0)
+          for (size_t i = 0; i < n; i++)
+            df(i, n*l+i) = A(j, l);
+    }
+    // as EvaluateDeriv, for the stage vector itself as vecfun
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      size_t s = A.Height();
+      size_t n = (vecfun->DimF())/s;
+      jv = 0.0;
+      for (size_t l = 0; l < s; l++)
+        LinComb(1.0, jv, A(j, l), v.Range(n*l, n*(l+1)));
     }
   };
 
@@ -0,0 +1,643 @@
+#ifndef RADAU_H
+#define RADAU_H
+
+#include <complex>
+#include <vector>
+#include <algorithm>
+
+#include "rungekutta.h"
+
+
+namespace ASC_ode
+{
+
+  // roots of  sum_k coefs[k] x^k  by Durand-Kerner iteration, polished
+  // with Newton. Intended for the small polynomials of the Radau methods
+  inline std::vector<std::complex<double>> PolynomialRoots (std::vector<double> coefs)
+  {
+    using cplx = std::complex<double>;
+    size_t deg = coefs.size()-1;
+    for (auto & ci : coefs) ci /= coefs[deg];
+
+    auto eval = [&] (cplx x, cplx & deriv)
+    {
+      cplx p = coefs[deg];
+      deriv = 0;
+      for (size_t k = deg; k-- > 0; )
+        {
+          deriv = deriv*x + p;
+          p = p*x + coefs[k];
+        }
+      return p;
+    };
+
+    std::vector<cplx> z(deg);
+    for (size_t i = 0; i < deg; i++)
+      z[i] = std::pow(cplx(0.4, 0.9), double(i));
+
+    cplx deriv;
+    for (int it = 0; it < 500; it++)
+      {
+        double change = 0;
+        for (size_t i = 0; i < deg; i++)
+          {
+            cplx denom = 1;
+            for (size_t j = 0; j < deg; j++)
+              if (j != i) denom *= z[i]-z[j];
+            cplx dz = eval(z[i], deriv) / denom;
+            z[i] -= dz;
+            change = std::max(change, std::abs(dz) / (1+std::abs(z[i])));
+          }
+        if (change < 1e-15) break;
+      }
+    for (auto & zi : z)
+      for (int it = 0; it < 3; it++)
+        {
+          cplx p = eval(zi, deriv);
+          if (deriv != 0.0) zi -= p / deriv;
+        }
+    return z;
+  }
+
+  // det(x I - a) = sum_k coefs[k] x^k, Faddeev-LeVerrier
+  inline std::vector<double> CharacteristicPolynomial (const Matrix<double, ColMajor> & a)
+  {
+    size_t n = a.Height();
+    std::vector<double> coefs(n+1, 0.0);
+    coefs[n] = 1;
+    Matrix<double, ColMajor> mk(n, n), amk(n, n);
+    mk = 0.0;
+    for (size_t k = 1; k <= n; k++)
+      {
+        // M_k = a M_{k-1} + c_{n-k+1} I
+        MultMatMat(a, mk, amk);
+        for (size_t i = 0; i < n; i++)
+          amk(i,i) += coefs[n-k+1];
+        mk = amk;
+        // c_{n-k} = -tr(a M_k) / k
+        double trace = 0;
+        for (size_t i = 0; i < n; i++)
+          for (size_t j = 0; j < n; j++)
+            trace += a(i,j) * mk(j,i);
+        coefs[n-k] = -trace / k;
+      }
+    return coefs;
+  }
+
+
+  // Radau IIA with s stages, order 2s-1, stiffly accurate.
+  // The nodes are the roots of d^{s-1}/dx^{s-1} (x^{s-1} (x-1)^s),
+  // A follows from the collocation conditions  sum_j a_ij c_j^{k-1} = c_i^k / k
+  inline ButcherTableau RadauIIATableau (size_t s)
+  {
+    // q(x) = x^{s-1} (x-1)^s
+    std::vector<double> q(2*s, 0.0);
+    double binom = 1;
+    for (size_t m = 0; m <= s; m++)
+      {
+        q[m+s-1] = ((s-m) % 2 ? -1 : 1) * binom;
+        binom = binom * (s-m) / (m+1);
+      }
+    // p = q^{(s-1)}
+    std::vector<double> p(s+1);
+    for (size_t j = 0; j <= s; j++)
+      {
+        double fac = 1;
+        for (size_t l = j+1; l <= j+s-1; l++) fac *= l;
+        p[j] = q[j+s-1] * fac;
+      }
+
+    auto roots = PolynomialRoots(p);
+    std::vector<double> nodes;
+    for (auto r : roots) nodes.push_back(r.real());
+    std::sort(nodes.begin(), nodes.end());
+    nodes[s-1] = 1.0;
+
+    ButcherTableau tab(s, false);
+    for (size_t i = 0; i < s; i++)
+      tab.c(i) = nodes[i];
+
+    // V(k,j) = c_j^k
+    Matrix<double, ColMajor> V(s, s);
+    for (size_t j = 0; j < s; j++)
+      {
+        double pw = 1;
+        for (size_t k = 0; k < s; k++, pw *= nodes[j])
+          V(k,j) = pw;
+      }
+    DenseLU lu;
+    lu.Factor(V);
+    Vector<double> row(s);
+    for (size_t i = 0; i < s; i++)
+      {
+        double pw = nodes[i];
+        for (size_t k = 0; k < s; k++, pw *= nodes[i])
+          row(k) = pw / (k+1);
+        lu.Solve(row);
+        for (size_t j = 0; j < s; j++)
+          tab.A(i,j) = row(j);
+      }
+    for (size_t j = 0; j < s; j++)
+      tab.b(j) = tab.A(s-1,j);
+    tab.order = 2*s-1;
+    return tab;
+  }
+
+
+
+  // Radau IIA for stiff dy/dt = rhs(y), after Hairer-Wanner (RADAU5).
+  // The stage increments Z solve  (A^{-1}/dt (x) I) Z = F(y+Z). With the real
+  // eigen-decomposition A^{-1} = T Lambda T^{-1} simplified Newton splits into
+  // one real system (gamma/dt I - J) and one complex system
+  // ((alpha - i beta)/dt I - J) per eigenvalue pair, all n x n. Their
+  // factorizations are kept while the step size and the Jacobian stay.
+  // The Jacobian is reused over steps while Newton contracts well.
+  //
+  // Advance(tend) controls the step size with the embedded error estimate
+  // of Hairer-Wanner, Step(dt) makes steps of fixed size.
+  // DenseOutput evaluates the collocation polynomial of the last step.
+  // Dense Jacobians only, the number of stages must be odd (3, 5, 7).
+  class Radau : public TimeStepper
+  {
+    static constexpr int max_newton = 7;       // simplified Newton iterations per step
+    static constexpr double theta_jacobian = 0.001;   // new Jacobian if contraction is worse
+
+    std::shared_ptr<NonlinearFunction> rhs;
+    AdaptiveOptions opts;
+    size_t s, n, npairs;
+    Vector<double> c;
+    Matrix<double, ColMajor> T, Tinv;
+    double gamma;                   // real eigenvalue of A^{-1}
+    std::vector<double> alpha, beta;  // complex eigenvalues alpha + i beta of A^{-1}
+    Vector<double> dd;              // error estimate: f0 + 1/dt sum dd_i Z_i
+
+    Matrix<double, ColMajor> jac, mreal;
+    DenseLU lureal;
+    std::vector<ComplexShiftedLU> lucomplex;
+    bool jac_valid = false;         // jac can be used
+    bool jac_current = false;       // jac was evaluated at y
+    bool factored = false;
+    double h_factored = 0;
+
+    Vector<double> y, z, w, dw, f, f0, err;
+    bool f0_valid = false;
+    // last accepted step, for dense output and the prediction of Z
+    Vector<double> yold, zold;
+    double told = 0, hold = 0;
+    bool has_previous = false;
+
+    double h = 0;                   // proposed step size
+    double faccon = 1, theta = 1;
+    StepStatistics stats;
+
+  protected:
+    void Build (double dt) override { }
+    void DoStep (double dt) override
+    {
+      if (!jac_valid) EvaluateJacobian();
+      Predict(dt);
+      int its = 0;
+      if (!SolveStages(dt, its))
+        {
+          if (jac_current)
+            throw std::domain_error("Radau: Newton did not converge");
+          EvaluateJacobian();
+          Predict(dt);
+          if (!SolveStages(dt, its))
+            throw std::domain_error("Radau: Newton did not converge");
+        }
+      Accept(dt);
+      stats.accepted++;
+      if (theta > theta_jacobian)
+        jac_valid = false;
+    }
+
+  public:
+    Radau (std::shared_ptr<NonlinearFunction> _rhs, size_t stages = 3,
+           const AdaptiveOptions & _opts = AdaptiveOptions(),
+           const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), opts(_opts), s(stages), n(_rhs->DimX()),
+        npairs(stages/2), c(stages), T(stages, stages), Tinv(stages, stages), dd(stages),
+        jac(n, n), mreal(n, n), lucomplex(stages/2),
+        y(n), z(n*stages), w(n*stages), dw(n*stages), f(n*stages), f0(n), err(n),
+        yold(n), zold(n*stages)
+    {
+      if (s % 2 == 0)
+        throw std::invalid_argument("Radau: number of stages must be odd");
+      auto tab = RadauIIATableau(s);
+      c = tab.c;
+      Transformation(tab);
+    }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      has_previous = false;
+      f0_valid = false;
+      jac_valid = jac_current = false;
+      factored = false;
+      h = opts.dt_init;
+      faccon = 1;
+      theta = 1;
+      Restart(t0);
+    }
+
+    VectorView<double> Solution() override { return y; }
+    const StepStatistics & Statistics() const { return stats; }
+    double ProposedStepSize() const { return h; }
+
+    // the collocation polynomial of the last step, for told <= tq <= Time()
+    void DenseOutput (double tq, VectorView<double> out) const
+    {
+      if (!has_previous)
+        throw std::domain_error("Radau::DenseOutput: no step done");
+      for (size_t l = 0; l < n; l++)
+        out(l) = yold(l);
+      AddCollocation((tq-told)/hold, out);
+    }
+
+    void Advance (double tend, std::function<void(double,VectorView<double>)> callback = nullptr) override
+    {
+      if (h <= 0)
+        {
+          h = InitialStepSize(*rhs, y, opts);
+          stats.rhs_evaluations++;
+        }
+      bool first = true, last_rejected = false;
+
+      while (t < tend)
+        {
+          double dt = std::min(h, tend-t);
+          bool last = (dt == tend-t);
+
+          if (!jac_valid) EvaluateJacobian();
+          Predict(dt);
+          int its = 0;
+          if (!SolveStages(dt, its))
+            {
+              // Newton failed: fresh Jacobian, or smaller step
+              stats.rejected++;
+              last_rejected = true;
+              if (!jac_current)
+                EvaluateJacobian();
+              else
+                h = dt/2;
+              if (h < opts.dt_min)
+                throw std::domain_error("Radau: step size too small");
+              continue;
+            }
+
+          double errnorm = ErrorEstimate(dt, first || last_rejected);
+          double fac = opts.safety * (2*max_newton+1) / (2*max_newton+its);
+          fac = std::min(opts.safety, fac);
+          double quot = fac * std::pow(std::max(errnorm, 1e-10), -1.0/(s+1));
+          double hnew = dt * std::min(opts.facmax, std::max(opts.facmin, quot));
+
+          if (errnorm < 1)
+            {
+              Accept(dt);
+              t = last ? tend : t+dt;
+              stats.accepted++;
+              if (last_rejected) hnew = std::min(hnew, dt);
+              first = last_rejected = false;
+
+              // keep Jacobian and factorizations if Newton converged fast
+              // and the step size would hardly change
+              if (theta > theta_jacobian)
+                jac_valid = false;
+              else if (hnew >= dt && hnew <= 1.2*dt)
+                hnew = dt;
+              if (!last || dt == h) h = hnew;
+              if (callback) callback(t, y);
+            }
+          else
+            {
+              stats.rejected++;
+              h = first ? dt/10 : hnew;
+              last_rejected = true;
+              if (h < opts.dt_min)
+                throw std::domain_error("Radau: step size too small");
+            }
+          if (opts.dt_max > 0)
+            h = std::min(h, opts.dt_max);
+        }
+    }
+
+  private:
+    // A^{-1} T = T Lambda with Lambda = diag(gamma, [alpha, beta; -beta, alpha], ...),
+    // T from inverse iteration on the eigenvalues of A^{-1}
+    void Transformation (const ButcherTableau & tab)
+    {
+      using cplx = std::complex<double>;
+      Matrix<double, ColMajor> Minv(s, s);
+      DenseLU lu;
+      lu.Factor(tab.A);
+      Vector<double> col(s);
+      for (size_t j = 0; j < s; j++)
+        {
+          col = 0.0;
+          col(j) = 1;
+          lu.Solve(col);
+          for (size_t i = 0; i < s; i++)
+            Minv(i,j) = col(i);
+        }
+
+      auto eigenvalues = PolynomialRoots(CharacteristicPolynomial(Minv));
+      std::sort(eigenvalues.begin(), eigenvalues.end(),
+                [] (cplx a, cplx b) { return std::fabs(a.imag()) < std::fabs(b.imag()); });
+      gamma = eigenvalues[0].real();
+
+      auto eigenvector = [&] (cplx lam, std::vector<cplx> & v)
+      {
+        ComplexShiftedLU ilu;
+        ilu.Factor(lam * (1+1e-10), Minv);
+        v.assign(s, 1.0);
+        for (int it = 0; it < 3; it++)
+          {
+            ilu.Solve(v.data());
+            size_t imax = 0;
+            for (size_t i = 1; i < s; i++)
+              if (std::abs(v[i]) > std::abs(v[imax])) imax = i;
+            cplx scal = v[imax];
+            for (auto & vi : v) vi /= scal;
+          }
+      };
+
+      std::vector<cplx> v;
+      eigenvector(gamma, v);
+      for (size_t i = 0; i < s; i++)
+        T(i,0) = v[i].real();
+      for (size_t p = 0, k = 1; p < npairs; p++, k += 2)
+        {
+          cplx lam = eigenvalues[k];
+          if (lam.imag() < 0) lam = std::conj(lam);
+          alpha.push_back(lam.real());
+          beta.push_back(lam.imag());
+          eigenvector(lam, v);
+          for (size_t i = 0; i < s; i++)
+            {
+              T(i,2*p+1) = v[i].real();
+              T(i,2*p+2) = v[i].imag();
+            }
+        }
+
+      lu.Factor(T);
+      for (size_t j = 0; j < s; j++)
+        {
+          col = 0.0;
+          col(j) = 1;
+          lu.Solve(col);
+          for (size_t i = 0; i < s; i++)
+            Tinv(i,j) = col(i);
+        }
+
+      // embedded method of order s with weight 1/gamma on f(y0):
+      // yhat - y = h/gamma f0 + sum e_i Z_i,  e = -1/gamma A^{-T} d,
+      // sum_i d_i c_i^k = delta_k0.  dd = gamma e
+      Matrix<double, ColMajor> V(s, s);
+      for (size_t i = 0; i < s; i++)
+        {
+          double pw = 1;
+          for (size_t k = 0; k < s; k++, pw *= c(i))
+            V(k,i) = pw;
+        }
+      Vector<double> d(s);
+      d = 0.0;
+      d(0) = 1;
+      lu.Factor(V);
+      lu.Solve(d);
+      for (size_t j = 0; j < s; j++)
+        {
+          dd(j) = 0;
+          for (size_t i = 0; i < s; i++)
+            dd(j) -= d(i) * Minv(i,j);
+        }
+    }
+
+    void EvaluateJacobian ()
+    {
+      rhs->EvaluateDeriv(y, jac);
+      stats.jacobian_evaluations++;
+      jac_valid = jac_current = true;
+      factored = false;
+    }
+
+    void Factor (double dt)
+    {
+      for (size_t j = 0; j < n; j++)
+        for (size_t i = 0; i < n; i++)
+          mreal(i,j) = -jac(i,j);
+      for (size_t i = 0; i < n; i++)
+        mreal(i,i) += gamma/dt;
+      lureal.Factor(mreal);
+      for (size_t p = 0; p < npairs; p++)
+        lucomplex[p].Factor(std::complex<double>(alpha[p], -beta[p]) / dt, jac);
+      factored = true;
+      h_factored = dt;
+      stats.factorizations++;
+    }
+
+    // out += sum_j Z_j L_j(theta), with the Lagrange basis on 0, c_1 ... c_s
+    void AddCollocation (double theta, VectorView<double> out) const
+    {
+      for (size_t j = 0; j < s; j++)
+        {
+          double lj = theta / c(j);
+          for (size_t m = 0; m < s; m++)
+            if (m != j)
+              lj *= (theta-c(m)) / (c(j)-c(m));
+          for (size_t l = 0; l < n; l++)
+            out(l) += lj * zold(j*n+l);
+        }
+    }
+
+    // initial guess for Z from the collocation polynomial of the last step
+    void Predict (double dt)
+    {
+      if (!has_previous)
+        {
+          z = 0.0;
+          return;
+        }
+      for (size_t i = 0; i < s; i++)
+        {
+          auto zi = z.Range(i*n, (i+1)*n);
+          for (size_t l = 0; l < n; l++)
+            zi(l) = -zold((s-1)*n+l);
+          AddCollocation(1 + c(i)*dt/hold, zi);
+        }
+    }
+
+    double ScaledNorm (VectorView<double> v, VectorView<double> yref) const
+    {
+      double sum = 0;
+      size_t m = v.Size() / n;
+      for (size_t i = 0; i < m; i++)
+        for (size_t l = 0; l < n; l++)
+          {
+            double sc = opts.atol + opts.rtol * std::fabs(yref(l));
+            double vi = v(i*n+l) / sc;
+            sum += vi*vi;
+          }
+      return std::sqrt(sum / v.Size());
+    }
+
+    // simplified Newton for the transformed stage equations,
+    // its counts the iterations. false if it diverges or is too slow
+    bool SolveStages (double dt, int & its)
+    {
+      if (!factored || dt != h_factored)
+        Factor(dt);
+
+      double fnewt = std::max(10*std::numeric_limits<double>::epsilon()/opts.rtol,
+                              std::min(0.03, std::sqrt(opts.rtol)));
+      double fc = std::pow(std::max(faccon, std::numeric_limits<double>::epsilon()), 0.8);
+      double dynold = 0, thqold = 0;
+
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+
+      // W = (T^{-1} x I) Z
+      for (size_t i = 0; i < s; i++)
+        for (size_t l = 0; l < n; l++)
+          {
+            double sum = 0;
+            for (size_t j = 0; j < s; j++)
+              sum += Tinv(i,j) * z(j*n+l);
+            w(i*n+l) = sum;
+          }
+
+      for (int k = 0; k < max_newton; k++)
+        {
+          for (size_t i = 0; i < s; i++)
+            {
+              for (size_t l = 0; l < n; l++)
+                yi(l) = y(l) + z(i*n+l);
+              rhs->Evaluate(yi, f.Range(i*n, (i+1)*n));
+              stats.rhs_evaluations++;
+            }
+
+          // dW = (T^{-1} x I) F - 1/dt (Lambda x I) W
+          for (size_t i = 0; i < s; i++)
+            for (size_t l = 0; l < n; l++)
+              {
+                double sum = 0;
+                for (size_t j = 0; j < s; j++)
+                  sum += Tinv(i,j) * f(j*n+l);
+                dw(i*n+l) = sum;
+              }
+          for (size_t l = 0; l < n; l++)
+            dw(l) -= gamma/dt * w(l);
+          for (size_t p = 0; p < npairs; p++)
+            {
+              size_t a = (2*p+1)*n, b = (2*p+2)*n;
+              for (size_t l = 0; l < n; l++)
+                {
+                  double wa = w(a+l), wb = w(b+l);
+                  dw(a+l) -= (alpha[p]*wa + beta[p]*wb) / dt;
+                  dw(b+l) -= (-beta[p]*wa + alpha[p]*wb) / dt;
+                }
+            }
+
+          lureal.Solve(dw.Range(0, n));
+          for (size_t p = 0; p < npairs; p++)
+            lucomplex[p].Solve(dw.Range((2*p+1)*n, (2*p+2)*n), dw.Range((2*p+2)*n, (2*p+3)*n));
+          its++;
+          stats.newton_iterations++;
+
+          double dyno = ScaledNorm(dw, y);
+          if (k > 0)
+            {
+              double thq = dyno / dynold;
+              theta = (k == 1) ? thq : std::sqrt(thq * thqold);
+              thqold = thq;
+              if (theta >= 0.99) return false;
+              fc = theta / (1-theta);
+              // expected error after the remaining iterations
+              if (fc * dyno * std::pow(theta, max_newton-1-k) / fnewt >= 1)
+                return false;
+            }
+          dynold = std::max(dyno, std::numeric_limits<double>::epsilon());
+
+          for (size_t i = 0; i < s*n; i++)
+            w(i) += dw(i);
+          // Z = (T x I) W
+          for (size_t i = 0; i < s; i++)
+            for (size_t l = 0; l < n; l++)
+              {
+                double sum = 0;
+                for (size_t j = 0; j < s; j++)
+                  sum += T(i,j) * w(j*n+l);
+                z(i*n+l) = sum;
+              }
+
+          if (fc * dyno <= fnewt)
+            {
+              faccon = fc;
+              return true;
+            }
+        }
+      return false;
+    }
+
+    // (gamma/dt I - J)^{-1} (f0 + 1/dt sum dd_i Z_i), in the scaled norm
+    double ErrorEstimate (double dt, bool refine)
+    {
+      WorkspaceScope ws;
+      auto sum = ws.Vec(n);
+      auto yi = ws.Vec(n);
+      if (!f0_valid)
+        {
+          rhs->Evaluate(y, f0);
+          stats.rhs_evaluations++;
+          f0_valid = true;
+        }
+      for (size_t l = 0; l < n; l++)
+        {
+          sum(l) = 0;
+          for (size_t i = 0; i < s; i++)
+            sum(l) += dd(i) * z(i*n+l);
+          sum(l) /= dt;
+          err(l) = f0(l) + sum(l);
+        }
+      lureal.Solve(err);
+
+      for (size_t l = 0; l < n; l++)
+        yi(l) = std::max(std::fabs(y(l)), std::fabs(y(l)+z((s-1)*n+l)));
+      double errnorm = ScaledNorm(err, yi);
+
+      // first or rejected step: one more solve damps stiff components
+      if (errnorm >= 1 && refine)
+        {
+          for (size_t l = 0; l < n; l++)
+            yi(l) = y(l) + err(l);
+          rhs->Evaluate(yi, err);
+          stats.rhs_evaluations++;
+          for (size_t l = 0; l < n; l++)
+            err(l) += sum(l);
+          lureal.Solve(err);
+          for (size_t l = 0; l < n; l++)
+            yi(l) = std::max(std::fabs(y(l)), std::fabs(y(l)+z((s-1)*n+l)));
+          errnorm = ScaledNorm(err, yi);
+        }
+      return errnorm;
+    }
+
+    void Accept (double dt)
+    {
+      yold = y;
+      zold = z;
+      told = t;
+      hold = dt;
+      has_previous = true;
+      // stiffly accurate: the new value is the last stage
+      for (size_t l = 0; l < n; l++)
+        y(l) += z((s-1)*n+l);
+      f0_valid = false;
+      jac_current = false;
+    }
+  };
+
+}
+
+#endif
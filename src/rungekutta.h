@@ -0,0 +1,857 @@
+#ifndef RUNGEKUTTA_H
+#define RUNGEKUTTA_H
+
+#include <cmath>
+#include <limits>
+
+#include "timestepper.h"
+
+
+namespace ASC_ode
+{
+
+  // Butcher tableau (A, b, c), optionally with embedded weights bhat
+  // of lower order for error estimation
+  struct ButcherTableau
+  {
+    Matrix<double, ColMajor> A;
+    Vector<double> b, c;
+    Vector<double> bhat;        // size 0 if there is no embedded method
+    int order = 0, embedded_order = 0;
+    bool fsal = false;          // last stage is rhs(y_new), reused as first stage of the next step
+
+    ButcherTableau (size_t s, bool embedded)
+      : A(s, s), b(s), c(s), bhat(embedded ? s : 0)
+    {
+      A = 0.0;
+      b = 0.0;
+      c = 0.0;
+      if (embedded) bhat = 0.0;
+    }
+
+    size_t Stages() const { return b.Size(); }
+    bool HasEmbedded() const { return bhat.Size() == b.Size(); }
+
+    // c_i = sum_j a_ij
+    void SetC()
+    {
+      for (size_t i = 0; i < Stages(); i++)
+        {
+          c(i) = 0;
+          for (size_t j = 0; j < Stages(); j++)
+            c(i) += A(i,j);
+        }
+    }
+
+    bool IsExplicit() const { return IsExplicitTableau(A); }
+    bool IsDiagonallyImplicit() const { return IsDiagonallyImplicitTableau(A); }
+
+    // diagonally implicit with the same a_ii = gamma for all implicit stages,
+    // a_00 = 0 is allowed (ESDIRK)
+    bool IsSinglyDiagonallyImplicit() const
+    {
+      if (!IsDiagonallyImplicit() || IsExplicit()) return false;
+      for (size_t i = 0; i < Stages(); i++)
+        if (A(i,i) != 0.0 && A(i,i) != Gamma()) return false;
+      return A(0,0) == 0.0 || A(0,0) == Gamma();
+    }
+    double Gamma() const { return A(Stages()-1, Stages()-1); }
+  };
+
+
+  // Dormand-Prince 5(4), FSAL
+  inline ButcherTableau DormandPrince54()
+  {
+    ButcherTableau tab(7, true);
+    auto & A = tab.A;
+    A(1,0) = 1./5;
+    A(2,0) = 3./40;       A(2,1) = 9./40;
+    A(3,0) = 44./45;      A(3,1) = -56./15;      A(3,2) = 32./9;
+    A(4,0) = 19372./6561; A(4,1) = -25360./2187; A(4,2) = 64448./6561; A(4,3) = -212./729;
+    A(5,0) = 9017./3168;  A(5,1) = -355./33;     A(5,2) = 46732./5247; A(5,3) = 49./176;
+    A(5,4) = -5103./18656;
+    A(6,0) = 35./384;     A(6,2) = 500./1113;    A(6,3) = 125./192;    A(6,4) = -2187./6784;
+    A(6,5) = 11./84;
+    for (size_t j = 0; j < 7; j++)
+      tab.b(j) = A(6,j);
+    double bhat[] = { 5179./57600, 0, 7571./16695, 393./640, -92097./339200, 187./2100, 1./40 };
+    for (size_t j = 0; j < 7; j++)
+      tab.bhat(j) = bhat[j];
+    tab.SetC();
+    tab.order = 5;
+    tab.embedded_order = 4;
+    tab.fsal = true;
+    return tab;
+  }
+
+  // Bogacki-Shampine 3(2), FSAL
+  inline ButcherTableau BogackiShampine32()
+  {
+    ButcherTableau tab(4, true);
+    auto & A = tab.A;
+    A(1,0) = 1./2;
+    A(2,1) = 3./4;
+    A(3,0) = 2./9;  A(3,1) = 1./3;  A(3,2) = 4./9;
+    double b[] = { 2./9, 1./3, 4./9, 0 };
+    double bhat[] = { 7./24, 1./4, 1./3, 1./8 };
+    for (size_t j = 0; j < 4; j++)
+      {
+        tab.b(j) = b[j];
+        tab.bhat(j) = bhat[j];
+      }
+    tab.SetC();
+    tab.order = 3;
+    tab.embedded_order = 2;
+    tab.fsal = true;
+    return tab;
+  }
+
+  // two stage L-stable SDIRK of order 2 (Alexander), gamma = 1-1/sqrt(2),
+  // embedded first order weights (1, 0)
+  inline ButcherTableau SDIRK21()
+  {
+    ButcherTableau tab(2, true);
+    double gamma = 1-1/std::sqrt(2.0);
+    tab.A(0,0) = gamma;
+    tab.A(1,0) = 1-gamma;
+    tab.A(1,1) = gamma;
+    tab.b(0) = 1-gamma;
+    tab.b(1) = gamma;
+    tab.bhat(0) = 1;
+    tab.bhat(1) = 0;
+    tab.SetC();
+    tab.order = 2;
+    tab.embedded_order = 1;
+    return tab;
+  }
+
+
+
+  // three stage L-stable SDIRK of order 3 (Alexander), stiffly accurate
+  inline ButcherTableau SDIRK3()
+  {
+    ButcherTableau tab(3, false);
+    double gamma = 0.435866521508458999416019;
+    double tau = (1+gamma)/2;
+    double b1 = -(6*gamma*gamma-16*gamma+1)/4;
+    double b2 = (6*gamma*gamma-20*gamma+5)/4;
+    tab.A(0,0) = gamma;
+    tab.A(1,0) = tau-gamma; tab.A(1,1) = gamma;
+    tab.A(2,0) = b1;        tab.A(2,1) = b2;     tab.A(2,2) = gamma;
+    tab.b(0) = b1;
+    tab.b(1) = b2;
+    tab.b(2) = gamma;
+    tab.SetC();
+    tab.order = 3;
+    return tab;
+  }
+
+  // TR-BDF2 as ESDIRK: trapezoidal rule to t+2 gamma dt, BDF2 to t+dt.
+  // Embedded weights of order 3 (Hosea, Shampine), last stage is rhs(y_new)
+  inline ButcherTableau TRBDF2()
+  {
+    ButcherTableau tab(3, true);
+    double gamma = 1-std::sqrt(2.0)/2;
+    double w = std::sqrt(2.0)/4;
+    tab.A(1,0) = gamma; tab.A(1,1) = gamma;
+    tab.A(2,0) = w;     tab.A(2,1) = w;      tab.A(2,2) = gamma;
+    tab.b(0) = w;
+    tab.b(1) = w;
+    tab.b(2) = gamma;
+    tab.bhat(0) = (1-w)/3;
+    tab.bhat(1) = (3*w+1)/3;
+    tab.bhat(2) = gamma/3;
+    tab.SetC();
+    tab.order = 2;
+    tab.embedded_order = 3;
+    tab.fsal = true;
+    return tab;
+  }
+
+
+
+  // the stage equations  k_i - rhs(y0 + dt sum_j a_ij k_j) = 0  of an implicit
+  // Runge-Kutta method. y0 and dt are parameters, so the same function
+  // serves all steps, also with changing step size
+  class RKStageFunction : public NonlinearFunction
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    Matrix<double, ColMajor> A;
+    size_t s, n;
+    Vector<double> y0;
+    double dt = 0;
+    mutable std::unique_ptr<SparseMatrix> sparse_jac;
+  public:
+    mutable size_t num_rhs_evaluations = 0;
+    mutable size_t num_jacobian_evaluations = 0;
+
+    RKStageFunction (std::shared_ptr<NonlinearFunction> _rhs, const Matrix<double, ColMajor> & _A)
+      : rhs(_rhs), A(_A), s(_A.Height()), n(_rhs->DimX()), y0(n) { }
+
+    void SetStep (VectorView<double> _y0, double _dt)
+    {
+      y0 = _y0;
+      dt = _dt;
+    }
+    double StepSize() const { return dt; }
+
+    size_t DimX() const override { return n*s; }
+    size_t DimF() const override { return n*s; }
+
+    // y_i = y0 + dt sum_j a_ij k_j
+    void StageValue (size_t i, VectorView<double> k, VectorView<double> yi) const
+    {
+      for (size_t l = 0; l < n; l++)
+        yi(l) = y0(l);
+      for (size_t j = 0; j < s; j++)
+        if (A(i,j) != 0.0)
+          for (size_t l = 0; l < n; l++)
+            yi(l) += dt * A(i,j) * k(j*n+l);
+    }
+
+    void Evaluate (VectorView<double> k, VectorView<double> f) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t i = 0; i < s; i++)
+        {
+          StageValue(i, k, yi);
+          auto fi = f.Range(i*n, (i+1)*n);
+          rhs->Evaluate(yi, fi);
+          num_rhs_evaluations++;
+          for (size_t l = 0; l < n; l++)
+            fi(l) = k(i*n+l) - fi(l);
+        }
+    }
+
+    void EvaluateDeriv (VectorView<double> k, MatrixView<double, ColMajor> df) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      auto jac = ws.Mat(n, n);
+      df = 0.0;
+      for (size_t i = 0; i < s; i++)
+        {
+          StageValue(i, k, yi);
+          rhs->EvaluateDeriv(yi, jac);
+          num_jacobian_evaluations++;
+          AddStageDeriv(i, jac, df);
+        }
+    }
+
+    void EvaluateWithDeriv (VectorView<double> k, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      auto jac = ws.Mat(n, n);
+      df = 0.0;
+      for (size_t i = 0; i < s; i++)
+        {
+          StageValue(i, k, yi);
+          auto fi = f.Range(i*n, (i+1)*n);
+          rhs->EvaluateWithDeriv(yi, fi, jac);
+          num_rhs_evaluations++;
+          num_jacobian_evaluations++;
+          for (size_t l = 0; l < n; l++)
+            fi(l) = k(i*n+l) - fi(l);
+          AddStageDeriv(i, jac, df);
+        }
+    }
+
+    // identity plus one block of the rhs pattern for every a_ij != 0
+    SparsityPattern DerivPattern () const override
+    {
+      auto pat = rhs->DerivPattern();
+      SparsityPattern pattern(n*s, n*s);
+      pattern.AddDiag(0, n*s);
+      for (size_t i = 0; i < s; i++)
+        for (size_t j = 0; j < s; j++)
+          if (A(i,j) != 0.0)
+            pattern.Add(pat, i*n, j*n);
+      return pattern;
+    }
+
+    void EvaluateSparseDeriv (VectorView<double> k, SparseMatrix & df) const override
+    {
+      if (!sparse_jac)
+        sparse_jac = std::make_unique<SparseMatrix>(rhs->DerivPattern());
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      df = 0.0;
+      for (size_t i = 0; i < s; i++)
+        {
+          StageValue(i, k, yi);
+          rhs->EvaluateSparseDeriv(yi, *sparse_jac);
+          num_jacobian_evaluations++;
+          for (size_t j = 0; j < s; j++)
+            if (A(i,j) != 0.0)
+              df.Add(-dt*A(i,j), *sparse_jac, i*n, j*n);
+        }
+      for (size_t l = 0; l < n*s; l++)
+        df(l,l) += 1.0;
+    }
+
+    // (Jv)_i = v_i - dt J(y_i) sum_j a_ij v_j
+    void ApplyDeriv (VectorView<double> k, VectorView<double> v, VectorView<double> jv) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      auto vi = ws.Vec(n);
+      for (size_t i = 0; i < s; i++)
+        {
+          StageValue(i, k, yi);
+          vi = 0.0;
+          for (size_t j = 0; j < s; j++)
+            if (A(i,j) != 0.0)
+              LinComb(1.0, vi, A(i,j), v.Range(j*n, (j+1)*n));
+          auto jvi = jv.Range(i*n, (i+1)*n);
+          rhs->ApplyDeriv(yi, vi, jvi);
+          LinComb(-dt, jvi, 1.0, v.Range(i*n, (i+1)*n));
+        }
+    }
+
+  private:
+    // block row i:  delta_ij I - dt a_ij J(y_i)
+    void AddStageDeriv (size_t i, MatrixView<double, ColMajor> jac, MatrixView<double, ColMajor> df) const
+    {
+      for (size_t j = 0; j < s; j++)
+        if (A(i,j) != 0.0)
+          for (size_t c = 0; c < n; c++)
+            for (size_t r = 0; r < n; r++)
+              df(i*n+r, j*n+c) -= dt*A(i,j) * jac(r,c);
+      for (size_t l = 0; l < n; l++)
+        df(i*n+l, i*n+l) += 1.0;
+    }
+  };
+
+
+
+  // one stage of a diagonally implicit method:  k - rhs(ybase + h k) = 0
+  // with h = dt a_ii. ybase and h are parameters
+  class DIRKStageFunction : public NonlinearFunction
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    size_t n;
+    Vector<double> ybase;
+    double h = 0;
+    mutable std::unique_ptr<SparseMatrix> sparse_jac;
+  public:
+    mutable size_t num_rhs_evaluations = 0;
+    mutable size_t num_jacobian_evaluations = 0;
+
+    DIRKStageFunction (std::shared_ptr<NonlinearFunction> _rhs)
+      : rhs(_rhs), n(_rhs->DimX()), ybase(n) { }
+
+    void SetBase (VectorView<double> _ybase) { ybase = _ybase; }
+    void SetH (double _h) { h = _h; }
+
+    size_t DimX() const override { return n; }
+    size_t DimF() const override { return n; }
+
+    void Evaluate (VectorView<double> k, VectorView<double> f) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t l = 0; l < n; l++)
+        yi(l) = ybase(l) + h * k(l);
+      rhs->Evaluate(yi, f);
+      num_rhs_evaluations++;
+      for (size_t l = 0; l < n; l++)
+        f(l) = k(l) - f(l);
+    }
+
+    void EvaluateDeriv (VectorView<double> k, MatrixView<double, ColMajor> df) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t l = 0; l < n; l++)
+        yi(l) = ybase(l) + h * k(l);
+      rhs->EvaluateDeriv(yi, df);
+      num_jacobian_evaluations++;
+      ShiftDeriv(df);
+    }
+
+    void EvaluateWithDeriv (VectorView<double> k, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t l = 0; l < n; l++)
+        yi(l) = ybase(l) + h * k(l);
+      rhs->EvaluateWithDeriv(yi, f, df);
+      num_rhs_evaluations++;
+      num_jacobian_evaluations++;
+      for (size_t l = 0; l < n; l++)
+        f(l) = k(l) - f(l);
+      ShiftDeriv(df);
+    }
+
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(n, n);
+      pattern.AddDiag(0, n);
+      pattern.Add(rhs->DerivPattern());
+      return pattern;
+    }
+
+    void EvaluateSparseDeriv (VectorView<double> k, SparseMatrix & df) const override
+    {
+      if (!sparse_jac)
+        sparse_jac = std::make_unique<SparseMatrix>(rhs->DerivPattern());
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t l = 0; l < n; l++)
+        yi(l) = ybase(l) + h * k(l);
+      rhs->EvaluateSparseDeriv(yi, *sparse_jac);
+      num_jacobian_evaluations++;
+      df = 0.0;
+      df.Add(-h, *sparse_jac);
+      for (size_t l = 0; l < n; l++)
+        df(l,l) += 1.0;
+    }
+
+    // v - h J(ybase + h k) v
+    void ApplyDeriv (VectorView<double> k, VectorView<double> v, VectorView<double> jv) const override
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t l = 0; l < n; l++)
+        yi(l) = ybase(l) + h * k(l);
+      rhs->ApplyDeriv(yi, v, jv);
+      LinComb(-h, jv, 1.0, v);
+    }
+
+  private:
+    // df = I - h J
+    void ShiftDeriv (MatrixView<double, ColMajor> df) const
+    {
+      for (size_t c = 0; c < n; c++)
+        for (size_t r = 0; r < n; r++)
+          df(r,c) *= -h;
+      for (size_t l = 0; l < n; l++)
+        df(l,l) += 1.0;
+    }
+  };
+
+
+  // Stage solver of singly diagonally implicit methods: the stages are
+  // computed one after the other, every implicit stage is an n x n Newton
+  // problem with the matrix I - dt gamma J. With simplified Newton one
+  // factorization serves all stages and, while it converges well, several
+  // steps. It is kept as long as dt gamma changes by less than 20 percent.
+  class SDIRKStages
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    Matrix<double, ColMajor> A;
+    size_t s, n;
+    double gamma;
+    std::shared_ptr<DIRKStageFunction> func;
+    Vector<double> ystage;
+    double h_factored = 0;
+    size_t num_rhs_evaluations = 0;
+  public:
+    SDIRKStages (std::shared_ptr<NonlinearFunction> _rhs, const ButcherTableau & tab)
+      : rhs(_rhs), A(tab.A), s(tab.Stages()), n(_rhs->DimX()), gamma(tab.Gamma()),
+        func(std::make_shared<DIRKStageFunction>(_rhs)), ystage(n)
+    {
+      if (!tab.IsSinglyDiagonallyImplicit())
+        throw std::invalid_argument("SDIRKStages: tableau is not singly diagonally implicit");
+    }
+
+    size_t NumRhsEvaluations() const { return num_rhs_evaluations + func->num_rhs_evaluations; }
+    size_t NumJacobianEvaluations() const { return func->num_jacobian_evaluations; }
+
+    // the stages k for the step y -> y + dt sum b_i k_i. If k0_valid, the
+    // first stage of an ESDIRK already holds rhs(y).
+    // Throws std::domain_error if Newton fails.
+    void Solve (VectorView<double> y, double dt, VectorView<double> k, bool k0_valid,
+                const NewtonOptions & opts, NewtonState & state)
+    {
+      double h = dt*gamma;
+      func->SetH(h);
+      if (std::fabs(h-h_factored) > 0.2*h)
+        {
+          state.Reset();
+          h_factored = h;
+        }
+      size_t nfact = state.num_factorizations;
+
+      for (size_t i = 0; i < s; i++)
+        {
+          auto ki = k.Range(i*n, (i+1)*n);
+          // ystage = y + dt sum_{j<i} a_ij k_j
+          for (size_t l = 0; l < n; l++)
+            ystage(l) = y(l);
+          for (size_t j = 0; j < i; j++)
+            if (A(i,j) != 0.0)
+              for (size_t l = 0; l < n; l++)
+                ystage(l) += dt * A(i,j) * k(j*n+l);
+
+          if (A(i,i) == 0.0)
+            {
+              if (i == 0 && k0_valid) continue;
+              rhs->Evaluate(ystage, ki);
+              num_rhs_evaluations++;
+              continue;
+            }
+
+          // initial guess: the previous stage, or rhs(y)
+          if (i == 0)
+            {
+              rhs->Evaluate(y, ki);
+              num_rhs_evaluations++;
+            }
+          else
+            for (size_t l = 0; l < n; l++)
+              ki(l) = k((i-1)*n+l);
+
+          func->SetBase(ystage);
+          NewtonSolver(func, ki, opts, state);
+        }
+
+      if (state.num_factorizations != nfact)
+        h_factored = h;
+    }
+  };
+
+
+
+  struct AdaptiveOptions
+  {
+    double rtol = 1e-6;
+    double atol = 1e-8;
+    double dt_init = 0;         // 0: estimated from the initial slope
+    double dt_min = 1e-14;
+    double dt_max = 0;          // 0: no limit
+    double safety = 0.9;
+    double facmin = 0.2;        // bounds for the step size ratio
+    double facmax = 5.0;
+  };
+
+  struct StepStatistics
+  {
+    size_t accepted = 0;
+    size_t rejected = 0;
+    size_t rhs_evaluations = 0;
+    size_t jacobian_evaluations = 0;
+    size_t factorizations = 0;
+    size_t newton_iterations = 0;
+  };
+
+  inline std::ostream & operator<< (std::ostream & ost, const StepStatistics & stat)
+  {
+    ost << "accepted = " << stat.accepted << ", rejected = " << stat.rejected
+        << ", rhs evaluations = " << stat.rhs_evaluations
+        << ", jacobians = " << stat.jacobian_evaluations
+        << ", factorizations = " << stat.factorizations
+        << ", newton iterations = " << stat.newton_iterations;
+    return ost;
+  }
+
+
+
+  // h0 = 0.01 |y| / |rhs(y)| in the scaled norm, as in Hairer-Norsett-Wanner
+  inline double InitialStepSize (const NonlinearFunction & rhs, VectorView<double> y,
+                                 const AdaptiveOptions & opts)
+  {
+    size_t n = y.Size();
+    WorkspaceScope ws;
+    auto f = ws.Vec(n);
+    rhs.Evaluate(y, f);
+    double d0 = 0, d1 = 0;
+    for (size_t l = 0; l < n; l++)
+      {
+        double sc = opts.atol + opts.rtol * std::fabs(y(l));
+        d0 += (y(l)/sc) * (y(l)/sc);
+        d1 += (f(l)/sc) * (f(l)/sc);
+      }
+    d0 = std::sqrt(d0/n);
+    d1 = std::sqrt(d1/n);
+    double h0 = (d0 < 1e-5 || d1 < 1e-5) ? 1e-6 : 0.01 * d0/d1;
+    if (opts.dt_max > 0) h0 = std::min(h0, opts.dt_max);
+    return h0;
+  }
+
+
+
+  // Runge-Kutta with an embedded pair and PI step size control.
+  // Explicit tableaux evaluate the stages one after the other, singly
+  // diagonally implicit ones solve them one after the other with Newton,
+  // other implicit ones solve the coupled stage equations.
+  // Step(dt) makes one step without control, Advance(tend) controls the step size.
+  class AdaptiveRungeKutta : public TimeStepper
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    ButcherTableau tab;
+    AdaptiveOptions opts;
+    size_t s, n;
+    bool explicit_tab;
+    Vector<double> y, ynew, k;
+    std::unique_ptr<SDIRKStages> sdirk;          // singly diagonally implicit tableaux
+    std::shared_ptr<RKStageFunction> stages;     // other implicit tableaux
+    bool k0_valid = false;      // first stage holds rhs(y)
+    double h = 0;               // proposed next step size
+    double err_old = 1.0;
+    StepStatistics stats;
+
+  protected:
+    void Build (double dt) override { }
+    void DoStep (double dt) override
+    {
+      // Newton failed or the stages blew up
+      if (!std::isfinite(AttemptStep(dt)))
+        throw std::domain_error("AdaptiveRungeKutta: step failed");
+      Accept();
+    }
+
+  public:
+    AdaptiveRungeKutta (std::shared_ptr<NonlinearFunction> _rhs, const ButcherTableau & _tab,
+                        const AdaptiveOptions & _opts = AdaptiveOptions(),
+                        const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), tab(_tab), opts(_opts),
+        s(_tab.Stages()), n(_rhs->DimX()), explicit_tab(_tab.IsExplicit()),
+        y(n), ynew(n), k(n*s)
+    {
+      if (!tab.HasEmbedded())
+        throw std::invalid_argument("AdaptiveRungeKutta: tableau without embedded weights");
+      if (tab.IsSinglyDiagonallyImplicit())
+        sdirk = std::make_unique<SDIRKStages>(rhs, tab);
+      else if (!explicit_tab)
+        stages = std::make_shared<RKStageFunction>(rhs, tab.A);
+    }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      k0_valid = false;
+      h = opts.dt_init;
+      err_old = 1.0;
+      Restart(t0);
+    }
+
+    VectorView<double> Solution() override { return y; }
+    const StepStatistics & Statistics() const { return stats; }
+    double ProposedStepSize() const { return h; }
+
+    void Advance (double tend, std::function<void(double,VectorView<double>)> callback = nullptr) override
+    {
+      if (h <= 0) h = InitialStepSize();
+      double expo = 1.0 / (std::min(tab.order, tab.embedded_order) + 1);
+      bool last_rejected = false;
+
+      while (t < tend)
+        {
+          double dt = std::min(h, tend-t);
+          bool last = (dt == tend-t);
+
+          double err = AttemptStep(dt);
+          if (err <= 1.0)
+            {
+              Accept();
+              t = last ? tend : t+dt;
+              stats.accepted++;
+
+              // PI controller
+              err = std::max(err, 1e-10);
+              double fac = opts.safety * std::pow(err, -0.7*expo) * std::pow(err_old, 0.4*expo);
+              fac = std::min(last_rejected ? 1.0 : opts.facmax, std::max(opts.facmin, fac));
+              if (!last || dt == h)
+                h = dt * fac;
+              err_old = std::max(err, 1e-4);
+              last_rejected = false;
+              if (callback) callback(t, y);
+            }
+          else
+            {
+              stats.rejected++;
+              double fac = std::isfinite(err) ? opts.safety * std::pow(err, -expo) : opts.facmin;
+              h = dt * std::max(opts.facmin, fac);
+              last_rejected = true;
+              if (h < opts.dt_min)
+                throw std::domain_error("AdaptiveRungeKutta: step size too small");
+            }
+          if (opts.dt_max > 0)
+            h = std::min(h, opts.dt_max);
+        }
+    }
+
+    // one step of size dt from y into ynew, returns the scaled error estimate,
+    // infinity if Newton fails
+    double AttemptStep (double dt)
+    {
+      if (explicit_tab)
+        ExplicitStages(dt);
+      else if (sdirk ? !SDIRKStep(dt) : !ImplicitStages(dt))
+        return std::numeric_limits<double>::infinity();
+
+      double sum = 0;
+      for (size_t l = 0; l < n; l++)
+        {
+          double incr = 0, err = 0;
+          for (size_t i = 0; i < s; i++)
+            {
+              incr += tab.b(i) * k(i*n+l);
+              err += (tab.b(i)-tab.bhat(i)) * k(i*n+l);
+            }
+          ynew(l) = y(l) + dt * incr;
+          double sc = opts.atol + opts.rtol * std::max(std::fabs(y(l)), std::fabs(ynew(l)));
+          sum += (dt*err/sc) * (dt*err/sc);
+        }
+      return std::sqrt(sum / n);
+    }
+
+  private:
+    void Accept ()
+    {
+      y = ynew;
+      // with FSAL the last stage is rhs(ynew)
+      if (tab.fsal && tab.A(0,0) == 0.0)
+        {
+          for (size_t l = 0; l < n; l++)
+            k(l) = k((s-1)*n+l);
+          k0_valid = true;
+        }
+      else
+        k0_valid = false;
+    }
+
+    void ExplicitStages (double dt)
+    {
+      WorkspaceScope ws;
+      auto yi = ws.Vec(n);
+      for (size_t i = 0; i < s; i++)
+        {
+          if (i == 0 && k0_valid) continue;
+          for (size_t l = 0; l < n; l++)
+            yi(l) = y(l);
+          for (size_t j = 0; j < i; j++)
+            if (tab.A(i,j) != 0.0)
+              for (size_t l = 0; l < n; l++)
+                yi(l) += dt * tab.A(i,j) * k(j*n+l);
+          rhs->Evaluate(yi, k.Range(i*n, (i+1)*n));
+          stats.rhs_evaluations++;
+        }
+      // y is unchanged if the step gets rejected
+      k0_valid = true;
+    }
+
+    bool SDIRKStep (double dt)
+    {
+      size_t nrhs = sdirk->NumRhsEvaluations();
+      size_t njac = sdirk->NumJacobianEvaluations();
+      size_t nit = newton_state.num_iterations;
+      size_t nfact = newton_state.num_factorizations;
+      bool converged = true;
+      try
+        {
+          sdirk->Solve(y, dt, k, k0_valid, newton, newton_state);
+          // y is unchanged if the step gets rejected
+          k0_valid = (tab.A(0,0) == 0.0);
+        }
+      catch (std::domain_error &)
+        {
+          converged = false;
+          newton_state.Reset();
+        }
+      stats.rhs_evaluations += sdirk->NumRhsEvaluations() - nrhs;
+      stats.jacobian_evaluations += sdirk->NumJacobianEvaluations() - njac;
+      stats.newton_iterations += newton_state.num_iterations - nit;
+      stats.factorizations += newton_state.num_factorizations - nfact;
+      return converged;
+    }
+
+    bool ImplicitStages (double dt)
+    {
+      if (dt != stages->StepSize())
+        newton_state.Reset();
+      stages->SetStep(y, dt);
+      // initial guess: all stages rhs(y)
+      rhs->Evaluate(y, k.Range(0, n));
+      stats.rhs_evaluations++;
+      for (size_t i = 1; i < s; i++)
+        for (size_t l = 0; l < n; l++)
+          k(i*n+l) = k(l);
+
+      size_t nrhs = stages->num_rhs_evaluations;
+      size_t njac = stages->num_jacobian_evaluations;
+      size_t nit = newton_state.num_iterations;
+      size_t nfact = newton_state.num_factorizations;
+      bool converged = true;
+      try
+        {
+          NewtonSolver(stages, k, newton, newton_state);
+        }
+      catch (std::domain_error &)
+        {
+          converged = false;
+          newton_state.Reset();
+        }
+      stats.rhs_evaluations += stages->num_rhs_evaluations - nrhs;
+      stats.jacobian_evaluations += stages->num_jacobian_evaluations - njac;
+      stats.newton_iterations += newton_state.num_iterations - nit;
+      stats.factorizations += newton_state.num_factorizations - nfact;
+      return converged;
+    }
+
+    double InitialStepSize ()
+    {
+      stats.rhs_evaluations++;
+      return ASC_ode::InitialStepSize(*rhs, y, opts);
+    }
+  };
+
+
+
+  // singly diagonally implicit Runge-Kutta with fixed step size.
+  // Simplified Newton is always used, so the factored I - dt gamma J is
+  // shared by all stages and kept over steps while Newton converges well.
+  class SDIRK : public TimeStepper
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    ButcherTableau tab;
+    size_t s, n;
+    SDIRKStages stages;
+    Vector<double> y, k;
+    bool k0_valid = false;
+  protected:
+    void Build (double dt) override { }
+    void DoStep (double dt) override
+    {
+      stages.Solve(y, dt, k, k0_valid, newton, newton_state);
+      for (size_t l = 0; l < n; l++)
+        {
+          double incr = 0;
+          for (size_t i = 0; i < s; i++)
+            incr += tab.b(i) * k(i*n+l);
+          y(l) += dt * incr;
+        }
+      // FSAL: the last stage is rhs(y_new)
+      k0_valid = tab.fsal && tab.A(0,0) == 0.0;
+      if (k0_valid)
+        for (size_t l = 0; l < n; l++)
+          k(l) = k((s-1)*n+l);
+    }
+  public:
+    SDIRK (std::shared_ptr<NonlinearFunction> _rhs, const ButcherTableau & _tab = SDIRK3(),
+           const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), tab(_tab), s(_tab.Stages()), n(_rhs->DimX()),
+        stages(_rhs, _tab), y(n), k(n*s)
+    {
+      newton.simplified = true;
+    }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      k0_valid = false;
+      Restart(t0);
+    }
+    VectorView<double> Solution() override { return y; }
+    size_t NumRhsEvaluations() const { return stages.NumRhsEvaluations(); }
+    size_t NumJacobianEvaluations() const { return stages.NumJacobianEvaluations(); }
+  };
+
+}
+
+#endif
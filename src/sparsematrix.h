@@ -0,0 +1,294 @@
+#ifndef SPARSEMATRIX_H
+#define SPARSEMATRIX_H
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <atomic>
+
+#include <../ASC-bla/src/vector.h>
+#include <../ASC-bla/src/matrix.h>
+
+
+namespace ASC_ode
+{
+  using namespace ASC_bla;
+
+  // non-zero structure of a height x width matrix, as column indices per row
+  class SparsityPattern
+  {
+    size_t height, width;
+    std::vector<std::vector<size_t>> rows;
+  public:
+    SparsityPattern (size_t _height, size_t _width)
+      : height(_height), width(_width), rows(_height) { }
+
+    size_t Height() const { return height; }
+    size_t Width() const { return width; }
+    const std::vector<size_t> & Row (size_t i) const { return rows[i]; }
+
+    void Add (size_t i, size_t j) { rows[i].push_back(j); }
+
+    // entries (i,i) for first <= i < next
+    void AddDiag (size_t first, size_t next)
+    {
+      for (size_t i = first; i < next; i++)
+        rows[i].push_back(i);
+    }
+
+    void AddDense (size_t firstrow, size_t nextrow, size_t firstcol, size_t nextcol)
+    {
+      for (size_t i = firstrow; i < nextrow; i++)
+        for (size_t j = firstcol; j < nextcol; j++)
+          rows[i].push_back(j);
+    }
+
+    // add the entries of other, shifted by the given offsets
+    void Add (const SparsityPattern & other, size_t rowoffset = 0, size_t coloffset = 0)
+    {
+      for (size_t i = 0; i < other.Height(); i++)
+        for (size_t j : other.Row(i))
+          rows[i+rowoffset].push_back(j+coloffset);
+    }
+
+    // sort and remove duplicates
+    void Compress ()
+    {
+      for (auto & row : rows)
+        {
+          std::sort(row.begin(), row.end());
+          row.erase(std::unique(row.begin(), row.end()), row.end());
+        }
+    }
+
+    size_t NZE () const
+    {
+      size_t nze = 0;
+      for (auto & row : rows) nze += row.size();
+      return nze;
+    }
+  };
+
+
+  // pattern of the product a*b
+  inline SparsityPattern PatternProduct (const SparsityPattern & a, const SparsityPattern & b)
+  {
+    SparsityPattern prod(a.Height(), b.Width());
+    for (size_t i = 0; i < a.Height(); i++)
+      for (size_t k : a.Row(i))
+        for (size_t j : b.Row(k))
+          prod.Add(i, j);
+    prod.Compress();
+    return prod;
+  }
+
+
+
+  // compressed sparse row matrix with a pattern fixed at construction
+  class SparseMatrix
+  {
+    size_t height = 0, width = 0;
+    std::vector<size_t> firsti;   // entries of row i are firsti[i] <= k < firsti[i+1]
+    std::vector<size_t> colnr;    // sorted within every row
+    std::vector<double> values;
+    size_t pattern_id = 0;
+  public:
+    static constexpr size_t npos = size_t(-1);
+
+    SparseMatrix () = default;
+    SparseMatrix (SparsityPattern pattern)
+      : height(pattern.Height()), width(pattern.Width()), firsti(pattern.Height()+1)
+    {
+      static std::atomic<size_t> num_patterns{0};
+      pattern_id = ++num_patterns;
+      pattern.Compress();
+      firsti[0] = 0;
+      for (size_t i = 0; i < height; i++)
+        firsti[i+1] = firsti[i] + pattern.Row(i).size();
+      colnr.reserve(firsti[height]);
+      for (size_t i = 0; i < height; i++)
+        colnr.insert(colnr.end(), pattern.Row(i).begin(), pattern.Row(i).end());
+      values.assign(colnr.size(), 0.0);
+    }
+
+    size_t Height() const { return height; }
+    size_t Width() const { return width; }
+    size_t NZE() const { return colnr.size(); }
+    // new for every matrix set up from a pattern, copies keep it: value
+    // positions found with Position stay valid while the id is the same
+    size_t PatternId() const { return pattern_id; }
+
+    size_t First (size_t i) const { return firsti[i]; }
+    size_t Next (size_t i) const { return firsti[i+1]; }
+    size_t ColNr (size_t k) const { return colnr[k]; }
+    double & Value (size_t k) { return values[k]; }
+    double Value (size_t k) const { return values[k]; }
+
+    SparsityPattern Pattern () const
+    {
+      SparsityPattern pattern(height, width);
+      for (size_t i = 0; i < height; i++)
+        for (size_t k = firsti[i]; k < firsti[i+1]; k++)
+          pattern.Add(i, colnr[k]);
+      return pattern;
+    }
+
+    // index of entry (i,j) in the value array, npos if not in the pattern
+    size_t Position (size_t i, size_t j) const
+    {
+      auto first = colnr.begin()+firsti[i];
+      auto last = colnr.begin()+firsti[i+1];
+      auto pos = std::lower_bound(first, last, j);
+      if (pos == last || *pos != j) return npos;
+      return pos - colnr.begin();
+    }
+
+    double & operator() (size_t i, size_t j)
+    {
+      size_t pos = Position(i, j);
+      if (pos == npos)
+        throw std::out_of_range("SparseMatrix: entry not in sparsity pattern");
+      return values[pos];
+    }
+
+    double operator() (size_t i, size_t j) const
+    {
+      size_t pos = Position(i, j);
+      return (pos == npos) ? 0.0 : values[pos];
+    }
+
+    SparseMatrix & operator= (double val)
+    {
+      std::fill(values.begin(), values.end(), val);
+      return *this;
+    }
+
+    void Scale (double fac)
+    {
+      for (auto & v : values) v *= fac;
+    }
+
+    // this += fac * b, pattern of b must be contained in the pattern of this
+    void Add (double fac, const SparseMatrix & b, size_t rowoffset = 0, size_t coloffset = 0)
+    {
+      for (size_t i = 0; i < b.Height(); i++)
+        for (size_t k = b.First(i); k < b.Next(i); k++)
+          (*this)(i+rowoffset, b.ColNr(k)+coloffset) += fac * b.Value(k);
+    }
+
+    // A = diag(d) A
+    void ScaleRows (VectorView<double> d)
+    {
+      for (size_t i = 0; i < height; i++)
+        for (size_t k = firsti[i]; k < firsti[i+1]; k++)
+          values[k] *= d(i);
+    }
+
+    // A = A diag(d)
+    void ScaleCols (VectorView<double> d)
+    {
+      for (size_t k = 0; k < values.size(); k++)
+        values[k] *= d(colnr[k]);
+    }
+
+    // y = A x
+    void Mult (VectorView<double> x, VectorView<double> y) const
+    {
+      for (size_t i = 0; i < height; i++)
+        {
+          double sum = 0;
+          for (size_t k = firsti[i]; k < firsti[i+1]; k++)
+            sum += values[k] * x(colnr[k]);
+          y(i) = sum;
+        }
+    }
+
+    // copy the values at the pattern positions out of a dense matrix
+    void SetFromDense (MatrixView<double, ColMajor> a)
+    {
+      for (size_t i = 0; i < height; i++)
+        for (size_t k = firsti[i]; k < firsti[i+1]; k++)
+          values[k] = a(i, colnr[k]);
+    }
+
+    void ToDense (MatrixView<double, ColMajor> a) const
+    {
+      a = 0.0;
+      for (size_t i = 0; i < height; i++)
+        for (size_t k = firsti[i]; k < firsti[i+1]; k++)
+          a(i, colnr[k]) = values[k];
+    }
+  };
+
+
+  // df = a * b, the pattern of df must contain the product pattern
+  inline void SparseProduct (const SparseMatrix & a, const SparseMatrix & b, SparseMatrix & df)
+  {
+    df = 0.0;
+    for (size_t i = 0; i < a.Height(); i++)
+      for (size_t ka = a.First(i); ka < a.Next(i); ka++)
+        {
+          double aik = a.Value(ka);
+          if (aik == 0.0) continue;
+          size_t k = a.ColNr(ka);
+          for (size_t kb = b.First(k); kb < b.Next(k); kb++)
+            df(i, b.ColNr(kb)) += aik * b.Value(kb);
+        }
+  }
+
+
+
+  // Reverse Cuthill-McKee ordering of a graph given by its adjacency lists.
+  // returns order, with order[newnr] = oldnr
+  inline std::vector<size_t> ReverseCuthillMcKee (const std::vector<std::vector<size_t>> & graph)
+  {
+    size_t n = graph.size();
+    std::vector<size_t> order;
+    order.reserve(n);
+    std::vector<bool> visited(n, false);
+    auto degree = [&](size_t v) { return graph[v].size(); };
+
+    for (size_t start = 0; start < n; start++)
+      {
+        if (visited[start]) continue;
+
+        // start from a vertex of minimal degree in this component
+        std::vector<size_t> comp { start };
+        visited[start] = true;
+        for (size_t k = 0; k < comp.size(); k++)
+          for (size_t w : graph[comp[k]])
+            if (!visited[w])
+              {
+                visited[w] = true;
+                comp.push_back(w);
+              }
+        size_t root = *std::min_element(comp.begin(), comp.end(),
+                                        [&](size_t a, size_t b) { return degree(a) < degree(b); });
+        for (size_t v : comp) visited[v] = false;
+
+        size_t first = order.size();
+        order.push_back(root);
+        visited[root] = true;
+        std::vector<size_t> neighbours;
+        for (size_t k = first; k < order.size(); k++)
+          {
+            neighbours.clear();
+            for (size_t w : graph[order[k]])
+              if (!visited[w])
+                {
+                  visited[w] = true;
+                  neighbours.push_back(w);
+                }
+            std::sort(neighbours.begin(), neighbours.end(),
+                      [&](size_t a, size_t b) { return degree(a) < degree(b); });
+            order.insert(order.end(), neighbours.begin(), neighbours.end());
+          }
+      }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+
+}
+
+#endif
@@ -0,0 +1,637 @@
+#ifndef TAPE_H
+#define TAPE_H
+
+#include <map>
+#include <tuple>
+#include <vector>
+#include <memory>
+
+#include "nonlinfunc.h"
+
+
+namespace ASC_ode
+{
+
+  // A NonlinearFunction graph built from the combinators in nonlinfunc.h,
+  // flattened into a linear tape:
+  //  - nodes shared by pointer, or structurally equal (same operation on the
+  //    same children), are evaluated once
+  //  - all node values and Jacobian buffers are allocated once
+  //  - replay is a switch over opcodes, virtual calls only for leaf functions
+  //  - the Jacobian is accumulated with scalar weights through the linear nodes,
+  //    so every leaf Jacobian is evaluated once even if the leaf is shared
+  //  - every call sweeps the tape, leaves may have state (time, parameters)
+  //    which the tape does not see; EvaluateWithDeriv shares the sweep
+  //    between value and Jacobian
+  //  - EvaluateWithDeriv calls EvaluateWithDeriv of the leaf functions in the
+  //    forward sweep and accumulates from the stored leaf Jacobians
+  //  - diagonal leaves and outer functions (DiagonalFunction) add their
+  //    diagonal or scale rows, they have no Jacobian buffer
+  //  - ApplyDeriv propagates a direction through the tape, the leaves
+  //    only see ApplyDeriv, no Jacobian is formed
+  class CompiledFunction : public NonlinearFunction
+  {
+  public:
+    enum OPCODE { INPUT, CONSTANT, SUM, SCALE, COMPOSE, EMBED, PROJECT, LEAF };
+
+  private:
+    struct Node
+    {
+      OPCODE op;
+      size_t dimf;
+      size_t a = 0, b = 0;          // children
+      double faca = 0, facb = 0;
+      std::shared_ptr<NonlinearFunction> func;     // LEAF, EMBED, outer function of COMPOSE
+      std::shared_ptr<ConstantFunction> constant;
+      const DiagonalFunction * diag = nullptr;     // LEAF or outer of COMPOSE is diagonal
+      size_t first = 0, next = 0, firstx = 0;      // EMBED, PROJECT
+      bool affine = false;          // derivative is idfac * I
+      double idfac = 0;
+
+      std::unique_ptr<Vector<double>> value;
+      mutable std::unique_ptr<Vector<double>> tangent;   // ApplyDeriv
+      mutable std::unique_ptr<Matrix<double, ColMajor>> jac, jacb;
+      mutable std::unique_ptr<SparseMatrix> sparse_jac, sparse_jacb, sparse_prod;
+      mutable std::vector<double> weights;          // COMPOSE, for the inner Jacobian
+    };
+
+    size_t dimx;
+    std::vector<Node> nodes;        // children before parents, root is last
+    mutable std::vector<double> root_weights;
+    mutable size_t num_sweeps = 0;
+
+    using Key = std::tuple<int, size_t, size_t, double, double, const void*, const void*, size_t, size_t, size_t>;
+    std::map<const NonlinearFunction*, size_t> visited;
+    std::map<Key, size_t> structural;
+    std::map<const NonlinearFunction*, std::shared_ptr<NonlinearFunction>> compiled_outer;
+
+  public:
+    CompiledFunction (std::shared_ptr<NonlinearFunction> func)
+      : dimx(func->DimX())
+    {
+      Record(func);
+      for (auto & node : nodes)
+        {
+          node.value = std::make_unique<Vector<double>>(node.dimf);
+          if (node.op == COMPOSE)
+            node.weights.resize(nodes.size());
+        }
+      root_weights.resize(nodes.size());
+      visited.clear();
+      structural.clear();
+    }
+
+    size_t DimX() const override { return dimx; }
+    size_t DimF() const override { return nodes.back().dimf; }
+    size_t NumNodes() const { return nodes.size(); }
+    size_t NumSweeps() const { return num_sweeps; }
+
+    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      Forward(x);
+      f = *nodes.back().value;
+    }
+
+    void EvaluateDeriv (VectorView<double> x, MatrixView<double, ColMajor> df) const override
+    {
+      Forward(x);
+      df = 0.0;
+      Accumulate(nodes.size()-1, root_weights, df, 1.0, x, false);
+    }
+
+    SparsityPattern DerivPattern () const override
+    {
+      SparsityPattern pattern(DimF(), DimX());
+      AddPattern(nodes.size()-1, pattern);
+      return pattern;
+    }
+
+    void EvaluateSparseDeriv (VectorView<double> x, SparseMatrix & df) const override
+    {
+      Forward(x);
+      df = 0.0;
+      AccumulateSparse(nodes.size()-1, root_weights, df, 1.0, x, false);
+    }
+
+    void EvaluateWithDeriv (VectorView<double> x, VectorView<double> f,
+                            MatrixView<double, ColMajor> df) const override
+    {
+      Forward(x, DENSE_DERIV);
+      f = *nodes.back().value;
+      df = 0.0;
+      Accumulate(nodes.size()-1, root_weights, df, 1.0, x, true);
+    }
+
+    void EvaluateWithSparseDeriv (VectorView<double> x, VectorView<double> f,
+                                  SparseMatrix & df) const override
+    {
+      Forward(x, SPARSE_DERIV);
+      f = *nodes.back().value;
+      df = 0.0;
+      AccumulateSparse(nodes.size()-1, root_weights, df, 1.0, x, true);
+    }
+
+    void ApplyDeriv (VectorView<double> x, VectorView<double> v, VectorView<double> jv) const override
+    {
+      Forward(x);
+      for (auto & node : nodes)
+        {
+          if (!node.tangent)
+            node.tangent = std::make_unique<Vector<double>>(node.dimf);
+          auto & t = *node.tangent;
+          switch (node.op)
+            {
+            case INPUT:
+              t = v;
+              break;
+            case CONSTANT:
+              t = 0.0;
+              break;
+            case SUM:
+              {
+                auto & ta = *nodes[node.a].tangent;
+                auto & tb = *nodes[node.b].tangent;
+                for (size_t i = 0; i < node.dimf; i++)
+                  t(i) = node.faca*ta(i) + node.facb*tb(i);
+                break;
+              }
+            case SCALE:
+              {
+                auto & ta = *nodes[node.a].tangent;
+                for (size_t i = 0; i < node.dimf; i++)
+                  t(i) = node.faca*ta(i);
+                break;
+              }
+            case COMPOSE:
+              {
+                const Node & inner = nodes[node.b];
+                if (inner.affine && inner.idfac == 0.0)
+                  t = 0.0;
+                else
+                  node.func->ApplyDeriv(*inner.value, *inner.tangent, t);
+                break;
+              }
+            case EMBED:
+              {
+                size_t nx = node.func->DimX();
+                t = 0.0;
+                node.func->ApplyDeriv(x.Range(node.firstx, node.firstx+nx),
+                                      v.Range(node.firstx, node.firstx+nx),
+                                      t.Range(node.first, node.next));
+                break;
+              }
+            case PROJECT:
+              t = 0.0;
+              t.Range(node.first, node.next) = v.Range(node.first, node.next);
+              break;
+            case LEAF:
+              node.func->ApplyDeriv(x, v, t);
+              break;
+            }
+        }
+      jv = *nodes.back().tangent;
+    }
+
+  private:
+    size_t Record (std::shared_ptr<NonlinearFunction> func)
+    {
+      auto it = visited.find(func.get());
+      if (it != visited.end()) return it->second;
+
+      Node node;
+      node.dimf = func->DimF();
+      const void * funckey = nullptr;    // identifies the wrapped function in the structural key
+      if (dynamic_cast<IdentityFunction*>(func.get()))
+        {
+          node.op = INPUT;
+          node.affine = true;
+          node.idfac = 1;
+        }
+      else if (auto c = std::dynamic_pointer_cast<ConstantFunction>(func))
+        {
+          node.op = CONSTANT;
+          node.constant = c;
+          node.affine = true;
+        }
+      else if (auto sum = dynamic_cast<SumFunction*>(func.get()))
+        {
+          node.op = SUM;
+          node.a = Record(sum->FuncA());
+          node.b = Record(sum->FuncB());
+          node.faca = sum->FacA();
+          node.facb = sum->FacB();
+          node.affine = nodes[node.a].affine && nodes[node.b].affine;
+          node.idfac = node.faca*nodes[node.a].idfac + node.facb*nodes[node.b].idfac;
+        }
+      else if (auto scale = dynamic_cast<ScaleFunction*>(func.get()))
+        {
+          node.op = SCALE;
+          node.a = Record(scale->Func());
+          node.faca = scale->Factor();
+          node.affine = nodes[node.a].affine;
+          node.idfac = node.faca*nodes[node.a].idfac;
+        }
+      else if (auto comp = dynamic_cast<ComposeFunction*>(func.get()))
+        {
+          // the outer function sees a different input, it gets its own tape
+          node.op = COMPOSE;
+          node.b = Record(comp->Inner());
+          auto outer = comp->Outer();
+          if (!compiled_outer.count(outer.get()))
+            compiled_outer[outer.get()] = IsCombinator(*outer) ? std::make_shared<CompiledFunction>(outer) : outer;
+          node.func = compiled_outer[outer.get()];
+          node.diag = dynamic_cast<const DiagonalFunction*>(outer.get());
+          funckey = outer.get();
+        }
+      else if (auto embed = dynamic_cast<EmbedFunction*>(func.get()))
+        {
+          node.op = EMBED;
+          node.func = embed->Func();
+          funckey = node.func.get();
+          node.firstx = embed->FirstX();
+          node.first = embed->FirstF();
+          node.next = node.first + node.func->DimF();
+        }
+      else if (auto proj = dynamic_cast<Projector*>(func.get()))
+        {
+          node.op = PROJECT;
+          node.first = proj->First();
+          node.next = proj->Next();
+        }
+      else
+        {
+          node.op = LEAF;
+          node.func = func;
+          node.diag = dynamic_cast<const DiagonalFunction*>(func.get());
+          funckey = func.get();
+        }
+
+      Key key { node.op, node.a, node.b, node.faca, node.facb, funckey, node.constant.get(),
+                node.first, node.next, node.firstx };
+
+      size_t nr;
+      auto sit = structural.find(key);
+      if (sit != structural.end())
+        nr = sit->second;
+      else
+        {
+          nr = nodes.size();
+          nodes.push_back(std::move(node));
+          structural[key] = nr;
+        }
+      visited[func.get()] = nr;
+      return nr;
+    }
+
+    static bool IsCombinator (const NonlinearFunction & func)
+    {
+      return dynamic_cast<const SumFunction*>(&func) || dynamic_cast<const ScaleFunction*>(&func)
+        || dynamic_cast<const ComposeFunction*>(&func);
+    }
+
+    // leaf Jacobians, sized by the wrapped function
+    Matrix<double, ColMajor> & DenseJac (const Node & node) const
+    {
+      if (!node.jac)
+        node.jac = std::make_unique<Matrix<double, ColMajor>>(node.func->DimF(), node.func->DimX());
+      return *node.jac;
+    }
+
+    SparseMatrix & SparseJac (const Node & node) const
+    {
+      if (!node.sparse_jac)
+        node.sparse_jac = std::make_unique<SparseMatrix>(node.func->DerivPattern());
+      return *node.sparse_jac;
+    }
+
+    void EvaluateFunc (const Node & node, VectorView<double> xin, VectorView<double> v, DERIV_MODE deriv) const
+    {
+      switch (deriv)
+        {
+        case NO_DERIV: node.func->Evaluate(xin, v); break;
+        case DENSE_DERIV: node.func->EvaluateWithDeriv(xin, v, DenseJac(node)); break;
+        case SPARSE_DERIV: node.func->EvaluateWithSparseDeriv(xin, v, SparseJac(node)); break;
+        }
+    }
+
+    // values of all nodes, with deriv also the Jacobians of the leaf functions
+    void Forward (VectorView<double> x, DERIV_MODE deriv = NO_DERIV) const
+    {
+      num_sweeps++;
+
+      for (auto & node : nodes)
+        {
+          auto & v = *node.value;
+          switch (node.op)
+            {
+            case INPUT:
+              v = x;
+              break;
+            case CONSTANT:
+              v = node.constant->Get();
+              break;
+            case SUM:
+              {
+                auto & va = *nodes[node.a].value;
+                auto & vb = *nodes[node.b].value;
+                for (size_t i = 0; i < node.dimf; i++)
+                  v(i) = node.faca*va(i) + node.facb*vb(i);
+                break;
+              }
+            case SCALE:
+              {
+                auto & va = *nodes[node.a].value;
+                for (size_t i = 0; i < node.dimf; i++)
+                  v(i) = node.faca*va(i);
+                break;
+              }
+            case COMPOSE:
+              {
+                const Node & inner = nodes[node.b];
+                bool constinner = inner.affine && inner.idfac == 0.0;
+                EvaluateFunc(node, *inner.value, v, (constinner || node.diag) ? NO_DERIV : deriv);
+                break;
+              }
+            case EMBED:
+              v = 0.0;
+              EvaluateFunc(node, x.Range(node.firstx, node.firstx+node.func->DimX()),
+                           v.Range(node.first, node.next), deriv);
+              break;
+            case PROJECT:
+              v = 0.0;
+              v.Range(node.first, node.next) = x.Range(node.first, node.next);
+              break;
+            case LEAF:
+              EvaluateFunc(node, x, v, node.diag ? NO_DERIV : deriv);
+              break;
+            }
+        }
+    }
+
+    // target += fac * derivative of node 'root', after Forward.
+    // stored: leaf Jacobians were computed by Forward(x, DENSE_DERIV)
+    void Accumulate (size_t root, std::vector<double> & w,
+                     MatrixView<double, ColMajor> target, double fac, VectorView<double> x,
+                     bool stored) const
+    {
+      for (size_t k = 0; k <= root; k++) w[k] = 0;
+      w[root] = fac;
+
+      for (size_t k = root+1; k-- > 0; )
+        {
+          double wk = w[k];
+          if (wk == 0.0) continue;
+          const Node & node = nodes[k];
+          switch (node.op)
+            {
+            case INPUT:
+              for (size_t i = 0; i < node.dimf; i++)
+                target(i,i) += wk;
+              break;
+            case CONSTANT:
+              break;
+            case SUM:
+              w[node.a] += wk*node.faca;
+              w[node.b] += wk*node.facb;
+              break;
+            case SCALE:
+              w[node.a] += wk*node.faca;
+              break;
+            case PROJECT:
+              for (size_t i = node.first; i < node.next; i++)
+                target(i,i) += wk;
+              break;
+            case LEAF:
+              if (node.diag)
+                {
+                  AddDiag(wk, node.diag->Diagonal(), target);
+                  break;
+                }
+              if (!stored)
+                node.func->EvaluateDeriv(x, DenseJac(node));
+              AddScaled(wk, *node.jac, target, 0, 0);
+              break;
+            case EMBED:
+              {
+                size_t nx = node.func->DimX();
+                if (!stored)
+                  node.func->EvaluateDeriv(x.Range(node.firstx, node.firstx+nx), DenseJac(node));
+                AddScaled(wk, *node.jac, target, node.first, node.firstx);
+                break;
+              }
+            case COMPOSE:
+              {
+                const Node & inner = nodes[node.b];
+                if (inner.affine && inner.idfac == 0.0) break;
+                if (node.diag && inner.affine)
+                  {
+                    AddDiag(wk*inner.idfac, node.diag->Diagonal(), target);
+                    break;
+                  }
+                if (!stored && !node.diag)
+                  node.func->EvaluateDeriv(*inner.value, DenseJac(node));
+                if (inner.affine)
+                  {
+                    AddScaled(wk*inner.idfac, *node.jac, target, 0, 0);
+                    break;
+                  }
+                if (!node.jacb)
+                  node.jacb = std::make_unique<Matrix<double, ColMajor>>(inner.dimf, target.Width());
+                *node.jacb = 0.0;
+                Accumulate(node.b, node.weights, *node.jacb, 1.0, x, stored);
+                if (node.diag)
+                  {
+                    // rows of the inner Jacobian scaled, no product
+                    auto & d = node.diag->Diagonal();
+                    auto & jb = *node.jacb;
+                    for (size_t j = 0; j < jb.Width(); j++)
+                      for (size_t i = 0; i < jb.Height(); i++)
+                        target(i,j) += wk * d(i) * jb(i,j);
+                    break;
+                  }
+                auto & ja = *node.jac;
+                auto & jb = *node.jacb;
+                for (size_t j = 0; j < jb.Width(); j++)
+                  for (size_t l = 0; l < ja.Width(); l++)
+                    {
+                      double blj = wk * jb(l,j);
+                      if (blj == 0.0) continue;
+                      for (size_t i = 0; i < ja.Height(); i++)
+                        target(i,j) += ja(i,l) * blj;
+                    }
+                break;
+              }
+            }
+        }
+    }
+
+    template <typename TJAC>
+    static void AddDiag (double fac, const Vector<double> & d, TJAC & target)
+    {
+      for (size_t i = 0; i < d.Size(); i++)
+        target(i,i) += fac * d(i);
+    }
+
+    static void AddScaled (double fac, const Matrix<double, ColMajor> & a,
+                           MatrixView<double, ColMajor> target, size_t firstrow, size_t firstcol)
+    {
+      for (size_t j = 0; j < a.Width(); j++)
+        for (size_t i = 0; i < a.Height(); i++)
+          target(firstrow+i, firstcol+j) += fac * a(i,j);
+    }
+
+    // non-zero pattern of the derivative of node 'root'
+    void AddPattern (size_t root, SparsityPattern & pattern) const
+    {
+      std::vector<bool> reached(root+1, false);
+      reached[root] = true;
+      for (size_t k = root+1; k-- > 0; )
+        {
+          if (!reached[k]) continue;
+          const Node & node = nodes[k];
+          switch (node.op)
+            {
+            case INPUT:
+              pattern.AddDiag(0, node.dimf);
+              break;
+            case CONSTANT:
+              break;
+            case SUM:
+              reached[node.a] = reached[node.b] = true;
+              break;
+            case SCALE:
+              reached[node.a] = true;
+              break;
+            case PROJECT:
+              pattern.AddDiag(node.first, node.next);
+              break;
+            case LEAF:
+              pattern.Add(node.func->DerivPattern());
+              break;
+            case EMBED:
+              pattern.Add(node.func->DerivPattern(), node.first, node.firstx);
+              break;
+            case COMPOSE:
+              {
+                const Node & inner = nodes[node.b];
+                if (inner.affine)
+                  {
+                    if (inner.idfac != 0.0)
+                      pattern.Add(node.func->DerivPattern());
+                    break;
+                  }
+                pattern.Add(PatternProduct(node.func->DerivPattern(), InnerPattern(node)));
+                break;
+              }
+            }
+        }
+    }
+
+    SparsityPattern InnerPattern (const Node & node) const
+    {
+      SparsityPattern patb(nodes[node.b].dimf, dimx);
+      AddPattern(node.b, patb);
+      return patb;
+    }
+
+    void AccumulateSparse (size_t root, std::vector<double> & w,
+                           SparseMatrix & target, double fac, VectorView<double> x,
+                           bool stored) const
+    {
+      for (size_t k = 0; k <= root; k++) w[k] = 0;
+      w[root] = fac;
+
+      for (size_t k = root+1; k-- > 0; )
+        {
+          double wk = w[k];
+          if (wk == 0.0) continue;
+          const Node & node = nodes[k];
+          switch (node.op)
+            {
+            case INPUT:
+              for (size_t i = 0; i < node.dimf; i++)
+                target(i,i) += wk;
+              break;
+            case CONSTANT:
+              break;
+            case SUM:
+              w[node.a] += wk*node.faca;
+              w[node.b] += wk*node.facb;
+              break;
+            case SCALE:
+              w[node.a] += wk*node.faca;
+              break;
+            case PROJECT:
+              for (size_t i = node.first; i < node.next; i++)
+                target(i,i) += wk;
+              break;
+            case LEAF:
+              if (node.diag)
+                {
+                  AddDiag(wk, node.diag->Diagonal(), target);
+                  break;
+                }
+              if (!stored)
+                node.func->EvaluateSparseDeriv(x, SparseJac(node));
+              target.Add(wk, *node.sparse_jac);
+              break;
+            case EMBED:
+              {
+                size_t nx = node.func->DimX();
+                if (!stored)
+                  node.func->EvaluateSparseDeriv(x.Range(node.firstx, node.firstx+nx), SparseJac(node));
+                target.Add(wk, *node.sparse_jac, node.first, node.firstx);
+                break;
+              }
+            case COMPOSE:
+              {
+                const Node & inner = nodes[node.b];
+                if (inner.affine && inner.idfac == 0.0) break;
+                if (node.diag && inner.affine)
+                  {
+                    AddDiag(wk*inner.idfac, node.diag->Diagonal(), target);
+                    break;
+                  }
+                if (!stored && !node.diag)
+                  node.func->EvaluateSparseDeriv(*inner.value, SparseJac(node));
+                if (inner.affine)
+                  {
+                    target.Add(wk*inner.idfac, *node.sparse_jac);
+                    break;
+                  }
+                if (!node.sparse_jacb)
+                  {
+                    auto patb = InnerPattern(node);
+                    if (!node.diag)
+                      node.sparse_prod = std::make_unique<SparseMatrix>(PatternProduct(node.func->DerivPattern(), patb));
+                    node.sparse_jacb = std::make_unique<SparseMatrix>(patb);
+                  }
+                *node.sparse_jacb = 0.0;
+                AccumulateSparse(node.b, node.weights, *node.sparse_jacb, 1.0, x, stored);
+                if (node.diag)
+                  {
+                    auto & d = node.diag->Diagonal();
+                    auto & jb = *node.sparse_jacb;
+                    for (size_t i = 0; i < jb.Height(); i++)
+                      for (size_t k = jb.First(i); k < jb.Next(i); k++)
+                        target(i, jb.ColNr(k)) += wk * d(i) * jb.Value(k);
+                    break;
+                  }
+                SparseProduct(*node.sparse_jac, *node.sparse_jacb, *node.sparse_prod);
+                target.Add(wk, *node.sparse_prod);
+                break;
+              }
+            }
+        }
+    }
+  };
+
+
+  inline std::shared_ptr<CompiledFunction> Compile (std::shared_ptr<NonlinearFunction> func)
+  {
+    return std::make_shared<CompiledFunction>(func);
+  }
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+
+namespace ASC_ode
+{
+
+  // Persistent worker threads for parallel loops. The threads are started
+  // once and wait between the loops, so a ParallelFor per Newton iteration
+  // or per colour of an assembly is cheap.
+  // The calling thread takes part as thread 0. Loops must not be nested,
+  // and one pool must not be used from several threads at the same time.
+  class ThreadPool
+  {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+    size_t generation = 0;     // counts the loops, wakes up the workers
+    size_t running = 0;        // workers still busy with the current loop
+    bool stop = false;
+
+    const std::function<void(size_t)> * task = nullptr;
+    size_t task_size = 0;
+    std::exception_ptr error;
+
+  public:
+    // num_threads including the calling thread
+    explicit ThreadPool (size_t num_threads)
+    {
+      for (size_t tid = 1; tid < std::max<size_t>(num_threads, 1); tid++)
+        workers.emplace_back([this, tid] { Worker(tid); });
+    }
+
+    ThreadPool (const ThreadPool &) = delete;
+    ThreadPool & operator= (const ThreadPool &) = delete;
+
+    ~ThreadPool ()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      start_cv.notify_all();
+      for (auto & w : workers)
+        w.join();
+    }
+
+    size_t NumThreads () const { return workers.size()+1; }
+
+    // func(i) for i = 0 ... n-1. Thread tid does the contiguous chunk
+    // [tid*n/N, (tid+1)*n/N), so the split depends only on n and N.
+    // Returns when all are done, the first exception is rethrown
+    void ParallelFor (size_t n, const std::function<void(size_t)> & func)
+    {
+      if (workers.empty() || n <= 1)
+        {
+          for (size_t i = 0; i < n; i++)
+            func(i);
+          return;
+        }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &func;
+        task_size = n;
+        error = nullptr;
+        running = workers.size();
+        generation++;
+      }
+      start_cv.notify_all();
+
+      RunChunk(0);
+
+      std::unique_lock<std::mutex> lock(mutex);
+      done_cv.wait(lock, [this] { return running == 0; });
+      task = nullptr;
+      if (error)
+        std::rethrow_exception(error);
+    }
+
+  private:
+    void RunChunk (size_t tid)
+    {
+      size_t num = NumThreads();
+      size_t first = tid*task_size/num, next = (tid+1)*task_size/num;
+      try
+        {
+          for (size_t i = first; i < next; i++)
+            (*task)(i);
+        }
+      catch (...)
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) error = std::current_exception();
+        }
+    }
+
+    void Worker (size_t tid)
+    {
+      size_t seen = 0;
+      while (true)
+        {
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [this, seen] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+          }
+
+          RunChunk(tid);
+
+          bool last;
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            last = (--running == 0);
+          }
+          if (last) done_cv.notify_one();
+        }
+    }
+  };
+
+}
+
+#endif
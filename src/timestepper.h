@@ -0,0 +1,713 @@
+#ifndef TIMESTEPPER_H
+#define TIMESTEPPER_H
+
+#include <cmath>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+#include "Newton.h"
+#include "funcexpr.h"
+#include "tape.h"
+
+
+namespace ASC_ode
+{
+
+  // Time integrators as objects. The step equations, the Newton state with
+  // the factored Jacobian and the previous step live in the stepper, so
+  // stepping in small chunks costs the same as one long run.
+  // The equations are rebuilt only if the step size changes.
+  //
+  //   stepper.Init(state...);        initial values, t0
+  //   stepper.Step(dt);              one step
+  //   stepper.SetStepSize(dt);
+  //   stepper.Advance(tend);         equal steps of at most dt up to tend
+  //
+  // If Newton fails, Advance and StepWithRetry repeat the step with half the
+  // step size (at most max_halvings times) and grow back to the full step
+  // after two successful steps.
+  class TimeStepper
+  {
+  protected:
+    NewtonOptions newton;
+    NewtonState newton_state;
+    NewtonStatistics newton_stats;
+    double t = 0;
+    double dt_built = 0;       // step size of the current equations, 0 if none
+    double dt_max = 0;         // step size for Advance
+    int max_halvings = 10;
+    int halvings = 0;          // current reduction of the step size
+
+    // build the step equations for step size dt
+    virtual void Build (double dt) = 0;
+    // one step from t to t+dt, with the equations built for dt
+    virtual void DoStep (double dt) = 0;
+    // undo a DoStep which failed with an exception, the default is for
+    // methods which change their state only after the Newton solve
+    virtual void Reject () { }
+
+    // new initial values: the step equations stay, the Jacobian does not
+    void Restart (double t0)
+    {
+      t = t0;
+      halvings = 0;
+      newton_state.Reset();
+    }
+
+    bool TryStep (double dt)
+    {
+      double t0 = t;
+      try
+        {
+          Step(dt);
+          return true;
+        }
+      catch (std::domain_error &)
+        {
+          t = t0;
+          Reject();
+          newton_state.Reset();
+          newton_stats.rejected++;
+          return false;
+        }
+    }
+
+  public:
+    TimeStepper (const NewtonOptions & _newton) : newton(_newton) { }
+    virtual ~TimeStepper() = default;
+
+    // y for first order, the position x for second order systems
+    virtual VectorView<double> Solution() = 0;
+
+    double Time() const { return t; }
+    void SetStepSize (double dt) { dt_max = dt; }
+    double StepSize () const { return dt_max; }
+    // 0: a failing Newton solve throws instead of reducing the step size
+    void SetMaxHalvings (int m) { max_halvings = std::max(0, std::min(m, 30)); }
+    const NewtonState & GetNewtonState() const { return newton_state; }
+    const NewtonStatistics & GetNewtonStatistics() const { return newton_stats; }
+    void ResetStatistics() { newton_stats = NewtonStatistics(); }
+
+    void Step (double dt)
+    {
+      if (dt != dt_built)
+        {
+          Build(dt);
+          dt_built = dt;
+          newton_state.Reset();
+        }
+      size_t its = newton_state.num_iterations;
+      DoStep(dt);
+      newton_stats.Add(newton_state.num_iterations - its);
+      t += dt;
+    }
+
+    // one step from t to t+dt, done in substeps of dt/2^k where Newton fails
+    void StepWithRetry (double dt)
+    {
+      // position within the step, in units of dt / 2^max_halvings
+      long unit = 1L << max_halvings;
+      long pos = 0;
+      int good = 0;
+      double t0 = t;
+      halvings = std::min(halvings, max_halvings);
+      while (pos < unit)
+        {
+          long len = unit >> halvings;
+          if (TryStep(dt * len / unit))
+            {
+              pos += len;
+              good++;
+              if (good >= 2 && halvings > 0 && pos % (2*len) == 0)
+                {
+                  halvings--;
+                  good = 0;
+                }
+            }
+          else
+            {
+              if (halvings == max_halvings)
+                throw std::domain_error("TimeStepper: Newton failed with the smallest step size");
+              halvings++;
+              good = 0;
+            }
+        }
+      t = t0 + dt;
+    }
+
+    // the interval is divided into equal steps of at most StepSize(),
+    // chunks of the same length reuse the built equations
+    virtual void Advance (double tend, std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      if (dt_max <= 0)
+        throw std::domain_error("TimeStepper::Advance: no step size set");
+      double span = tend - t;
+      if (span <= 0) return;
+
+      int steps = std::max(1, int(std::ceil(span/dt_max * (1-1e-12))));
+      double dt = span / steps;
+      if (std::fabs(dt-dt_built) <= 1e-12 * dt)
+        dt = dt_built;
+
+      for (int i = 0; i < steps; i++)
+        {
+          StepWithRetry(dt);
+          if (i == steps-1) t = tend;
+          if (callback) callback(t, Solution());
+        }
+    }
+  };
+
+
+
+  // initial guess for the Newton solver of the next step: the polynomial
+  // through the unknowns of the last order+1 steps, evaluated at the new time.
+  // The past steps may have different sizes.
+  class ExtrapolationPredictor
+  {
+    size_t n;
+    int order;
+    std::vector<double> hist;    // past values, newest first
+    std::vector<double> thist;
+    int nhist = 0;
+  public:
+    ExtrapolationPredictor (size_t _n, int _order)
+      : n(_n), order(std::max(0, _order)), hist((order+1)*_n), thist(order+1) { }
+
+    int Order() const { return order; }
+    void Clear() { nhist = 0; }
+
+    void Push (double t, VectorView<double> x)
+    {
+      int m = std::min(nhist, order);
+      for (int j = m; j > 0; j--)
+        {
+          thist[j] = thist[j-1];
+          std::copy_n(hist.data()+(j-1)*n, n, hist.data()+j*n);
+        }
+      thist[0] = t;
+      for (size_t l = 0; l < n; l++)
+        hist[l] = x(l);
+      nhist = m+1;
+    }
+
+    // false if there is no history, x is not changed then
+    bool Predict (double t, VectorView<double> x) const
+    {
+      if (nhist == 0) return false;
+      for (size_t l = 0; l < n; l++)
+        x(l) = 0;
+      for (int j = 0; j < nhist; j++)
+        {
+          double lj = 1;
+          for (int i = 0; i < nhist; i++)
+            if (i != j)
+              lj *= (t - thist[i]) / (thist[j] - thist[i]);
+          for (size_t l = 0; l < n; l++)
+            x(l) += lj * hist[j*n+l];
+        }
+      return true;
+    }
+  };
+
+
+
+  // explicit Euler method for dy/dt = rhs(y)
+  class ExplicitEuler : public TimeStepper
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    Vector<double> y, f;
+  protected:
+    void Build (double dt) override { }
+    void DoStep (double dt) override
+    {
+      rhs->Evaluate(y, f);
+      for (size_t i = 0; i < y.Size(); i++)
+        y(i) += dt * f(i);
+    }
+  public:
+    ExplicitEuler (std::shared_ptr<NonlinearFunction> _rhs)
+      : TimeStepper(NewtonOptions()), rhs(_rhs), y(_rhs->DimX()), f(_rhs->DimF()) { }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      Restart(t0);
+    }
+    VectorView<double> Solution() override { return y; }
+  };
+
+
+
+  // implicit Euler method for dy/dt = rhs(y)
+  class ImplicitEuler : public TimeStepper
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    Vector<double> y;
+    std::shared_ptr<ConstantFunction> yold;
+    std::shared_ptr<NonlinearFunction> equ;
+    ExtrapolationPredictor predictor;
+  protected:
+    void Build (double dt) override
+    {
+      auto ynew = std::make_shared<IdentityFunction>(y.Size());
+      equ = Compile(ynew-yold - dt * rhs);
+    }
+    void DoStep (double dt) override
+    {
+      predictor.Predict(t+dt, y);
+      NewtonSolver (equ, y, newton, newton_state);
+      yold->Set(y);
+      predictor.Push(t+dt, y);
+    }
+    void Reject () override { y = yold->Get(); }
+  public:
+    ImplicitEuler (std::shared_ptr<NonlinearFunction> _rhs,
+                   const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), y(_rhs->DimX()),
+        yold(std::make_shared<ConstantFunction>(y)),
+        predictor(_rhs->DimX(), _newton.predictor) { }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      yold->Set(y);
+      Restart(t0);
+      predictor.Clear();
+      predictor.Push(t0, y);
+    }
+    VectorView<double> Solution() override { return y; }
+  };
+
+
+
+  // Crank-Nicolson for dy/dt = rhs(y)
+  class CrankNicolson : public TimeStepper
+  {
+    std::shared_ptr<NonlinearFunction> rhs;
+    Vector<double> y, rhs_old_eval;
+    std::shared_ptr<ConstantFunction> yold, rhs_old;
+    std::shared_ptr<NonlinearFunction> equ;
+    ExtrapolationPredictor predictor;
+  protected:
+    void Build (double dt) override
+    {
+      auto ynew = std::make_shared<IdentityFunction>(y.Size());
+      equ = Compile(ynew - yold - (dt / 2.0) * (rhs + rhs_old));
+    }
+    void DoStep (double dt) override
+    {
+      predictor.Predict(t+dt, y);
+      NewtonSolver (equ, y, newton, newton_state);
+      yold->Set(y);
+      rhs->Evaluate(y, rhs_old_eval);
+      rhs_old->Set(rhs_old_eval);
+      predictor.Push(t+dt, y);
+    }
+    void Reject () override { y = yold->Get(); }
+  public:
+    CrankNicolson (std::shared_ptr<NonlinearFunction> _rhs,
+                   const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), y(_rhs->DimX()), rhs_old_eval(_rhs->DimF()),
+        yold(std::make_shared<ConstantFunction>(y)),
+        rhs_old(std::make_shared<ConstantFunction>(rhs_old_eval)),
+        predictor(_rhs->DimX(), _newton.predictor) { }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      yold->Set(y);
+      rhs->Evaluate(y, rhs_old_eval);
+      rhs_old->Set(rhs_old_eval);
+      Restart(t0);
+      predictor.Clear();
+      predictor.Push(t0, y);
+    }
+    VectorView<double> Solution() override { return y; }
+  };
+
+
+
+  // a_ij = 0 for j >= i: the stages can be evaluated one after the other
+  inline bool IsExplicitTableau (const Matrix<double, ColMajor> & A)
+  {
+    for (size_t i = 0; i < A.Height(); i++)
+      for (size_t j = i; j < A.Width(); j++)
+        if (A(i,j) != 0.0) return false;
+    return true;
+  }
+
+  // a_ij = 0 for j > i: every stage is an equation of the size of y
+  inline bool IsDiagonallyImplicitTableau (const Matrix<double, ColMajor> & A)
+  {
+    for (size_t i = 0; i < A.Height(); i++)
+      for (size_t j = i+1; j < A.Width(); j++)
+        if (A(i,j) != 0.0) return false;
+    return true;
+  }
+
+
+  // Runge-Kutta method given by its Butcher tableau (A, b).
+  // The structure of A decides how the stages are computed:
+  //   explicit:             one rhs evaluation per stage, no Newton
+  //   diagonally implicit:  one Newton solve of size n per stage
+  //   fully implicit:       all stages are solved together with Newton
+  class RungeKutta : public TimeStepper
+  {
+  public:
+    enum TYPE { EXPLICIT, DIAGONALLY_IMPLICIT, IMPLICIT };
+  private:
+    std::shared_ptr<NonlinearFunction> rhs;
+    Matrix<double, ColMajor> A;
+    Vector<double> b;
+    size_t s, n;
+    TYPE type;
+    Vector<double> y, k, ystage;
+    // fully implicit: the coupled system for all stages
+    std::shared_ptr<ConstantFunction> yold;
+    std::vector<std::shared_ptr<NonlinearFunction>> funs;   // referenced by the BlockFunction
+    std::shared_ptr<NonlinearFunction> equ;
+    // diagonally implicit: k_i - rhs(ybase + dt a_ii k_i) = 0, stages with
+    // the same a_ii share their equation
+    std::shared_ptr<ConstantFunction> ybase;
+    std::vector<std::shared_ptr<NonlinearFunction>> stage_equ;
+    NonlinearFunction * factored_equ = nullptr;   // equation of the factorization in newton_state
+    // stages of the last steps, extrapolated to the new step
+    ExtrapolationPredictor predictor;
+  protected:
+    void Build (double dt) override
+    {
+      if (type == EXPLICIT) return;
+
+      if (type == DIAGONALLY_IMPLICIT)
+        {
+          auto kvar = std::make_shared<IdentityFunction>(n);
+          for (size_t i = 0; i < s; i++)
+            {
+              stage_equ[i] = nullptr;
+              if (A(i,i) == 0.0) continue;
+              for (size_t j = 0; j < i; j++)
+                if (A(j,j) == A(i,i))
+                  {
+                    stage_equ[i] = stage_equ[j];
+                    break;
+                  }
+              if (!stage_equ[i])
+                stage_equ[i] = Compile(kvar - Compose(rhs, ybase + (dt*A(i,i)) * kvar));
+            }
+          factored_equ = nullptr;
+          return;
+        }
+
+      auto kvar = std::make_shared<IdentityFunction>(n * s);
+      std::vector<std::shared_ptr<NonlinearFunction>> newfuns(s);
+      for (size_t i = 0; i < s; i++)
+        {
+          auto tmp = std::make_shared<BlockMatVec>(A, kvar, i);
+          newfuns[i] = Compose(rhs, yold + dt * tmp);
+        }
+      auto block_f = std::make_shared<BlockFunction>(s, newfuns.data());
+      equ = Compile(kvar - block_f);
+      funs = std::move(newfuns);
+    }
+
+    void DoStep (double dt) override
+    {
+      // without predictor every stage starts from the explicit value
+      bool predicted = type != EXPLICIT && newton.predictor > 0 && predictor.Predict(t, k);
+      if (type == IMPLICIT)
+        {
+          if (!predicted)
+            for (size_t j = 0; j < s; j++)
+              rhs->Evaluate(y, k.Range(j * n, (j+1) * n));
+          NewtonSolver (equ, k, newton, newton_state);
+        }
+      else
+        for (size_t i = 0; i < s; i++)
+          {
+            // ystage = y + dt sum_{j<i} a_ij k_j
+            for (size_t l = 0; l < n; l++)
+              ystage(l) = y(l);
+            for (size_t j = 0; j < i; j++)
+              if (A(i,j) != 0.0)
+                for (size_t l = 0; l < n; l++)
+                  ystage(l) += dt * A(i,j) * k(j*n+l);
+
+            auto ki = k.Range(i*n, (i+1)*n);
+            if (type == EXPLICIT || !stage_equ[i])
+              {
+                rhs->Evaluate(ystage, ki);
+                continue;
+              }
+            if (!predicted)
+              rhs->Evaluate(ystage, ki);
+
+            // the factorization belongs to the stage equation
+            if (stage_equ[i].get() != factored_equ)
+              {
+                newton_state.Reset();
+                factored_equ = stage_equ[i].get();
+              }
+            ybase->Set(ystage);
+            NewtonSolver (stage_equ[i], ki, newton, newton_state);
+          }
+
+      for (size_t i = 0; i < n; i++)
+        {
+          double incr = 0;
+          for (size_t l = 0; l < s; l++)
+            incr += b(l) * k(l*n+i);
+          y(i) += dt * incr;
+        }
+      if (yold)
+        yold->Set(y);
+      if (type != EXPLICIT && newton.predictor > 0)
+        predictor.Push(t, k);
+    }
+  public:
+    RungeKutta (std::shared_ptr<NonlinearFunction> _rhs,
+                Matrix<double, ColMajor> _A, Vector<double> _b,
+                const NewtonOptions & _newton = NewtonOptions())
+      : TimeStepper(_newton), rhs(_rhs), A(_A), b(_b),
+        s(_b.Size()), n(_rhs->DimX()),
+        type(IsExplicitTableau(_A) ? EXPLICIT :
+             IsDiagonallyImplicitTableau(_A) ? DIAGONALLY_IMPLICIT : IMPLICIT),
+        y(n), k(n*s), ystage(n), stage_equ(s), predictor(n*s, _newton.predictor)
+    {
+      if (type == IMPLICIT)
+        yold = std::make_shared<ConstantFunction>(y, n*s);
+      if (type == DIAGONALLY_IMPLICIT)
+        ybase = std::make_shared<ConstantFunction>(y, n);
+    }
+
+    void Init (VectorView<double> y0, double t0 = 0)
+    {
+      y = y0;
+      if (yold) yold->Set(y);
+      Restart(t0);
+      predictor.Clear();
+    }
+    VectorView<double> Solution() override { return y; }
+    TYPE Type() const { return type; }
+  };
+
+
+
+  // second order systems: position, velocity and acceleration are the state
+  class SecondOrderStepper : public TimeStepper
+  {
+  protected:
+    Vector<double> x, v, a;
+  public:
+    SecondOrderStepper (size_t n, const NewtonOptions & _newton)
+      : TimeStepper(_newton), x(n), v(n), a(n) { }
+
+    // restart from a full state. Methods for which the acceleration
+    // is not a state recompute it from x
+    virtual void Init (VectorView<double> x0, VectorView<double> dx0, VectorView<double> ddx0,
+                       double t0 = 0) = 0;
+
+    VectorView<double> Solution() override { return x; }
+    VectorView<double> X() { return x; }
+    VectorView<double> V() { return v; }
+    VectorView<double> A() { return a; }
+  };
+
+
+
+  // Newmark and generalized alpha:
+  // https://miaodi.github.io/finite%20element%20method/newmark-generalized/
+
+  // Newmark method for  mass*d^2x/dt^2 = rhs
+  class Newmark : public SecondOrderStepper
+  {
+  protected:
+    std::shared_ptr<NonlinearFunction> rhs, mass;
+    std::shared_ptr<ConstantFunction> xold, vold, aold;
+    std::shared_ptr<NonlinearFunction> equ, xnew, vnew;
+    double gamma = 0.5, beta = 0.25;
+    ExtrapolationPredictor predictor;    // for the acceleration
+
+    void Build (double dt) override
+    {
+      // statically typed expressions, evaluated in fused loops
+      auto anew = Var(a.Size());
+      vnew = MakeFunction(Const(vold) + dt*((1-gamma)*Const(aold)+gamma*anew));
+      auto xnew_expr = Const(xold) + dt*Const(vold) + dt*dt/2 * ((1-2*beta)*Const(aold)+2*beta*anew);
+      xnew = MakeFunction(xnew_expr);
+      equ = MakeFunction(Compose(mass, anew) - Compose(rhs, xnew_expr));
+    }
+    void DoStep (double dt) override
+    {
+      predictor.Predict(t+dt, a);
+      NewtonSolver (equ, a, newton, newton_state);
+      xnew -> Evaluate (a, x);
+      vnew -> Evaluate (a, v);
+      xold->Set(x);
+      vold->Set(v);
+      aold->Set(a);
+      predictor.Push(t+dt, a);
+    }
+    void Reject () override { a = aold->Get(); }
+  public:
+    Newmark (std::shared_ptr<NonlinearFunction> _rhs,
+             std::shared_ptr<NonlinearFunction> _mass,
+             const NewtonOptions & _newton = NewtonOptions())
+      : SecondOrderStepper(_rhs->DimX(), _newton), rhs(_rhs), mass(_mass),
+        xold(std::make_shared<ConstantFunction>(x)),
+        vold(std::make_shared<ConstantFunction>(v)),
+        aold(std::make_shared<ConstantFunction>(a)),
+        predictor(_rhs->DimX(), _newton.predictor) { }
+
+    // the initial acceleration is M^{-1} rhs(x) for a diagonal mass,
+    // otherwise the mass is assumed to be the identity
+    void Init (VectorView<double> x0, VectorView<double> dx0, double t0 = 0)
+    {
+      rhs->Evaluate(x0, a);
+      if (auto diag = dynamic_cast<const DiagonalFunction*>(mass.get()))
+        for (size_t i = 0; i < a.Size(); i++)
+          a(i) /= diag->Diagonal()(i);
+      Init(x0, dx0, a, t0);
+    }
+
+    // the acceleration is a state of the method and is kept between steps
+    void Init (VectorView<double> x0, VectorView<double> dx0, VectorView<double> ddx0,
+               double t0 = 0) override
+    {
+      x = x0;
+      v = dx0;
+      a = ddx0;
+      xold->Set(x);
+      vold->Set(v);
+      aold->Set(a);
+      Restart(t0);
+      predictor.Clear();
+      predictor.Push(t0, a);
+    }
+  };
+
+
+
+  // Generalized alpha method for M d^2x/dt^2 = rhs
+  class GeneralizedAlpha : public Newmark
+  {
+    double alpham, alphaf;
+  protected:
+    void Build (double dt) override
+    {
+      auto anew = Var(a.Size());
+      vnew = MakeFunction(Const(vold) + dt*((1-gamma)*Const(aold)+gamma*anew));
+      auto xnew_expr = Const(xold) + dt*Const(vold) + dt*dt/2 * ((1-2*beta)*Const(aold)+2*beta*anew);
+      xnew = MakeFunction(xnew_expr);
+
+      // equ = Compose(mass, (1-alpham)*anew+alpham*aold) - Compose(rhs, (1-alphaf)*xnew+alphaf*xold);
+      equ = MakeFunction(Compose(mass, (1-alpham)*anew+alpham*Const(aold))
+                         - (1-alphaf)*Compose(rhs,xnew_expr) - alphaf*Compose(rhs, Const(xold)));
+    }
+  public:
+    GeneralizedAlpha (std::shared_ptr<NonlinearFunction> _rhs,
+                      std::shared_ptr<NonlinearFunction> _mass,
+                      double rhoinf,
+                      const NewtonOptions & _newton = NewtonOptions())
+      : Newmark(_rhs, _mass, _newton)
+    {
+      alpham = (2*rhoinf-1)/(rhoinf+1);
+      alphaf = rhoinf/(rhoinf+1);
+      gamma = 0.5-alpham+alphaf;
+      beta = 0.25 * (1-alpham+alphaf)*(1-alpham+alphaf);
+    }
+  };
+
+
+
+  // explicit symplectic methods for x'' = acc(x), e.g. force/mass of a
+  // mass-spring system. No equations and no Jacobian, only evaluations of
+  // acc: cheap steps for large non-stiff systems, stable for dt < 2/omega_max.
+  // The energy error stays bounded over long runs.
+
+  // velocity Verlet (kick-drift-kick), order 2, one evaluation per step
+  class VelocityVerlet : public SecondOrderStepper
+  {
+  protected:
+    std::shared_ptr<NonlinearFunction> acc;
+
+    void Build (double dt) override { }
+    void DoStep (double dt) override { KickDriftKick(dt); }
+
+    // a = acc(x) on entry and on exit
+    void KickDriftKick (double dt)
+    {
+      size_t n = x.Size();
+      for (size_t i = 0; i < n; i++)
+        {
+          v(i) += dt/2 * a(i);
+          x(i) += dt * v(i);
+        }
+      acc->Evaluate(x, a);
+      for (size_t i = 0; i < n; i++)
+        v(i) += dt/2 * a(i);
+    }
+  public:
+    VelocityVerlet (std::shared_ptr<NonlinearFunction> _acc)
+      : SecondOrderStepper(_acc->DimX(), NewtonOptions()), acc(_acc) { }
+
+    void Init (VectorView<double> x0, VectorView<double> dx0, double t0 = 0)
+    {
+      x = x0;
+      v = dx0;
+      acc->Evaluate(x, a);
+      Restart(t0);
+    }
+    // ddx0 is not used, the acceleration is acc(x)
+    void Init (VectorView<double> x0, VectorView<double> dx0, VectorView<double> ddx0,
+               double t0 = 0) override
+    {
+      Init(x0, dx0, t0);
+    }
+  };
+
+
+  // leapfrog (drift-kick-drift), order 2, one evaluation per step.
+  // A() is the acceleration at the midpoint of the last step
+  class Leapfrog : public VelocityVerlet
+  {
+  protected:
+    void DoStep (double dt) override
+    {
+      size_t n = x.Size();
+      for (size_t i = 0; i < n; i++)
+        x(i) += dt/2 * v(i);
+      acc->Evaluate(x, a);
+      for (size_t i = 0; i < n; i++)
+        {
+          v(i) += dt * a(i);
+          x(i) += dt/2 * v(i);
+        }
+    }
+  public:
+    using VelocityVerlet::VelocityVerlet;
+  };
+
+
+  // Yoshida's fourth order composition of three velocity Verlet steps,
+  // three evaluations per step
+  class Yoshida4 : public VelocityVerlet
+  {
+  protected:
+    void DoStep (double dt) override
+    {
+      double cbrt2 = std::cbrt(2.0);
+      double w1 = 1 / (2-cbrt2);
+      double w0 = -cbrt2 / (2-cbrt2);
+      KickDriftKick(w1*dt);
+      KickDriftKick(w0*dt);
+      KickDriftKick(w1*dt);
+    }
+  public:
+    using VelocityVerlet::VelocityVerlet;
+  };
+
+}
+
+#endif
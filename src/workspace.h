@@ -0,0 +1,127 @@
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <../ASC-bla/src/vector.h>
+#include <../ASC-bla/src/matrix.h>
+
+
+namespace ASC_ode
+{
+  using namespace ASC_bla;
+
+  // Bump allocator for the temporaries of Evaluate / EvaluateDeriv.
+  // Memory is taken from chunks which are kept when released, so after
+  // the first Newton iteration no more heap allocations happen.
+  // Usage is stack-like: open a WorkspaceScope, take vectors and matrices,
+  // everything is given back when the scope ends.
+  class Workspace
+  {
+    std::vector<std::unique_ptr<double[]>> chunks;
+    std::vector<size_t> chunksize;
+    size_t chunk = 0;          // current chunk
+    size_t used = 0;           // doubles used in the current chunk
+    size_t num_allocations = 0;
+    size_t peak = 0, inuse = 0;
+
+  public:
+    struct Mark { size_t chunk, used, inuse; };
+
+    Workspace () = default;
+    Workspace (const Workspace &) = delete;
+    Workspace & operator= (const Workspace &) = delete;
+
+    double * Alloc (size_t n)
+    {
+      // skip chunks which are too small for the request
+      while (chunk < chunks.size() && used + n > chunksize[chunk])
+        {
+          chunk++;
+          used = 0;
+        }
+      if (chunk == chunks.size())
+        {
+          size_t size = std::max<size_t> (n, chunks.empty() ? 4096 : 2*chunksize.back());
+          chunks.push_back(std::make_unique<double[]>(size));
+          chunksize.push_back(size);
+          num_allocations++;
+        }
+      double * ptr = chunks[chunk].get() + used;
+      used += n;
+      inuse += n;
+      peak = std::max(peak, inuse);
+      return ptr;
+    }
+
+    VectorView<double> Vec (size_t n) { return VectorView<double>(n, Alloc(n)); }
+    MatrixView<double, ColMajor> Mat (size_t h, size_t w)
+    {
+      return MatrixView<double, ColMajor>(h, w, Alloc(h*w));
+    }
+
+    Mark GetMark () const { return { chunk, used, inuse }; }
+    void Release (Mark mark)
+    {
+      chunk = mark.chunk;
+      used = mark.used;
+      inuse = mark.inuse;
+    }
+
+    // everything is released. If the memory was spread over several chunks,
+    // they are merged into one chunk big enough for the peak usage
+    void Reset ()
+    {
+      chunk = used = inuse = 0;
+      if (chunks.size() > 1)
+        {
+          size_t total = std::max(peak, chunksize.back());
+          chunks.clear();
+          chunksize.clear();
+          chunks.push_back(std::make_unique<double[]>(total));
+          chunksize.push_back(total);
+          num_allocations++;
+        }
+    }
+
+    // doubles currently taken, 0 if no scope is open
+    size_t InUse () const { return inuse; }
+    // number of heap allocations done by the workspace so far
+    size_t NumAllocations () const { return num_allocations; }
+    size_t Capacity () const
+    {
+      size_t sum = 0;
+      for (auto s : chunksize) sum += s;
+      return sum;
+    }
+  };
+
+  // one workspace per thread, shared by all functions evaluated in this thread
+  inline Workspace & LocalWorkspace ()
+  {
+    static thread_local Workspace ws;
+    return ws;
+  }
+
+  // gives back all temporaries taken after its construction
+  class WorkspaceScope
+  {
+    Workspace & ws;
+    Workspace::Mark mark;
+  public:
+    WorkspaceScope (Workspace & _ws = LocalWorkspace())
+      : ws(_ws), mark(_ws.GetMark()) { }
+    ~WorkspaceScope () { ws.Release(mark); }
+    WorkspaceScope (const WorkspaceScope &) = delete;
+    WorkspaceScope & operator= (const WorkspaceScope &) = delete;
+
+    double * Alloc (size_t n) { return ws.Alloc(n); }
+    VectorView<double> Vec (size_t n) { return ws.Vec(n); }
+    MatrixView<double, ColMajor> Mat (size_t h, size_t w) { return ws.Mat(h, w); }
+  };
+
+}
+
+#endif